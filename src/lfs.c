@@ -41,6 +41,64 @@ static inline void lfs_cache_zero(lfs_t *lfs, lfs_cache_t *pcache) {
     pcache->block = LFS_BLOCK_NULL;
 }
 
+#ifdef LFS_RCACHE_WAYS
+static struct lfs_rline *lfs_rcache_set(lfs_t *lfs, lfs_block_t block) {
+    return &lfs->rlines.lines[(block % LFS_RCACHE_SETS)*LFS_RCACHE_WAYS];
+}
+
+static struct lfs_rline *lfs_rcache_lookup(lfs_t *lfs,
+        lfs_block_t block, lfs_off_t off) {
+    struct lfs_rline *set = lfs_rcache_set(lfs, block);
+    for (int i = 0; i < LFS_RCACHE_WAYS; i++) {
+        if (set[i].c.block == block && off >= set[i].c.off &&
+                off < set[i].c.off + set[i].c.size) {
+            return &set[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct lfs_rline *lfs_rcache_victim(lfs_t *lfs, lfs_block_t block) {
+    struct lfs_rline *set = lfs_rcache_set(lfs, block);
+    struct lfs_rline *line = &set[0];
+    for (int i = 1; i < LFS_RCACHE_WAYS; i++) {
+        if (set[i].used < line->used) {
+            line = &set[i];
+        }
+    }
+
+    return line;
+}
+
+static int lfs_rcache_load(lfs_t *lfs, struct lfs_rline *line,
+        lfs_block_t block, lfs_off_t off, lfs_size_t size) {
+    line->c.block = block;
+    line->c.off = off;
+    line->c.size = size;
+    line->used = ++lfs->rlines.tick;
+    line->prefetched = false;
+    int err = lfs->cfg->read(lfs->cfg, block, off, line->c.buffer, size);
+    LFS_ASSERT(err <= 0);
+    if (err) {
+        lfs_cache_drop(lfs, &line->c);
+    }
+
+    return err;
+}
+
+// lines are kept coherent with the disk, drop them when their block changes
+static void lfs_rcache_dropblock(lfs_t *lfs, lfs_block_t block) {
+    struct lfs_rline *set = lfs_rcache_set(lfs, block);
+    for (int i = 0; i < LFS_RCACHE_WAYS; i++) {
+        if (set[i].c.block == block) {
+            lfs_cache_drop(lfs, &set[i].c);
+            set[i].used = 0;
+        }
+    }
+}
+#endif
+
 static int lfs_bd_read(lfs_t *lfs,
         const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
         lfs_block_t block, lfs_off_t off,
@@ -88,6 +146,69 @@ static int lfs_bd_read(lfs_t *lfs,
             diff = lfs_min(diff, rcache->off-off);
         }
 
+#ifdef LFS_RCACHE_WAYS
+        // the filesystem's rcache is backed by the cache lines
+        if (rcache == &lfs->rcache) {
+            struct lfs_rline *line = lfs_rcache_lookup(lfs, block, off);
+            if (line) {
+                lfs->rlines.hits += 1;
+                if (line->prefetched) {
+                    lfs->rlines.prefetch_hits += 1;
+                    line->prefetched = false;
+                }
+                line->used = ++lfs->rlines.tick;
+
+            } else if (!(size >= hint && off % lfs->cfg->read_size == 0 &&
+                    size >= lfs->cfg->read_size)) {
+                // load to a line, prefetch the next one if we are
+                // continuing the previous load
+                lfs_off_t loff = lfs_aligndown(off, lfs->cfg->read_size);
+                bool sequential = (block == lfs->rlines.next_block &&
+                        loff == lfs->rlines.next_off);
+                line = lfs_rcache_victim(lfs, block);
+                int err = lfs_rcache_load(lfs, line, block, loff,
+                        lfs_min(
+                            lfs_min(
+                                lfs_alignup(off+hint, lfs->cfg->read_size),
+                                lfs->cfg->block_size)
+                            - loff,
+                            lfs->cfg->cache_size));
+                if (err) {
+                    return err;
+                }
+                lfs->rlines.misses += 1;
+                lfs->rlines.next_block = block;
+                lfs->rlines.next_off = line->c.off + line->c.size;
+
+                struct lfs_rline *next = lfs_rcache_victim(lfs, block);
+                if (sequential && next != line &&
+                        lfs->rlines.next_off < lfs->cfg->block_size) {
+                    err = lfs_rcache_load(lfs, next, block,
+                            lfs->rlines.next_off,
+                            lfs_min(lfs->cfg->block_size
+                                    - lfs->rlines.next_off,
+                                lfs->cfg->cache_size));
+                    // errors are left to the read that needs the data
+                    if (!err) {
+                        next->prefetched = true;
+                        lfs->rlines.prefetches += 1;
+                        lfs->rlines.next_off = next->c.off + next->c.size;
+                    }
+                }
+            }
+
+            if (line) {
+                diff = lfs_min(diff, line->c.size - (off-line->c.off));
+                memcpy(data, &line->c.buffer[off-line->c.off], diff);
+
+                data += diff;
+                off += diff;
+                size -= diff;
+                continue;
+            }
+        }
+#endif
+
         if (size >= hint && off % lfs->cfg->read_size == 0 &&
                 size >= lfs->cfg->read_size) {
             // bypass cache?
@@ -180,6 +301,9 @@ static int lfs_bd_flush(lfs_t *lfs,
         lfs_size_t diff = lfs_alignup(pcache->size, lfs->cfg->prog_size);
         int err = lfs->cfg->prog(lfs->cfg, pcache->block,
                 pcache->off, pcache->buffer, diff);
+#ifdef LFS_RCACHE_WAYS
+        lfs_rcache_dropblock(lfs, pcache->block);
+#endif
         LFS_ASSERT(err <= 0);
         if (err) {
             return err;
@@ -274,6 +398,9 @@ static int lfs_bd_prog(lfs_t *lfs,
 #ifndef LFS_READONLY
 static int lfs_bd_erase(lfs_t *lfs, lfs_block_t block) {
     LFS_ASSERT(block < lfs->block_count);
+#ifdef LFS_RCACHE_WAYS
+    lfs_rcache_dropblock(lfs, block);
+#endif
     int err = lfs->cfg->erase(lfs->cfg, block);
     LFS_ASSERT(err <= 0);
     return err;
@@ -634,11 +761,11 @@ static int lfs_alloc_scan(lfs_t *lfs) {
             % lfs->block_count;
     lfs->lookahead.next = 0;
     lfs->lookahead.size = lfs_min(
-            8*lfs->cfg->lookahead_size,
+            8*lfs->lookahead.bsize,
             lfs->lookahead.ckpoint);
 
     // find mask of free blocks from tree
-    memset(lfs->lookahead.buffer, 0, lfs->cfg->lookahead_size);
+    memset(lfs->lookahead.buffer, 0, lfs->lookahead.bsize);
     int err = lfs_fs_traverse_(lfs, lfs_alloc_lookahead, lfs, true);
     if (err) {
         lfs_alloc_drop(lfs);
@@ -649,33 +776,63 @@ static int lfs_alloc_scan(lfs_t *lfs) {
 }
 #endif
 
+#ifndef LFS_READONLY
+// find the first free block in the lookahead buffer at or after off, or
+// lookahead.size if there is none, testing 32 blocks at a time where possible
+static lfs_block_t lfs_alloc_findfree(lfs_t *lfs, lfs_block_t off) {
+    const uint8_t *buffer = lfs->lookahead.buffer;
+
+    // bit at a time up to a word boundary
+    while (off < lfs->lookahead.size && off % 32 != 0) {
+        if (!(buffer[off / 8] & (1U << (off % 8)))) {
+            return off;
+        }
+        off += 1;
+    }
+
+    // word at a time, the bitmap is little-endian so the lowest set bit of
+    // the inverted word is the first free block
+    while (off + 32 <= lfs->lookahead.size) {
+        uint32_t word;
+        memcpy(&word, &buffer[off / 8], sizeof(word));
+        word = ~lfs_fromle32(word);
+        if (word) {
+            return off + lfs_ctz(word);
+        }
+        off += 32;
+    }
+
+    // bit at a time for the tail
+    while (off < lfs->lookahead.size) {
+        if (!(buffer[off / 8] & (1U << (off % 8)))) {
+            return off;
+        }
+        off += 1;
+    }
+
+    return lfs->lookahead.size;
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
     while (true) {
         // scan our lookahead buffer for free blocks
-        while (lfs->lookahead.next < lfs->lookahead.size) {
-            if (!(lfs->lookahead.buffer[lfs->lookahead.next / 8]
-                    & (1U << (lfs->lookahead.next % 8)))) {
-                // found a free block
-                *block = (lfs->lookahead.start + lfs->lookahead.next)
-                        % lfs->block_count;
-
-                // eagerly find next free block to maximize how many blocks
-                // lfs_alloc_ckpoint makes available for scanning
-                while (true) {
-                    lfs->lookahead.next += 1;
-                    lfs->lookahead.ckpoint -= 1;
-
-                    if (lfs->lookahead.next >= lfs->lookahead.size
-                            || !(lfs->lookahead.buffer[lfs->lookahead.next / 8]
-                                & (1U << (lfs->lookahead.next % 8)))) {
-                        return 0;
-                    }
-                }
-            }
-
-            lfs->lookahead.next += 1;
-            lfs->lookahead.ckpoint -= 1;
+        lfs_block_t next = lfs_alloc_findfree(lfs, lfs->lookahead.next);
+        lfs->lookahead.ckpoint -= next - lfs->lookahead.next;
+        lfs->lookahead.next = next;
+
+        if (lfs->lookahead.next < lfs->lookahead.size) {
+            // found a free block
+            *block = (lfs->lookahead.start + lfs->lookahead.next)
+                    % lfs->block_count;
+
+            // eagerly find next free block to maximize how many blocks
+            // lfs_alloc_ckpoint makes available for scanning
+            next = lfs_alloc_findfree(lfs, lfs->lookahead.next + 1);
+            lfs->lookahead.ckpoint -= next - lfs->lookahead.next;
+            lfs->lookahead.next = next;
+            return 0;
         }
 
         // In order to keep our block allocator from spinning forever when our
@@ -1371,12 +1528,119 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
     return LFS_ERR_CORRUPT;
 }
 
+#ifdef LFS_DIR_CACHE
+static void lfs_dir_cachedrop(lfs_t *lfs) {
+    memset(&lfs->dcache, 0, sizeof(lfs->dcache));
+}
+
+// read the words that change whenever a metadata pair is appended to,
+// compacted or erased: both revision counts and the word past the last commit,
+// through the read cache, so only changes made through this lfs_t are seen
+static int lfs_dir_cachestamp(lfs_t *lfs,
+        const lfs_mdir_t *dir, uint32_t stamp[3]) {
+    for (int i = 0; i < 2; i++) {
+        int err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, sizeof(uint32_t),
+                dir->pair[i], 0, &stamp[i], sizeof(uint32_t));
+        if (err) {
+            return err;
+        }
+    }
+
+    stamp[2] = 0xffffffff;
+    if (dir->off + sizeof(uint32_t) <= lfs->cfg->block_size) {
+        int err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, sizeof(uint32_t),
+                dir->pair[0], dir->off, &stamp[2], sizeof(uint32_t));
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static struct lfs_dir_cache_entry *lfs_dir_cachefind(lfs_t *lfs,
+        const lfs_block_t pair[2], uint32_t hash, lfs_size_t namelen) {
+    for (int i = 0; i < LFS_DIR_CACHE; i++) {
+        struct lfs_dir_cache_entry *e = &lfs->dcache.entries[i];
+        if (!e->used || e->hash != hash || e->namelen != namelen
+                || !lfs_pair_issync(e->m.pair, pair)) {
+            continue;
+        }
+
+        // still the same commit log?
+        uint32_t stamp[3];
+        int err = lfs_dir_cachestamp(lfs, &e->m, stamp);
+        if (err || memcmp(stamp, e->stamp, sizeof(stamp)) != 0) {
+            e->used = 0;
+            return NULL;
+        }
+
+        e->used = ++lfs->dcache.tick;
+        return e;
+    }
+
+    return NULL;
+}
+
+static void lfs_dir_cacheput(lfs_t *lfs, const lfs_mdir_t *dir,
+        uint32_t hash, lfs_size_t namelen, lfs_off_t nameoff,
+        lfs_stag_t tag, uint16_t id) {
+    if (lfs->dcache.tick == 0xffffffff) {
+        lfs_dir_cachedrop(lfs);
+    }
+
+    // replace the same lookup if present, otherwise the least recently used
+    struct lfs_dir_cache_entry *e = &lfs->dcache.entries[0];
+    for (int i = 0; i < LFS_DIR_CACHE; i++) {
+        struct lfs_dir_cache_entry *c = &lfs->dcache.entries[i];
+        if (c->used && c->hash == hash && c->namelen == namelen
+                && lfs_pair_issync(c->m.pair, dir->pair)) {
+            e = c;
+            break;
+        }
+
+        if (c->used < e->used) {
+            e = c;
+        }
+    }
+
+    if (lfs_dir_cachestamp(lfs, dir, e->stamp)) {
+        e->used = 0;
+        return;
+    }
+
+    e->m = *dir;
+    e->hash = hash;
+    e->namelen = namelen;
+    e->nameoff = nameoff;
+    e->tag = tag;
+    e->id = id;
+    e->used = ++lfs->dcache.tick;
+}
+#endif
+
 static int lfs_dir_fetch(lfs_t *lfs,
         lfs_mdir_t *dir, const lfs_block_t pair[2]) {
+#ifdef LFS_DIR_CACHE
+    struct lfs_dir_cache_entry *e = lfs_dir_cachefind(lfs, pair, 0, 0);
+    if (e) {
+        *dir = e->m;
+        return 0;
+    }
+#endif
+
     // note, mask=-1, tag=-1 can never match a tag since this
     // pattern has the invalid bit set
-    return (int)lfs_dir_fetchmatch(lfs, dir, pair,
+    int err = (int)lfs_dir_fetchmatch(lfs, dir, pair,
             (lfs_tag_t)-1, (lfs_tag_t)-1, NULL, NULL, NULL);
+#ifdef LFS_DIR_CACHE
+    if (!err) {
+        lfs_dir_cacheput(lfs, dir, 0, 0, 0, 0, 0);
+    }
+#endif
+    return err;
 }
 
 static int lfs_dir_getgstate(lfs_t *lfs, const lfs_mdir_t *dir,
@@ -1435,6 +1699,11 @@ struct lfs_dir_find_match {
     lfs_t *lfs;
     const void *name;
     lfs_size_t size;
+#ifdef LFS_DIR_CACHE
+    // where the matching name was found
+    lfs_block_t block;
+    lfs_off_t off;
+#endif
 };
 
 static int lfs_dir_find_match(void *data,
@@ -1458,16 +1727,320 @@ static int lfs_dir_find_match(void *data,
     }
 
     // found a match!
+#ifdef LFS_DIR_CACHE
+    name->block = disk->block;
+    name->off = disk->off;
+#endif
     return LFS_CMP_EQ;
 }
 
-static lfs_stag_t lfs_dir_find(lfs_t *lfs, lfs_mdir_t *dir,
-        const char **path, uint16_t *id) {
+// fetch a metadata pair and look up a name in it
+static lfs_stag_t lfs_dir_fetchname(lfs_t *lfs, lfs_mdir_t *dir,
+        const lfs_block_t pair[2], const char *name, lfs_size_t namelen,
+        uint16_t *id) {
+#ifdef LFS_DIR_CACHE
+    uint32_t hash = lfs_crc(0xffffffff, name, namelen);
+    struct lfs_dir_cache_entry *e = lfs_dir_cachefind(lfs,
+            pair, hash, namelen);
+    // a matching crc is not a matching name, compare with disk
+    if (e && lfs_bd_cmp(lfs,
+            NULL, &lfs->rcache, namelen,
+            e->m.pair[0], e->nameoff, name, namelen) == LFS_CMP_EQ) {
+        *dir = e->m;
+        if (id) {
+            *id = e->id;
+        }
+        return e->tag;
+    }
+#endif
+
+    struct lfs_dir_find_match match = {
+            .lfs = lfs, .name = name, .size = namelen};
+    lfs_stag_t tag = lfs_dir_fetchmatch(lfs, dir, pair,
+            LFS_MKTAG(0x780, 0, 0),
+            LFS_MKTAG(LFS_TYPE_NAME, 0, namelen),
+            id, lfs_dir_find_match, &match);
+#ifdef LFS_DIR_CACHE
+    // only found names are cached, a miss can't be checked against disk
+    if (tag > 0 && match.block == dir->pair[0]) {
+        lfs_dir_cacheput(lfs, dir, hash, namelen, match.off,
+                tag, lfs_min(lfs_tag_id(tag), dir->count));
+    }
+#endif
+    return tag;
+}
+
+/// Batched entry operations ///
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+// in a batch, removed entries and made directories are kept here and go in
+// with the next commit to their metadata pair
+struct lfs_pending {
+    struct lfs_pending *next;
+    // user attributes set on a made directory
+    struct lfs_pending_attr *attrs;
+    lfs_block_t pair[2];
+    // metadata pair of a made directory, already written
+    lfs_block_t child[2];
+    // id of a removed entry, or of the entry a made directory goes before
+    uint16_t id;
+    uint16_t type;
+    lfs_size_t nlen;
+    // followed by the name of a made directory
+};
+
+struct lfs_pending_attr {
+    struct lfs_pending_attr *next;
+    uint8_t type;
+    lfs_size_t size;
+    // followed by the data
+};
+
+// limit on the entries kept, more are committed right away
+#ifndef LFS_BATCH_MAX
+#define LFS_BATCH_MAX 16
+#endif
+
+static const char *lfs_pending_name(const struct lfs_pending *p) {
+    return (const char*)(p + 1);
+}
+
+// does name a sort before name b, in the order lfs_dir_find_match keeps
+// entries of a metadata pair
+static bool lfs_pending_before(const void *a, lfs_size_t asize,
+        const void *b, lfs_size_t bsize) {
+    int res = memcmp(a, b, lfs_min(asize, bsize));
+    if (res) {
+        return res < 0;
+    }
+
+    return asize > bsize;
+}
+
+static struct lfs_pending *lfs_pending_finddir(lfs_t *lfs,
+        const lfs_block_t pair[2], const char *name, lfs_size_t namelen) {
+    for (struct lfs_pending *p = lfs->pending; p; p = p->next) {
+        if (p->type == LFS_TYPE_DIR && lfs_pair_cmp(p->pair, pair) == 0 &&
+                p->nlen == namelen &&
+                memcmp(lfs_pending_name(p), name, namelen) == 0) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static bool lfs_pending_isremoved(lfs_t *lfs,
+        const lfs_block_t pair[2], uint16_t id) {
+    for (struct lfs_pending *p = lfs->pending; p; p = p->next) {
+        if (p->type == LFS_TYPE_DELETE && lfs_pair_cmp(p->pair, pair) == 0 &&
+                p->id == id) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// the tail a directory made after a metadata pair links to, the newest
+// directory kept for the pair comes after it once committed
+static void lfs_pending_tail(lfs_t *lfs,
+        const lfs_block_t pair[2], lfs_block_t tail[2]) {
+    for (struct lfs_pending *p = lfs->pending; p; p = p->next) {
+        if (p->type == LFS_TYPE_DIR && lfs_pair_cmp(p->pair, pair) == 0) {
+            tail[0] = p->child[0];
+            tail[1] = p->child[1];
+            return;
+        }
+    }
+}
+
+// can an entry of the metadata pair be kept?
+static bool lfs_pending_cankeep(lfs_t *lfs,
+        const lfs_block_t pair[2], uint16_t id) {
+    if (!lfs->batch) {
+        return false;
+    }
+
+    int count = 0;
+    for (struct lfs_pending *p = lfs->pending; p; p = p->next) {
+        count += 1;
+    }
+    if (count >= LFS_BATCH_MAX) {
+        return false;
+    }
+
+    // open directories read what is on disk, and open files follow
+    // their entry, both only see the commit
+    for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
+        if (d->type == LFS_TYPE_DIR || (id != 0x3ff &&
+                lfs_pair_cmp(d->m.pair, pair) == 0 && d->id == id)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int lfs_pending_keep(lfs_t *lfs, uint16_t type,
+        const lfs_block_t pair[2], uint16_t id,
+        const lfs_block_t child[2], const char *name, lfs_size_t nlen) {
+    struct lfs_pending *p = lfs_malloc(sizeof(struct lfs_pending) + nlen);
+    if (!p) {
+        return LFS_ERR_NOMEM;
+    }
+
+    p->attrs = NULL;
+    p->pair[0] = pair[0];
+    p->pair[1] = pair[1];
+    p->child[0] = (child) ? child[0] : LFS_BLOCK_NULL;
+    p->child[1] = (child) ? child[1] : LFS_BLOCK_NULL;
+    p->id = id;
+    p->type = type;
+    p->nlen = nlen;
+    if (nlen) {
+        memcpy(p + 1, name, nlen);
+    }
+
+    // newest first
+    p->next = lfs->pending;
+    lfs->pending = p;
+    return 0;
+}
+
+static void lfs_pending_free(lfs_t *lfs, struct lfs_pending *p) {
+    for (struct lfs_pending **q = &lfs->pending; *q; q = &(*q)->next) {
+        if (*q == p) {
+            *q = p->next;
+            break;
+        }
+    }
+
+    while (p->attrs) {
+        struct lfs_pending_attr *a = p->attrs;
+        p->attrs = a->next;
+        lfs_free(a);
+    }
+    lfs_free(p);
+}
+
+static lfs_ssize_t lfs_pending_getattr(struct lfs_pending *p,
+        uint8_t type, void *buffer, lfs_size_t size) {
+    for (struct lfs_pending_attr *a = p->attrs; a; a = a->next) {
+        if (a->type == type) {
+            memcpy(buffer, a + 1, lfs_min(size, a->size));
+            return a->size;
+        }
+    }
+
+    return LFS_ERR_NOATTR;
+}
+
+static int lfs_pending_setattr(struct lfs_pending *p,
+        uint8_t type, const void *buffer, lfs_size_t size) {
+    for (struct lfs_pending_attr **q = &p->attrs; *q; q = &(*q)->next) {
+        if ((*q)->type == type) {
+            struct lfs_pending_attr *a = *q;
+            *q = a->next;
+            lfs_free(a);
+            break;
+        }
+    }
+
+    // a size of 0x3ff removes the attribute
+    if (size == 0x3ff) {
+        return 0;
+    }
+
+    struct lfs_pending_attr *a = lfs_malloc(
+            sizeof(struct lfs_pending_attr) + size);
+    if (!a) {
+        return LFS_ERR_NOMEM;
+    }
+
+    a->type = type;
+    a->size = size;
+    memcpy(a + 1, buffer, size);
+    a->next = p->attrs;
+    p->attrs = a;
+    return 0;
+}
+
+// id of a kept entry once the attributes of a commit to its pair are in,
+// entries the commit creates in the same place come first unless the made
+// directory sorts before them
+static uint16_t lfs_pending_shift(const struct lfs_pending *p,
+        const struct lfs_mattr *attrs, int attrcount) {
+    uint16_t id = p->id;
+    for (int i = 0; i < attrcount; i++) {
+        uint16_t aid = lfs_tag_id(attrs[i].tag);
+        if (lfs_tag_type3(attrs[i].tag) == LFS_TYPE_CREATE) {
+            bool before = (aid < id);
+            if (aid == id) {
+                before = true;
+                for (int j = i+1; j < attrcount; j++) {
+                    if (lfs_tag_type1(attrs[j].tag) == LFS_TYPE_NAME &&
+                            lfs_tag_id(attrs[j].tag) == aid) {
+                        before = (p->type != LFS_TYPE_DIR ||
+                                !lfs_pending_before(
+                                    lfs_pending_name(p), p->nlen,
+                                    attrs[j].buffer,
+                                    lfs_tag_size(attrs[j].tag)));
+                        break;
+                    }
+                }
+            }
+
+            if (before) {
+                id += 1;
+            }
+        } else if (lfs_tag_type3(attrs[i].tag) == LFS_TYPE_DELETE) {
+            LFS_ASSERT(p->type != LFS_TYPE_DELETE || aid != id);
+            if (aid < id) {
+                id -= 1;
+            }
+        }
+    }
+
+    return id;
+}
+
+// commit the entries kept for a metadata pair, or for all of them if pair
+// is NULL
+static int lfs_pending_flush(lfs_t *lfs, const lfs_block_t pair[2]) {
+    while (true) {
+        struct lfs_pending *p = lfs->pending;
+        while (p && pair && lfs_pair_cmp(p->pair, pair) != 0) {
+            p = p->next;
+        }
+        if (!p) {
+            return 0;
+        }
+
+        // an empty commit takes them along
+        lfs_mdir_t m;
+        int err = lfs_dir_fetch(lfs, &m, p->pair);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_commit(lfs, &m, NULL, 0);
+        if (err) {
+            return err;
+        }
+    }
+}
+#endif
+
+// look up a path, a directory made in a batch that has no entry yet is
+// returned in made along with LFS_ERR_NOENT
+static lfs_stag_t lfs_dir_lookup(lfs_t *lfs, lfs_mdir_t *dir,
+        const char **path, uint16_t *id, struct lfs_pending **made) {
     // we reduce path to a single name if we can find it
     const char *name = *path;
     if (id) {
         *id = 0x3ff;
     }
+    *made = NULL;
 
     // default to root dir
     lfs_stag_t tag = LFS_MKTAG(LFS_TYPE_DIR, 0x3ff, 0);
@@ -1536,13 +2109,43 @@ nextname:
 
         // find entry matching name
         while (true) {
-            tag = lfs_dir_fetchmatch(lfs, dir, dir->tail,
-                    LFS_MKTAG(0x780, 0, 0),
-                    LFS_MKTAG(LFS_TYPE_NAME, 0, namelen),
+            tag = lfs_dir_fetchname(lfs, dir, dir->tail, name, namelen,
                      // are we last name?
-                    (strchr(name, '/') == NULL) ? id : NULL,
-                    lfs_dir_find_match, &(struct lfs_dir_find_match){
-                        lfs, name, namelen});
+                    (strchr(name, '/') == NULL) ? id : NULL);
+            if (tag < 0 && tag != LFS_ERR_NOENT) {
+                return tag;
+            }
+
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+            if (tag > 0 && lfs_pending_isremoved(lfs,
+                    dir->pair, lfs_tag_id(tag))) {
+                // removed in a batch, a new entry takes its place
+                if (id && strchr(name, '/') == NULL) {
+                    *id = lfs_tag_id(tag);
+                }
+                return LFS_ERR_NOENT;
+            }
+
+            if (tag == LFS_ERR_NOENT || (tag == 0 && !dir->split)) {
+                // made in a batch?
+                struct lfs_pending *p = lfs_pending_finddir(lfs,
+                        dir->pair, name, namelen);
+                if (p) {
+                    const char *rest = name + namelen;
+                    if (rest[strspn(rest, "/")] == '\0') {
+                        *made = p;
+                        return LFS_ERR_NOENT;
+                    }
+
+                    // its entries are found from its own metadata pair
+                    tag = LFS_MKTAG(LFS_TYPE_DIR, 0x3ff, 0);
+                    dir->tail[0] = p->child[0];
+                    dir->tail[1] = p->child[1];
+                    break;
+                }
+            }
+#endif
+
             if (tag < 0) {
                 return tag;
             }
@@ -1561,6 +2164,29 @@ nextname:
     }
 }
 
+static lfs_stag_t lfs_dir_find(lfs_t *lfs, lfs_mdir_t *dir,
+        const char **path, uint16_t *id) {
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+    const char *fullpath = *path;
+#endif
+    struct lfs_pending *made;
+    lfs_stag_t tag = lfs_dir_lookup(lfs, dir, path, id, &made);
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+    if (tag == LFS_ERR_NOENT && made) {
+        // a directory made in a batch is found once its entry is in
+        int err = lfs_pending_flush(lfs, made->pair);
+        if (err) {
+            return err;
+        }
+
+        *path = fullpath;
+        tag = lfs_dir_lookup(lfs, dir, path, id, &made);
+        LFS_ASSERT(!made);
+    }
+#endif
+    return tag;
+}
+
 // commit logic
 struct lfs_commit {
     lfs_block_t block;
@@ -1639,6 +2265,11 @@ static int lfs_dir_commitattr(lfs_t *lfs, struct lfs_commit *commit,
 #ifndef LFS_READONLY
 
 static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
+#ifdef LFS_DIR_CACHE
+    // commits may move entries between pairs and change the gstate
+    lfs_dir_cachedrop(lfs);
+#endif
+
     // align to program units
     //
     // this gets a bit complex as we have two types of crcs:
@@ -2225,9 +2856,9 @@ static int lfs_dir_relocatingcommit(lfs_t *lfs, lfs_mdir_t *dir,
         }
     }
 
-    // should we actually drop the directory block?
-    if (hasdelete && dir->count == 0) {
-        LFS_ASSERT(pdir);
+    // should we actually drop the directory block? entries removed in a
+    // batch can empty it in a commit that can't drop it, it is kept then
+    if (hasdelete && dir->count == 0 && pdir) {
         int err = lfs_fs_pred(lfs, dir->pair, pdir);
         if (err && err != LFS_ERR_NOENT) {
             return err;
@@ -2338,6 +2969,12 @@ fixmlist:;
             if (d->m.pair != pair) {
                 for (int i = 0; i < attrcount; i++) {
                     if (lfs_tag_type3(attrs[i].tag) == LFS_TYPE_DELETE &&
+                            d->id == lfs_tag_id(attrs[i].tag) &&
+                            d->type == LFS_TYPE_REG &&
+                            (((lfs_file_t*)d)->flags & LFS_F_CREATING)) {
+                        // an entry still to be created only has a slot,
+                        // which stays where it is
+                    } else if (lfs_tag_type3(attrs[i].tag) == LFS_TYPE_DELETE &&
                             d->id == lfs_tag_id(attrs[i].tag)) {
                         d->m.pair[0] = LFS_BLOCK_NULL;
                         d->m.pair[1] = LFS_BLOCK_NULL;
@@ -2374,6 +3011,149 @@ fixmlist:;
 }
 #endif
 
+#ifndef LFS_READONLY
+// commit to a metadata pair, along with the entries a batch keeps for it
+static int lfs_dir_batchingcommit(lfs_t *lfs, lfs_mdir_t *dir,
+        const lfs_block_t pair[2],
+        const struct lfs_mattr *attrs, int attrcount,
+        lfs_mdir_t *pdir) {
+#ifndef LFS_NO_MALLOC
+    // find where the kept entries go once the caller's attrs are in
+    struct {
+        struct lfs_pending *p;
+        uint16_t id;
+    } kept[LFS_BATCH_MAX];
+    int count = 0;
+    int made = 0;
+    int extra = 0;
+    const lfs_block_t *tail = NULL;
+    bool hastail = false;
+    for (int i = 0; i < attrcount; i++) {
+        hastail |= (lfs_tag_type1(attrs[i].tag) == LFS_TYPE_TAIL);
+    }
+    for (struct lfs_pending *p = lfs->pending; p; p = p->next) {
+        if (lfs_pair_cmp(p->pair, pair) != 0) {
+            continue;
+        }
+
+        LFS_ASSERT(count < LFS_BATCH_MAX);
+        uint16_t id = lfs_pending_shift(p, attrs, attrcount);
+
+        // made directories by id and name, then removed entries from the
+        // last, so neither moves the ids of the others
+        int i = count;
+        while (i > 0 && ((p->type == LFS_TYPE_DIR)
+                ? (kept[i-1].p->type != LFS_TYPE_DIR ||
+                    id < kept[i-1].id || (id == kept[i-1].id &&
+                        lfs_pending_before(
+                            lfs_pending_name(p), p->nlen,
+                            lfs_pending_name(kept[i-1].p),
+                            kept[i-1].p->nlen)))
+                : (kept[i-1].p->type != LFS_TYPE_DIR &&
+                    id > kept[i-1].id))) {
+            kept[i] = kept[i-1];
+            i -= 1;
+        }
+        kept[i].p = p;
+        kept[i].id = id;
+        count += 1;
+
+        if (p->type == LFS_TYPE_DIR) {
+            // the newest directory comes first in the tail list
+            if (!tail) {
+                tail = p->child;
+            }
+            made += 1;
+            extra += 3;
+            for (struct lfs_pending_attr *a = p->attrs; a; a = a->next) {
+                extra += 1;
+            }
+        } else {
+            extra += 1;
+        }
+    }
+
+    if (count == 0) {
+        return lfs_dir_relocatingcommit(lfs, dir, pair,
+                attrs, attrcount, pdir);
+    }
+
+    // a new tail from the caller already leads to the made directories
+    if (made && !hastail) {
+        LFS_ASSERT(!dir->split);
+        extra += 1;
+    }
+
+    struct lfs_mattr *mattrs = lfs_malloc(
+            sizeof(struct lfs_mattr)*(attrcount + extra)
+            + sizeof(lfs_block_t)*2*(made + 1));
+    if (!mattrs) {
+        return LFS_ERR_NOMEM;
+    }
+    lfs_block_t (*pairs)[2] = (lfs_block_t (*)[2])&mattrs[attrcount + extra];
+
+    int n = 0;
+    for (int i = 0; i < attrcount; i++) {
+        mattrs[n++] = attrs[i];
+    }
+
+    for (int i = 0; i < made; i++) {
+        struct lfs_pending *p = kept[i].p;
+        uint16_t id = kept[i].id + i;
+        pairs[i][0] = p->child[0];
+        pairs[i][1] = p->child[1];
+        lfs_pair_tole32(pairs[i]);
+        mattrs[n++] = (struct lfs_mattr){
+                LFS_MKTAG(LFS_TYPE_CREATE, id, 0), NULL};
+        mattrs[n++] = (struct lfs_mattr){
+                LFS_MKTAG(LFS_TYPE_DIR, id, p->nlen), lfs_pending_name(p)};
+        mattrs[n++] = (struct lfs_mattr){
+                LFS_MKTAG(LFS_TYPE_DIRSTRUCT, id, 8), pairs[i]};
+        for (struct lfs_pending_attr *a = p->attrs; a; a = a->next) {
+            mattrs[n++] = (struct lfs_mattr){
+                    LFS_MKTAG(LFS_TYPE_USERATTR + a->type, id, a->size),
+                    a + 1};
+        }
+    }
+
+    for (int i = made; i < count; i++) {
+        uint16_t id = kept[i].id;
+        for (int j = 0; j < made; j++) {
+            if (kept[j].id <= kept[i].id) {
+                id += 1;
+            }
+        }
+        mattrs[n++] = (struct lfs_mattr){
+                LFS_MKTAG(LFS_TYPE_DELETE, id, 0), NULL};
+    }
+
+    if (made && !hastail) {
+        pairs[made][0] = tail[0];
+        pairs[made][1] = tail[1];
+        lfs_pair_tole32(pairs[made]);
+        mattrs[n++] = (struct lfs_mattr){
+                LFS_MKTAG(LFS_TYPE_SOFTTAIL, 0x3ff, 8), pairs[made]};
+    }
+    LFS_ASSERT(n == attrcount + extra);
+
+    int state = lfs_dir_relocatingcommit(lfs, dir, pair, mattrs, n, pdir);
+    lfs_free(mattrs);
+    if (state < 0) {
+        return state;
+    }
+
+    // committed, the entries are no longer kept
+    for (int i = 0; i < count; i++) {
+        lfs_pending_free(lfs, kept[i].p);
+    }
+
+    return state;
+#else
+    return lfs_dir_relocatingcommit(lfs, dir, pair, attrs, attrcount, pdir);
+#endif
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
         const struct lfs_mattr *attrs, int attrcount) {
@@ -2398,7 +3178,7 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
     lfs_block_t lpair[2] = {dir->pair[0], dir->pair[1]};
     lfs_mdir_t ldir = *dir;
     lfs_mdir_t pdir;
-    int state = lfs_dir_relocatingcommit(lfs, &ldir, dir->pair,
+    int state = lfs_dir_batchingcommit(lfs, &ldir, dir->pair,
             attrs, attrcount, &pdir);
     if (state < 0) {
         return state;
@@ -2426,7 +3206,7 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
         lpair[0] = pdir.pair[0];
         lpair[1] = pdir.pair[1];
         lfs_pair_tole32(dir->tail);
-        state = lfs_dir_relocatingcommit(lfs, &pdir, lpair, LFS_MKATTRS(
+        state = lfs_dir_batchingcommit(lfs, &pdir, lpair, LFS_MKATTRS(
                     {LFS_MKTAG(LFS_TYPE_TAIL + dir->split, 0x3ff, 8),
                         dir->tail}),
                 NULL);
@@ -2466,6 +3246,22 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
             }
         }
 
+#ifndef LFS_NO_MALLOC
+        // and entries kept by a batch
+        for (struct lfs_pending *p = lfs->pending; p; p = p->next) {
+            if (lfs_pair_cmp(lpair, p->pair) == 0) {
+                p->pair[0] = ldir.pair[0];
+                p->pair[1] = ldir.pair[1];
+            }
+
+            if (p->type == LFS_TYPE_DIR &&
+                    lfs_pair_cmp(lpair, p->child) == 0) {
+                p->child[0] = ldir.pair[0];
+                p->child[1] = ldir.pair[1];
+            }
+        }
+#endif
+
         // find parent
         lfs_stag_t tag = lfs_fs_parent(lfs, lpair, &pdir);
         if (tag < 0 && tag != LFS_ERR_NOENT) {
@@ -2497,7 +3293,7 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
 
             lfs_block_t ppair[2] = {pdir.pair[0], pdir.pair[1]};
             lfs_pair_tole32(ldir.pair);
-            state = lfs_dir_relocatingcommit(lfs, &pdir, ppair, LFS_MKATTRS(
+            state = lfs_dir_batchingcommit(lfs, &pdir, ppair, LFS_MKATTRS(
                         {LFS_MKTAG_IF(moveid != 0x3ff,
                             LFS_TYPE_DELETE, moveid, 0), NULL},
                         {tag, ldir.pair}),
@@ -2548,7 +3344,7 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
             lpair[0] = pdir.pair[0];
             lpair[1] = pdir.pair[1];
             lfs_pair_tole32(ldir.pair);
-            state = lfs_dir_relocatingcommit(lfs, &pdir, lpair, LFS_MKATTRS(
+            state = lfs_dir_batchingcommit(lfs, &pdir, lpair, LFS_MKATTRS(
                         {LFS_MKTAG_IF(moveid != 0x3ff,
                             LFS_TYPE_DELETE, moveid, 0), NULL},
                         {LFS_MKTAG(LFS_TYPE_TAIL + pdir.split, 0x3ff, 8),
@@ -2630,6 +3426,12 @@ static int lfs_mkdir_(lfs_t *lfs, const char *path) {
         }
     }
 
+#ifndef LFS_NO_MALLOC
+    // directories made in a batch come after their parent once committed
+    lfs_pending_tail(lfs, pred.pair, pred.tail);
+    bool keep = !cwd.m.split && lfs_pending_cankeep(lfs, cwd.m.pair, 0x3ff);
+#endif
+
     // setup dir
     lfs_pair_tole32(pred.tail);
     err = lfs_dir_commit(lfs, &dir, LFS_MKATTRS(
@@ -2639,6 +3441,14 @@ static int lfs_mkdir_(lfs_t *lfs, const char *path) {
         return err;
     }
 
+#ifndef LFS_NO_MALLOC
+    if (keep) {
+        // in a batch, the entry goes in with the next commit to our parent
+        return lfs_pending_keep(lfs, LFS_TYPE_DIR, cwd.m.pair, id,
+                dir.pair, path, nlen);
+    }
+#endif
+
     // current block not end of list?
     if (cwd.m.split) {
         // update tails, this creates a desync
@@ -2689,6 +3499,16 @@ static int lfs_mkdir_(lfs_t *lfs, const char *path) {
 #endif
 
 static int lfs_dir_open_(lfs_t *lfs, lfs_dir_t *dir, const char *path) {
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+    if (lfs->pending) {
+        // directories are read from disk
+        int err = lfs_pending_flush(lfs, NULL);
+        if (err) {
+            return err;
+        }
+    }
+#endif
+
     lfs_stag_t tag = lfs_dir_find(lfs, &dir->m, &path, NULL);
     if (tag < 0) {
         return tag;
@@ -2853,6 +3673,7 @@ static int lfs_ctz_index(lfs_t *lfs, lfs_off_t *off) {
     return i;
 }
 
+#ifndef LFS_CTZ_INDEX
 static int lfs_ctz_find(lfs_t *lfs,
         const lfs_cache_t *pcache, lfs_cache_t *rcache,
         lfs_block_t head, lfs_size_t size,
@@ -2886,6 +3707,87 @@ static int lfs_ctz_find(lfs_t *lfs,
     *off = pos;
     return 0;
 }
+#else
+static void lfs_file_ctzdrop(lfs_file_t *file) {
+    file->index.head = LFS_BLOCK_NULL;
+    file->index.size = 0;
+    for (int i = 0; i < LFS_CTZ_INDEX; i++) {
+        file->index.entries[i].block = LFS_BLOCK_NULL;
+    }
+}
+
+static void lfs_file_ctzremember(lfs_file_t *file,
+        lfs_off_t index, lfs_block_t block) {
+    struct lfs_ctz_entry *entry = &file->index.entries[index % LFS_CTZ_INDEX];
+    entry->index = index;
+    entry->block = block;
+}
+#endif
+
+// find the block at pos in the file's ctz skip-list, with LFS_CTZ_INDEX this
+// starts from the closest cached block at or after pos and caches every
+// block on the way
+static int lfs_file_ctzfind(lfs_t *lfs, lfs_file_t *file,
+        lfs_size_t pos, lfs_block_t *block, lfs_off_t *off) {
+#ifndef LFS_CTZ_INDEX
+    return lfs_ctz_find(lfs, NULL, &file->cache,
+            file->ctz.head, file->ctz.size, pos, block, off);
+#else
+    if (file->ctz.size == 0) {
+        *block = LFS_BLOCK_NULL;
+        *off = 0;
+        return 0;
+    }
+
+    if (file->index.head != file->ctz.head
+            || file->index.size != file->ctz.size) {
+        lfs_file_ctzdrop(file);
+        file->index.head = file->ctz.head;
+        file->index.size = file->ctz.size;
+    }
+
+    lfs_block_t head = file->ctz.head;
+    lfs_off_t current = lfs_ctz_index(lfs, &(lfs_off_t){file->ctz.size-1});
+    lfs_off_t target = lfs_ctz_index(lfs, &pos);
+
+    const struct lfs_ctz_entry *hit
+            = &file->index.entries[target % LFS_CTZ_INDEX];
+    if (hit->block != LFS_BLOCK_NULL && hit->index == target) {
+        current = target;
+        head = hit->block;
+    } else {
+        for (int i = 0; i < LFS_CTZ_INDEX; i++) {
+            const struct lfs_ctz_entry *entry = &file->index.entries[i];
+            if (entry->block != LFS_BLOCK_NULL
+                    && entry->index >= target && entry->index < current) {
+                current = entry->index;
+                head = entry->block;
+            }
+        }
+    }
+
+    while (current > target) {
+        lfs_size_t skip = lfs_min(
+                lfs_npw2(current-target+1) - 1,
+                lfs_ctz(current));
+
+        int err = lfs_bd_read(lfs,
+                NULL, &file->cache, sizeof(head),
+                head, 4*skip, &head, sizeof(head));
+        head = lfs_fromle32(head);
+        if (err) {
+            return err;
+        }
+
+        current -= 1 << skip;
+        lfs_file_ctzremember(file, current, head);
+    }
+
+    *block = head;
+    *off = pos;
+    return 0;
+#endif
+}
 
 #ifndef LFS_READONLY
 static int lfs_ctz_extend(lfs_t *lfs,
@@ -3054,8 +3956,15 @@ static int lfs_file_opencfg_(lfs_t *lfs, lfs_file_t *file,
     file->pos = 0;
     file->off = 0;
     file->cache.buffer = NULL;
+    file->name = NULL;
+#ifdef LFS_CTZ_INDEX
+    lfs_file_ctzdrop(file);
+#endif
 
     // allocate entry for file if it doesn't exist
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+    const char *fullpath = path;  // kept by a create deferred in a batch
+#endif
     lfs_stag_t tag = lfs_dir_find(lfs, &file->m, &path, &file->id);
     if (tag < 0 && !(tag == LFS_ERR_NOENT && file->id != 0x3ff)) {
         err = tag;
@@ -3084,17 +3993,35 @@ static int lfs_file_opencfg_(lfs_t *lfs, lfs_file_t *file,
             goto cleanup;
         }
 
-        // get next slot and create entry to remember name
-        err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
-                {LFS_MKTAG(LFS_TYPE_CREATE, file->id, 0), NULL},
-                {LFS_MKTAG(LFS_TYPE_REG, file->id, nlen), path},
-                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0), NULL}));
-
-        // it may happen that the file name doesn't fit in the metadata blocks, e.g., a 256 byte file name will
-        // not fit in a 128 byte block.
-        err = (err == LFS_ERR_NOSPC) ? LFS_ERR_NAMETOOLONG : err;
-        if (err) {
-            goto cleanup;
+#ifndef LFS_NO_MALLOC
+        if (lfs->batch) {
+            // in a batch, keep the path and create the entry along with
+            // the file's contents on the first sync, its id is looked up
+            // again then since other entries may come first by then
+            lfs_size_t plen = strlen(fullpath);
+            file->name = lfs_malloc(plen+1);
+            if (!file->name) {
+                err = LFS_ERR_NOMEM;
+                goto cleanup;
+            }
+            memcpy(file->name, fullpath, plen);
+            file->name[plen] = '\0';
+            file->flags |= LFS_F_CREATING | LFS_F_DIRTY;
+        } else
+#endif
+        {
+            // get next slot and create entry to remember name
+            err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
+                    {LFS_MKTAG(LFS_TYPE_CREATE, file->id, 0), NULL},
+                    {LFS_MKTAG(LFS_TYPE_REG, file->id, nlen), path},
+                    {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, file->id, 0), NULL}));
+
+            // it may happen that the file name doesn't fit in the metadata blocks, e.g., a 256 byte file name will
+            // not fit in a 128 byte block.
+            err = (err == LFS_ERR_NOSPC) ? LFS_ERR_NAMETOOLONG : err;
+            if (err) {
+                goto cleanup;
+            }
         }
 
         tag = LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, 0);
@@ -3124,8 +4051,13 @@ static int lfs_file_opencfg_(lfs_t *lfs, lfs_file_t *file,
 
     // fetch attrs
     for (unsigned i = 0; i < file->cfg->attr_count; i++) {
-        // if opened for read / read-write operations
-        if ((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY) {
+        // if opened for read / read-write operations, a file still to be
+        // created has no attrs, its id is only a slot
+        if ((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY
+#ifndef LFS_READONLY
+                && !(file->flags & LFS_F_CREATING)
+#endif
+                ) {
             lfs_stag_t res = lfs_dir_get(lfs, &file->m,
                     LFS_MKTAG(0x7ff, 0x3ff, 0),
                     LFS_MKTAG(LFS_TYPE_USERATTR + file->cfg->attrs[i].type,
@@ -3221,6 +4153,9 @@ static int lfs_file_close_(lfs_t *lfs, lfs_file_t *file) {
     if (!file->cfg->buffer) {
         lfs_free(file->cache.buffer);
     }
+#ifndef LFS_NO_MALLOC
+    lfs_free(file->name);
+#endif
 
     return err;
 }
@@ -3381,6 +4316,9 @@ relocate:
         // actual file updates
         file->ctz.head = file->block;
         file->ctz.size = file->pos;
+#ifdef LFS_CTZ_INDEX
+        lfs_file_ctzdrop(file);
+#endif
         file->flags &= ~LFS_F_WRITING;
         file->flags |= LFS_F_DIRTY;
 
@@ -3436,17 +4374,51 @@ static int lfs_file_sync_(lfs_t *lfs, lfs_file_t *file) {
             size = sizeof(ctz);
         }
 
-        // commit file data and attributes
-        err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
-                {LFS_MKTAG(type, file->id, size), buffer},
-                {LFS_MKTAG(LFS_FROM_USERATTRS, file->id,
-                    file->cfg->attr_count), file->cfg->attrs}));
+        if (file->flags & LFS_F_CREATING) {
+            // find the id in sorted order now, entries created since the
+            // open may have taken the slot
+            const char *name = file->name;
+            lfs_stag_t res = lfs_dir_find(lfs, &file->m, &name, &file->id);
+            if (res < 0 && !(res == LFS_ERR_NOENT && file->id != 0x3ff)) {
+                file->flags |= LFS_F_ERRED;
+                return res;
+            }
+            if (res >= 0 && lfs_tag_type3(res) != LFS_TYPE_REG) {
+                file->flags |= LFS_F_ERRED;
+                return LFS_ERR_ISDIR;
+            }
+
+            if (res >= 0) {
+                // created by another handle meanwhile, write over it
+                err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
+                        {LFS_MKTAG(type, file->id, size), buffer},
+                        {LFS_MKTAG(LFS_FROM_USERATTRS, file->id,
+                            file->cfg->attr_count), file->cfg->attrs}));
+            } else {
+                // create the entry deferred by a batch, with name, file
+                // data and attributes in one commit
+                err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
+                        {LFS_MKTAG(LFS_TYPE_CREATE, file->id, 0), NULL},
+                        {LFS_MKTAG(LFS_TYPE_REG, file->id,
+                            strlen(name)), name},
+                        {LFS_MKTAG(type, file->id, size), buffer},
+                        {LFS_MKTAG(LFS_FROM_USERATTRS, file->id,
+                            file->cfg->attr_count), file->cfg->attrs}));
+                err = (err == LFS_ERR_NOSPC) ? LFS_ERR_NAMETOOLONG : err;
+            }
+        } else {
+            // commit file data and attributes
+            err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
+                    {LFS_MKTAG(type, file->id, size), buffer},
+                    {LFS_MKTAG(LFS_FROM_USERATTRS, file->id,
+                        file->cfg->attr_count), file->cfg->attrs}));
+        }
         if (err) {
             file->flags |= LFS_F_ERRED;
             return err;
         }
 
-        file->flags &= ~LFS_F_DIRTY;
+        file->flags &= ~(LFS_F_DIRTY | LFS_F_CREATING);
     }
 
     return 0;
@@ -3471,8 +4443,7 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
         if (!(file->flags & LFS_F_READING) ||
                 file->off == lfs->cfg->block_size) {
             if (!(file->flags & LFS_F_INLINE)) {
-                int err = lfs_ctz_find(lfs, NULL, &file->cache,
-                        file->ctz.head, file->ctz.size,
+                int err = lfs_file_ctzfind(lfs, file,
                         file->pos, &file->block, &file->off);
                 if (err) {
                     return err;
@@ -3555,8 +4526,7 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
             if (!(file->flags & LFS_F_INLINE)) {
                 if (!(file->flags & LFS_F_WRITING) && file->pos > 0) {
                     // find out which block we're extending from
-                    int err = lfs_ctz_find(lfs, NULL, &file->cache,
-                            file->ctz.head, file->ctz.size,
+                    int err = lfs_file_ctzfind(lfs, file,
                             file->pos-1, &file->block, &(lfs_off_t){0});
                     if (err) {
                         file->flags |= LFS_F_ERRED;
@@ -3724,6 +4694,43 @@ static lfs_soff_t lfs_file_seek_(lfs_t *lfs, lfs_file_t *file,
     return npos;
 }
 
+#ifndef LFS_READONLY
+static int lfs_file_reserve_(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
+    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
+
+    if (size > lfs->file_max) {
+        return LFS_ERR_FBIG;
+    }
+
+    if (!(file->flags & LFS_F_INLINE) || size <= lfs->inline_max) {
+        // already in its final form
+        return 0;
+    }
+
+    if (file->flags & LFS_F_READING) {
+        // drop any reads
+        int err = lfs_file_flush(lfs, file);
+        if (err) {
+            return err;
+        }
+    }
+
+    if (file->pos != file->ctz.size) {
+        // leave rewrites and holes to the usual path in lfs_file_write
+        return 0;
+    }
+
+    // same as lfs_file_flushedwrite does once the file doesn't fit inline
+    int err = lfs_file_outline(lfs, file);
+    if (err) {
+        file->flags |= LFS_F_ERRED;
+        return err;
+    }
+
+    return 0;
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_file_truncate_(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
     LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
@@ -3767,8 +4774,7 @@ static int lfs_file_truncate_(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
             }
 
             // lookup new head in ctz skip list
-            err = lfs_ctz_find(lfs, NULL, &file->cache,
-                    file->ctz.head, file->ctz.size,
+            err = lfs_file_ctzfind(lfs, file,
                     size-1, &file->block, &(lfs_off_t){0});
             if (err) {
                 return err;
@@ -3779,6 +4785,9 @@ static int lfs_file_truncate_(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
             file->pos = size;
             file->ctz.head = file->block;
             file->ctz.size = size;
+#ifdef LFS_CTZ_INDEX
+            lfs_file_ctzdrop(file);
+#endif
             file->flags |= LFS_F_DIRTY | LFS_F_READING;
         }
     } else if (size > oldsize) {
@@ -3837,7 +4846,17 @@ static lfs_soff_t lfs_file_size_(lfs_t *lfs, lfs_file_t *file) {
 /// General fs operations ///
 static int lfs_stat_(lfs_t *lfs, const char *path, struct lfs_info *info) {
     lfs_mdir_t cwd;
-    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+    struct lfs_pending *made;
+    lfs_stag_t tag = lfs_dir_lookup(lfs, &cwd, &path, NULL, &made);
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+    if (tag == LFS_ERR_NOENT && made) {
+        // made in a batch
+        memcpy(info->name, lfs_pending_name(made), made->nlen);
+        info->name[made->nlen] = '\0';
+        info->type = LFS_TYPE_DIR;
+        return 0;
+    }
+#endif
     if (tag < 0) {
         return (int)tag;
     }
@@ -3853,12 +4872,39 @@ static int lfs_remove_(lfs_t *lfs, const char *path) {
         return err;
     }
 
+#ifndef LFS_NO_MALLOC
+    const char *fullpath = path;  // looked up again once a batch is in
+#endif
     lfs_mdir_t cwd;
     lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
     if (tag < 0 || lfs_tag_id(tag) == 0x3ff) {
         return (tag < 0) ? (int)tag : LFS_ERR_INVAL;
     }
 
+#ifndef LFS_NO_MALLOC
+    if (lfs_tag_type3(tag) == LFS_TYPE_REG &&
+            lfs_pending_cankeep(lfs, cwd.pair, lfs_tag_id(tag))) {
+        // in a batch, the entry is deleted with the next commit to its
+        // metadata pair
+        return lfs_pending_keep(lfs, LFS_TYPE_DELETE, cwd.pair,
+                lfs_tag_id(tag), NULL, NULL, 0);
+    }
+
+    if (lfs_tag_type3(tag) == LFS_TYPE_DIR && lfs->pending) {
+        // entries of the directory may still be kept by a batch
+        err = lfs_pending_flush(lfs, NULL);
+        if (err) {
+            return err;
+        }
+
+        path = fullpath;
+        tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+        if (tag < 0) {
+            return (int)tag;
+        }
+    }
+#endif
+
     struct lfs_mlist dir;
     dir.next = lfs->mlist;
     if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
@@ -3932,6 +4978,14 @@ static int lfs_rename_(lfs_t *lfs, const char *oldpath, const char *newpath) {
         return err;
     }
 
+#ifndef LFS_NO_MALLOC
+    // moves only deal with entries on disk
+    err = lfs_pending_flush(lfs, NULL);
+    if (err) {
+        return err;
+    }
+#endif
+
     // find old entry
     lfs_mdir_t oldcwd;
     lfs_stag_t oldtag = lfs_dir_find(lfs, &oldcwd, &oldpath, NULL);
@@ -4065,7 +5119,15 @@ static int lfs_rename_(lfs_t *lfs, const char *oldpath, const char *newpath) {
 static lfs_ssize_t lfs_getattr_(lfs_t *lfs, const char *path,
         uint8_t type, void *buffer, lfs_size_t size) {
     lfs_mdir_t cwd;
-    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+    struct lfs_pending *made;
+    lfs_stag_t tag = lfs_dir_lookup(lfs, &cwd, &path, NULL, &made);
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+    if (tag == LFS_ERR_NOENT && made) {
+        // made in a batch, attributes are kept along
+        return lfs_pending_getattr(made, type, buffer,
+                lfs_min(size, lfs->attr_max));
+    }
+#endif
     if (tag < 0) {
         return tag;
     }
@@ -4099,7 +5161,14 @@ static lfs_ssize_t lfs_getattr_(lfs_t *lfs, const char *path,
 static int lfs_commitattr(lfs_t *lfs, const char *path,
         uint8_t type, const void *buffer, lfs_size_t size) {
     lfs_mdir_t cwd;
-    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+    struct lfs_pending *made;
+    lfs_stag_t tag = lfs_dir_lookup(lfs, &cwd, &path, NULL, &made);
+#ifndef LFS_NO_MALLOC
+    if (tag == LFS_ERR_NOENT && made) {
+        // made in a batch, attributes are kept along
+        return lfs_pending_setattr(made, type, buffer, size);
+    }
+#endif
     if (tag < 0) {
         return tag;
     }
@@ -4209,6 +5278,10 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     LFS_ASSERT(lfs->cfg->compact_thresh == (lfs_size_t)-1
             || lfs->cfg->compact_thresh <= lfs->cfg->block_size);
 
+#ifdef LFS_RCACHE_WAYS
+    lfs->rlines.buffer = NULL;
+#endif
+
     // setup read cache
     if (lfs->cfg->read_buffer) {
         lfs->rcache.buffer = lfs->cfg->read_buffer;
@@ -4238,16 +5311,47 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     // setup lookahead buffer, note mount finishes initializing this after
     // we establish a decent pseudo-random seed
     LFS_ASSERT(lfs->cfg->lookahead_size > 0);
+    lfs->lookahead.bsize = lfs->cfg->lookahead_size;
     if (lfs->cfg->lookahead_buffer) {
         lfs->lookahead.buffer = lfs->cfg->lookahead_buffer;
     } else {
-        lfs->lookahead.buffer = lfs_malloc(lfs->cfg->lookahead_size);
+#ifdef LFS_ALLOC_BITMAP
+        // track every block of the device in one bitmap
+        lfs->lookahead.bsize = lfs_max(lfs->lookahead.bsize,
+                (lfs->block_count + 7) / 8);
+#endif
+        lfs->lookahead.buffer = lfs_malloc(lfs->lookahead.bsize);
         if (!lfs->lookahead.buffer) {
             err = LFS_ERR_NOMEM;
             goto cleanup;
         }
     }
 
+#ifdef LFS_RCACHE_WAYS
+    // setup read cache lines
+    lfs->rlines.buffer = lfs_malloc(
+            LFS_RCACHE_SETS*LFS_RCACHE_WAYS*lfs->cfg->cache_size);
+    if (!lfs->rlines.buffer) {
+        err = LFS_ERR_NOMEM;
+        goto cleanup;
+    }
+
+    for (int i = 0; i < LFS_RCACHE_SETS*LFS_RCACHE_WAYS; i++) {
+        lfs->rlines.lines[i].c.buffer
+                = &lfs->rlines.buffer[i*lfs->cfg->cache_size];
+        lfs_cache_drop(lfs, &lfs->rlines.lines[i].c);
+        lfs->rlines.lines[i].used = 0;
+        lfs->rlines.lines[i].prefetched = false;
+    }
+    lfs->rlines.tick = 0;
+    lfs->rlines.next_block = LFS_BLOCK_NULL;
+    lfs->rlines.next_off = 0;
+    lfs->rlines.hits = 0;
+    lfs->rlines.misses = 0;
+    lfs->rlines.prefetches = 0;
+    lfs->rlines.prefetch_hits = 0;
+#endif
+
     // check that the size limits are sane
     LFS_ASSERT(lfs->cfg->name_max <= LFS_NAME_MAX);
     lfs->name_max = lfs->cfg->name_max;
@@ -4295,9 +5399,14 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->root[1] = LFS_BLOCK_NULL;
     lfs->mlist = NULL;
     lfs->seed = 0;
+    lfs->batch = 0;
+    lfs->pending = NULL;
     lfs->gdisk = (lfs_gstate_t){0};
     lfs->gstate = (lfs_gstate_t){0};
     lfs->gdelta = (lfs_gstate_t){0};
+#ifdef LFS_DIR_CACHE
+    lfs_dir_cachedrop(lfs);
+#endif
 #ifdef LFS_MIGRATE
     lfs->lfs1 = NULL;
 #endif
@@ -4323,6 +5432,17 @@ static int lfs_deinit(lfs_t *lfs) {
         lfs_free(lfs->lookahead.buffer);
     }
 
+#ifdef LFS_RCACHE_WAYS
+    lfs_free(lfs->rlines.buffer);
+#endif
+
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+    // entries still kept by an unfinished batch are lost
+    while (lfs->pending) {
+        lfs_pending_free(lfs, lfs->pending);
+    }
+#endif
+
     return 0;
 }
 
@@ -4340,9 +5460,9 @@ static int lfs_format_(lfs_t *lfs, const struct lfs_config *cfg) {
         LFS_ASSERT(cfg->block_count != 0);
 
         // create free lookahead
-        memset(lfs->lookahead.buffer, 0, lfs->cfg->lookahead_size);
+        memset(lfs->lookahead.buffer, 0, lfs->lookahead.bsize);
         lfs->lookahead.start = 0;
-        lfs->lookahead.size = lfs_min(8*lfs->cfg->lookahead_size,
+        lfs->lookahead.size = lfs_min(8*lfs->lookahead.bsize,
                 lfs->block_count);
         lfs->lookahead.next = 0;
         lfs_alloc_ckpoint(lfs);
@@ -4404,10 +5524,37 @@ static int lfs_mount_(lfs_t *lfs, const struct lfs_config *cfg) {
 
     // scan directory blocks for superblock and any global updates
     lfs_mdir_t dir = {.tail = {0, 1}};
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+    // directories made in a batch are not in the tail list yet, they are
+    // followed from the entries kept for them up to where they link to it
+    struct lfs_pending *made = lfs->pending;
+    bool inmade = false;
+#endif
+
     lfs_block_t tortoise[2] = {LFS_BLOCK_NULL, LFS_BLOCK_NULL};
     lfs_size_t tortoise_i = 1;
     lfs_size_t tortoise_period = 1;
-    while (!lfs_pair_isnull(dir.tail)) {
+    while (true) {
+#if !defined(LFS_READONLY) && !defined(LFS_NO_MALLOC)
+        if (lfs_pair_isnull(dir.tail) || (inmade && !dir.split)) {
+            while (made && made->type != LFS_TYPE_DIR) {
+                made = made->next;
+            }
+            if (!made) {
+                break;
+            }
+
+            dir.tail[0] = made->child[0];
+            dir.tail[1] = made->child[1];
+            made = made->next;
+            inmade = true;
+        }
+#else
+        if (lfs_pair_isnull(dir.tail)) {
+            break;
+        }
+#endif
+
         // detect cycles with Brent's algorithm
         if (lfs_pair_issync(dir.tail, tortoise)) {
             LFS_WARN("Cycle detected in tail list");
@@ -4428,7 +5575,7 @@ static int lfs_mount_(lfs_t *lfs, const struct lfs_config *cfg) {
                 LFS_MKTAG(LFS_TYPE_SUPERBLOCK, 0, 8),
                 NULL,
                 lfs_dir_find_match, &(struct lfs_dir_find_match){
-                    lfs, "littlefs", 8});
+                    .lfs = lfs, .name = "littlefs", .size = 8});
         if (tag < 0) {
             err = tag;
             goto cleanup;
@@ -4611,6 +5758,13 @@ static int lfs_fs_stat_(lfs_t *lfs, struct lfs_fsinfo *fsinfo) {
     fsinfo->file_max = lfs->file_max;
     fsinfo->attr_max = lfs->attr_max;
 
+#ifdef LFS_RCACHE_WAYS
+    fsinfo->rcache_hits = lfs->rlines.hits;
+    fsinfo->rcache_misses = lfs->rlines.misses;
+    fsinfo->rcache_prefetches = lfs->rlines.prefetches;
+    fsinfo->rcache_prefetch_hits = lfs->rlines.prefetch_hits;
+#endif
+
     return 0;
 }
 
@@ -4724,6 +5878,29 @@ int lfs_fs_traverse_(lfs_t *lfs,
 #ifndef LFS_READONLY
 static int lfs_fs_pred(lfs_t *lfs,
         const lfs_block_t pair[2], lfs_mdir_t *pdir) {
+#ifndef LFS_NO_MALLOC
+    // directories made in a batch come before what they link to, the
+    // newest first
+    for (struct lfs_pending *p = lfs->pending; p; p = p->next) {
+        if (p->type != LFS_TYPE_DIR) {
+            continue;
+        }
+
+        pdir->tail[0] = p->child[0];
+        pdir->tail[1] = p->child[1];
+        do {
+            int err = lfs_dir_fetch(lfs, pdir, pdir->tail);
+            if (err) {
+                return err;
+            }
+
+            if (lfs_pair_cmp(pdir->tail, pair) == 0) {
+                return 0;
+            }
+        } while (pdir->split);
+    }
+#endif
+
     // iterate over all directory directory entries
     pdir->tail[0] = 0;
     pdir->tail[1] = 1;
@@ -5165,7 +6342,7 @@ static int lfs_fs_gc_(lfs_t *lfs) {
     }
 
     // try to populate the lookahead buffer, unless it's already full
-    if (lfs->lookahead.size < 8*lfs->cfg->lookahead_size) {
+    if (lfs->lookahead.size < 8*lfs->lookahead.bsize) {
         err = lfs_alloc_scan(lfs);
         if (err) {
             return err;
@@ -5176,6 +6353,40 @@ static int lfs_fs_gc_(lfs_t *lfs) {
 }
 #endif
 
+#ifndef LFS_READONLY
+static int lfs_batch_begin_(lfs_t *lfs) {
+    lfs->batch += 1;
+    return 0;
+}
+
+static int lfs_batch_commit_(lfs_t *lfs) {
+    LFS_ASSERT(lfs->batch > 0);
+    lfs->batch -= 1;
+    if (lfs->batch) {
+        return 0;
+    }
+
+    // sync files still waiting for their entry, so everything created in
+    // the batch can be found by path
+    for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
+        if (d->type == LFS_TYPE_REG &&
+                (((lfs_file_t*)d)->flags & LFS_F_CREATING)) {
+            int err = lfs_file_sync_(lfs, (lfs_file_t*)d);
+            if (err) {
+                return err;
+            }
+        }
+    }
+
+#ifndef LFS_NO_MALLOC
+    // and commit the removed entries and made directories not yet in
+    return lfs_pending_flush(lfs, NULL);
+#else
+    return 0;
+#endif
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_fs_grow_(lfs_t *lfs, lfs_size_t block_count) {
     // shrinking is not supported
@@ -6191,6 +7402,24 @@ int lfs_file_truncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
 }
 #endif
 
+#ifndef LFS_READONLY
+int lfs_file_reserve(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_reserve(%p, %p, %"PRIu32")",
+            (void*)lfs, (void*)file, size);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    err = lfs_file_reserve_(lfs, file, size);
+
+    LFS_TRACE("lfs_file_reserve -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
 lfs_soff_t lfs_file_tell(lfs_t *lfs, lfs_file_t *file) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
@@ -6413,6 +7642,36 @@ int lfs_fs_gc(lfs_t *lfs) {
 }
 #endif
 
+#ifndef LFS_READONLY
+int lfs_batch_begin(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_batch_begin(%p)", (void*)lfs);
+
+    err = lfs_batch_begin_(lfs);
+
+    LFS_TRACE("lfs_batch_begin -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
+int lfs_batch_commit(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_batch_commit(%p)", (void*)lfs);
+
+    err = lfs_batch_commit_(lfs);
+
+    LFS_TRACE("lfs_batch_commit -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
 #ifndef LFS_READONLY
 int lfs_fs_grow(lfs_t *lfs, lfs_size_t block_count) {
     int err = LFS_LOCK(lfs->cfg);
@@ -51,6 +51,35 @@ typedef uint32_t lfs_block_t;
 #define LFS_NAME_MAX 255
 #endif
 
+// Number of CTZ skip-list positions cached per open file, undefined by
+// default. When defined, seeks that leave the current block start the
+// skip-list walk from the closest cached block instead of the file head, so
+// repeated random access into large files needs few or no extra reads.
+// Costs 8*LFS_CTZ_INDEX bytes of RAM per lfs_file_t.
+//#define LFS_CTZ_INDEX 32
+
+// Number of metadata-pair fetches cached per filesystem, undefined by
+// default. When defined, directory fetches and the name lookups of path
+// resolution reuse the parsed state of a recently fetched metadata pair
+// while its revision counts and the word past its last commit are unchanged,
+// instead of rescanning and CRC-checking the whole commit log.
+// Only a single lfs_t per storage is supported: like every other read, the
+// check goes through the read cache, so a change made through another lfs_t
+// is not seen until this one is remounted.
+// Costs about 64*LFS_DIR_CACHE bytes of RAM per lfs_t.
+//#define LFS_DIR_CACHE 8
+
+// Number of extra read cache lines per set, undefined by default. When
+// defined, reads through the filesystem's read cache are served by
+// LFS_RCACHE_SETS*LFS_RCACHE_WAYS lines of cache_size bytes with LRU
+// replacement, so alternating metadata and data reads stop evicting each
+// other. A miss that continues the previous load also prefetches the next
+// line of the block. Hit counters are reported by lfs_fs_stat.
+//#define LFS_RCACHE_WAYS 4
+#if defined(LFS_RCACHE_WAYS) && !defined(LFS_RCACHE_SETS)
+#define LFS_RCACHE_SETS 1
+#endif
+
 // Maximum size of a file in bytes, may be redefined to limit to support other
 // drivers. Limited on disk to <= 2147483647. Stored in superblock and must be
 // respected by other littlefs drivers.
@@ -143,6 +172,9 @@ enum lfs_open_flags {
     LFS_F_ERRED   = 0x080000, // An error occurred during write
 #endif
     LFS_F_INLINE  = 0x100000, // Currently inlined in directory entry
+#ifndef LFS_READONLY
+    LFS_F_CREATING = 0x200000, // Directory entry is created on the next sync
+#endif
 };
 
 // File seek flags
@@ -227,6 +259,11 @@ struct lfs_config {
     // increases the number of blocks found during an allocation pass. The
     // lookahead buffer is stored as a compact bitmap, so each byte of RAM
     // can track 8 blocks.
+    //
+    // If LFS_ALLOC_BITMAP is defined and no lookahead_buffer is provided, the
+    // lookahead buffer is enlarged to a bitmap of the whole device, so the
+    // filesystem is only traversed once per pass over all blocks instead of
+    // once every 8*lookahead_size allocations.
     lfs_size_t lookahead_size;
 
     // Threshold for metadata compaction during lfs_fs_gc in bytes. Metadata
@@ -326,6 +363,15 @@ struct lfs_fsinfo {
 
     // Upper limit on the size of custom attributes in bytes.
     lfs_size_t attr_max;
+
+#ifdef LFS_RCACHE_WAYS
+    // Read cache line hits, loads and prefetches since mount, and how many
+    // prefetched lines were read before being evicted.
+    lfs_size_t rcache_hits;
+    lfs_size_t rcache_misses;
+    lfs_size_t rcache_prefetches;
+    lfs_size_t rcache_prefetch_hits;
+#endif
 };
 
 // Custom attribute structure, used to describe custom attributes
@@ -413,6 +459,21 @@ typedef struct lfs_file {
     lfs_block_t block;
     lfs_off_t off;
     lfs_cache_t cache;
+    char *name;
+
+#ifdef LFS_CTZ_INDEX
+    // block index -> block address of the blocks visited in the CTZ
+    // skip-list, direct mapped by index, valid only for the ctz it was
+    // built for
+    struct lfs_ctz_cache {
+        lfs_block_t head;
+        lfs_size_t size;
+        struct lfs_ctz_entry {
+            lfs_off_t index;
+            lfs_block_t block;
+        } entries[LFS_CTZ_INDEX];
+    } index;
+#endif
 
     const struct lfs_file_config *cfg;
 } lfs_file_t;
@@ -444,6 +505,8 @@ typedef struct lfs {
         lfs_mdir_t m;
     } *mlist;
     uint32_t seed;
+    uint32_t batch;
+    struct lfs_pending *pending;
 
     lfs_gstate_t gstate;
     lfs_gstate_t gdisk;
@@ -454,9 +517,45 @@ typedef struct lfs {
         lfs_block_t size;
         lfs_block_t next;
         lfs_block_t ckpoint;
+        lfs_size_t bsize;
         uint8_t *buffer;
     } lookahead;
 
+#ifdef LFS_RCACHE_WAYS
+    struct lfs_rlines {
+        uint8_t *buffer;
+        uint32_t tick;
+        // where a sequential read would miss next
+        lfs_block_t next_block;
+        lfs_off_t next_off;
+        struct lfs_rline {
+            lfs_cache_t c;
+            uint32_t used;
+            bool prefetched;
+        } lines[LFS_RCACHE_SETS*LFS_RCACHE_WAYS];
+        lfs_size_t hits;
+        lfs_size_t misses;
+        lfs_size_t prefetches;
+        lfs_size_t prefetch_hits;
+    } rlines;
+#endif
+
+#ifdef LFS_DIR_CACHE
+    struct lfs_dir_cache {
+        uint32_t tick;
+        struct lfs_dir_cache_entry {
+            lfs_mdir_t m;
+            uint32_t stamp[3];
+            uint32_t hash;
+            lfs_size_t namelen;
+            lfs_off_t nameoff;
+            int32_t tag;
+            uint16_t id;
+            uint32_t used;
+        } entries[LFS_DIR_CACHE];
+    } dcache;
+#endif
+
     const struct lfs_config *cfg;
     lfs_size_t block_count;
     lfs_size_t name_max;
@@ -638,6 +737,19 @@ lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
 int lfs_file_truncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size);
 #endif
 
+#ifndef LFS_READONLY
+// Prepares a file that is written up to the specified size
+//
+// An inline file that will outgrow inline_max is moved to its own block
+// right away, so the data goes straight into the CTZ skip-list instead of
+// being committed inline and copied out later. Only takes effect when the
+// file position is at the end of the file. Blocks are still allocated as
+// the data is written.
+//
+// Returns a negative error code on failure.
+int lfs_file_reserve(lfs_t *lfs, lfs_file_t *file, lfs_off_t size);
+#endif
+
 // Return the position of the file
 //
 // Equivalent to lfs_file_seek(lfs, file, 0, LFS_SEEK_CUR)
@@ -762,6 +874,33 @@ int lfs_fs_mkconsistent(lfs_t *lfs);
 int lfs_fs_gc(lfs_t *lfs);
 #endif
 
+#ifndef LFS_READONLY
+// Start a batch of filesystem operations
+//
+// Until the matching lfs_batch_commit, a file created by lfs_file_open with
+// LFS_O_CREAT gets its directory entry in the same metadata commit as its
+// contents on the first sync or close, instead of a commit of its own. Such
+// a file can't be found by path until then. Files removed by lfs_remove and
+// directories made by lfs_mkdir are kept in RAM and go in with the next
+// commit to the same metadata pair, so the operations on one directory
+// share commits. This is not done while a directory is open, for an entry
+// with an open file, or past LFS_BATCH_MAX kept entries. Batches may be
+// nested.
+//
+// Returns a negative error code on failure.
+int lfs_batch_begin(lfs_t *lfs);
+
+// Finish a batch of filesystem operations
+//
+// When the outermost batch finishes, files that are still open and waiting
+// for their directory entry are synced, and the removed files and made
+// directories still kept are committed. Until then a power loss keeps the
+// removed files and loses the made directories.
+//
+// Returns a negative error code on failure.
+int lfs_batch_commit(lfs_t *lfs);
+#endif
+
 #ifndef LFS_READONLY
 // Grows the filesystem to a new size, updating the superblock with the new
 // block count.
@@ -7,6 +7,7 @@
 #include <string.h>
 #include "lfs.h"
 #include "mimic_fat.h"
+#include "powerloss.h"
 
 //--------------------------------------------
 #define FLASH_SECTOR_SIZE   4096
@@ -28,6 +29,15 @@ static int read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, vo
 static int prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
 {
 	uint32_t addr = (block * c->block_size) + off;
+	powerloss_cut_t cut;
+	if (powerloss_cut(&cut))
+	{
+		if (cut == POWERLOSS_TEAR)
+		{
+			memcpy(flash_memory + addr, buffer, size / 2);
+		}
+		powerloss_reboot();
+	}
 	memcpy(flash_memory + addr, buffer, size);
 	return LFS_ERR_OK;
 }
@@ -36,6 +46,15 @@ static int prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, co
 static int erase(const struct lfs_config *c, lfs_block_t block)
 {
 	uint32_t addr = (block * c->block_size);
+	powerloss_cut_t cut;
+	if (powerloss_cut(&cut))
+	{
+		if (cut == POWERLOSS_TEAR)
+		{
+			memset(flash_memory + addr, 0xff, c->block_size / 2);
+		}
+		powerloss_reboot();
+	}
 	memset(flash_memory + addr, 0xff, c->block_size);
 	return LFS_ERR_OK;
 }
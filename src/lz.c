@@ -0,0 +1,111 @@
+/*
+ * LZSS codec for cluster sized buffers
+ *
+ * A flag byte precedes each group of eight items, a set bit marks a match and a clear bit
+ * a literal byte. A match is two bytes: a 10-bit distance and a 6-bit length.
+ *
+ * Copyright (c) 2024, Vladimir Alemasov
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <string.h>
+#include "lz.h"
+
+
+#define LZ_DISTANCE_BITS  10
+#define LZ_LENGTH_BITS    6
+#define LZ_MIN_MATCH      3
+#define LZ_MAX_DISTANCE   (1 << LZ_DISTANCE_BITS)
+#define LZ_MAX_MATCH      (LZ_MIN_MATCH + (1 << LZ_LENGTH_BITS) - 1)
+#define LZ_HASH_BITS      8
+#define LZ_NO_POSITION    0xFFFF
+
+static uint32_t lz_hash(const uint8_t *p) {
+    uint32_t v = p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Compress src into dst, returns the compressed size or 0 if it doesn't fit in dst_size
+ */
+size_t lz_compress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size) {
+    uint16_t table[1 << LZ_HASH_BITS];
+    size_t s = 0;
+    size_t d = 0;
+    size_t flag_pos = 0;
+    uint8_t flag_bit = 0;
+
+    if (src_size >= LZ_NO_POSITION)
+        return 0;
+    memset(table, 0xFF, sizeof(table));
+
+    while (s < src_size) {
+        if (flag_bit == 0) {
+            if (d >= dst_size)
+                return 0;
+            flag_pos = d++;
+            dst[flag_pos] = 0;
+            flag_bit = 1;
+        }
+
+        size_t length = 0;
+        size_t distance = 0;
+        if (s + LZ_MIN_MATCH <= src_size) {
+            uint32_t h = lz_hash(&src[s]);
+            size_t candidate = table[h];
+            table[h] = s;
+            if (candidate != LZ_NO_POSITION && s - candidate <= LZ_MAX_DISTANCE) {
+                size_t limit = src_size - s < LZ_MAX_MATCH ? src_size - s : LZ_MAX_MATCH;
+                while (length < limit && src[candidate + length] == src[s + length])
+                    length++;
+                distance = s - candidate;
+            }
+        }
+
+        if (length >= LZ_MIN_MATCH) {
+            if (d + 2 > dst_size)
+                return 0;
+            dst[d++] = (distance - 1) >> (LZ_DISTANCE_BITS - 8);
+            dst[d++] = ((distance - 1) << LZ_LENGTH_BITS | (length - LZ_MIN_MATCH)) & 0xFF;
+            dst[flag_pos] |= flag_bit;
+            for (size_t i = s + 1; i < s + length && i + LZ_MIN_MATCH <= src_size; i++)
+                table[lz_hash(&src[i])] = i;
+            s += length;
+        } else {
+            if (d >= dst_size)
+                return 0;
+            dst[d++] = src[s++];
+        }
+        flag_bit <<= 1;
+    }
+    return d;
+}
+
+/*
+ * Decompress src into dst, returns the decompressed size or 0 for a malformed input
+ */
+size_t lz_decompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size) {
+    size_t s = 0;
+    size_t d = 0;
+
+    while (s < src_size) {
+        uint8_t flags = src[s++];
+        for (int bit = 0; bit < 8 && s < src_size; bit++) {
+            if ((flags & (1 << bit)) == 0) {
+                if (d >= dst_size)
+                    return 0;
+                dst[d++] = src[s++];
+                continue;
+            }
+            if (s + 2 > src_size)
+                return 0;
+            size_t distance = (((size_t)src[s] << (LZ_DISTANCE_BITS - 8)) | (src[s + 1] >> LZ_LENGTH_BITS)) + 1;
+            size_t length = (src[s + 1] & ((1 << LZ_LENGTH_BITS) - 1)) + LZ_MIN_MATCH;
+            s += 2;
+            if (distance > d || d + length > dst_size)
+                return 0;
+            for (size_t i = 0; i < length; i++, d++)
+                dst[d] = dst[d - distance];
+        }
+    }
+    return d;
+}
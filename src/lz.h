@@ -0,0 +1,17 @@
+/*
+ * LZSS codec for cluster sized buffers
+ *
+ * Copyright (c) 2024, Vladimir Alemasov
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef PICO_LITTLEFS_USB_LZ_H_
+#define PICO_LITTLEFS_USB_LZ_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+size_t lz_compress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size);
+size_t lz_decompress(const uint8_t *src, size_t src_size, uint8_t *dst, size_t dst_size);
+
+#endif
@@ -9,17 +9,18 @@
 #include <string.h>     /* memcpy */
 #include <time.h>       /* time */
 #include <stdbool.h>    /* bool */
+#include <stddef.h>     /* offsetof */
 #include <errno.h>		/* errno */
 #include <assert.h>     /* assert */
 #include <pcap/pcap.h>  /* pcap library stuff */
 #ifdef _WIN32
 #include "win/getopt.h"
 #else
-#include <stddef.h>     /* offsetof */
 #include <signal.h>     /* signal */
 #include <sys/time.h>   /* gettimeofday */
 #include <fcntl.h>      /* open */
-#include <unistd.h>     /* usleep, getopt, write, close */
+#include <unistd.h>     /* usleep, getopt, write, close, fork, dup2 */
+#include <sys/wait.h>   /* waitpid */
 extern char *optarg;
 #ifndef HANDLE
 #define HANDLE int
@@ -28,6 +29,9 @@ extern char *optarg;
 #include "lfs.h"
 #include "mimic_fat.h"
 #include "tests.h"
+#include "powerloss.h"
+#include "write_behind.h"
+#include "msc_trace.h"
 
 
 //--------------------------------------------
@@ -35,10 +39,19 @@ typedef struct options
 {
 	int opt_r;
 	int opt_c;
+	int opt_z;
+	int opt_d;
+	int opt_f;
 	char *opt_t_arg;
+	char *opt_p_arg;
+	char *opt_w_arg;
+	char *opt_o_arg;
+	char *opt_i_arg;
+	char *opt_n_arg;
 } options_t;
 static options_t ts;
 static test_t *test;
+extern const struct lfs_config lfs_pico_flash_config;  // littlefs_driver.c
 
 //--------------------------------------------
 static int dlt;
@@ -49,8 +62,6 @@ static char err_buf[PCAP_ERRBUF_SIZE];
 #define LINKTYPE_USBPCAP                249
 #define LINKTYPE_USB_LINUX_MMAPPED      220
 #define USB_MSC_BOT_CBW_SIGNATURE       0x43425355
-#define SCSI_READ_10                    0x28
-#define SCSI_WRITE_10                   0x2A
 
 //--------------------------------------------
 #pragma pack(push, 1)
@@ -109,152 +120,772 @@ typedef struct
 	uint8_t CB[16];
 } usb_msc_bot_cbw_t;
 
-// READ(10), WRITE(10) command
+#pragma pack(pop)
+
+//--------------------------------------------
+// What the replay does with a SCSI command
+typedef enum
+{
+	SCSI_EVENT_NONE,
+	SCSI_EVENT_READ,
+	SCSI_EVENT_WRITE,
+	SCSI_EVENT_SYNC,            // flush point
+	SCSI_EVENT_START_STOP,      // eject when LOEJ is set and START is clear
+} scsi_event_t;
+
 typedef struct
 {
 	uint8_t operation_code;
-	uint8_t bit_fields;
-	uint8_t logical_block_address[4];
-	uint8_t group_number;
-	uint8_t transfer_length[2];
-	uint8_t control;
-} cdb_rw_10_t;
+	uint8_t cdb_length;
+	const char *name;
+	scsi_event_t event;
+	uint8_t lba_offset;         // big-endian LOGICAL BLOCK ADDRESS of READ and WRITE
+	uint8_t lba_size;
+	uint8_t length_offset;      // big-endian TRANSFER LENGTH of READ and WRITE
+	uint8_t length_size;
+} scsi_command_t;
 
+static const scsi_command_t scsi_commands[] =
+{
+	{ .operation_code = 0x00, .cdb_length =  6, .name = "TEST UNIT READY",              .event = SCSI_EVENT_NONE },
+	{ .operation_code = 0x03, .cdb_length =  6, .name = "REQUEST SENSE",                .event = SCSI_EVENT_NONE },
+	{ .operation_code = 0x12, .cdb_length =  6, .name = "INQUIRY",                      .event = SCSI_EVENT_NONE },
+	{ .operation_code = 0x1A, .cdb_length =  6, .name = "MODE SENSE(6)",                .event = SCSI_EVENT_NONE },
+	{ .operation_code = 0x1B, .cdb_length =  6, .name = "START STOP UNIT",              .event = SCSI_EVENT_START_STOP },
+	{ .operation_code = 0x1E, .cdb_length =  6, .name = "PREVENT ALLOW MEDIUM REMOVAL", .event = SCSI_EVENT_NONE },
+	{ .operation_code = 0x23, .cdb_length = 10, .name = "READ FORMAT CAPACITIES",       .event = SCSI_EVENT_NONE },
+	{ .operation_code = 0x25, .cdb_length = 10, .name = "READ CAPACITY(10)",            .event = SCSI_EVENT_NONE },
+	{ .operation_code = 0x28, .cdb_length = 10, .name = "READ(10)",                     .event = SCSI_EVENT_READ,
+	  .lba_offset = 2, .lba_size = 4, .length_offset = 7, .length_size = 2 },
+	{ .operation_code = 0x2A, .cdb_length = 10, .name = "WRITE(10)",                    .event = SCSI_EVENT_WRITE,
+	  .lba_offset = 2, .lba_size = 4, .length_offset = 7, .length_size = 2 },
+	{ .operation_code = 0x35, .cdb_length = 10, .name = "SYNCHRONIZE CACHE(10)",        .event = SCSI_EVENT_SYNC },
+	{ .operation_code = 0x5A, .cdb_length = 10, .name = "MODE SENSE(10)",               .event = SCSI_EVENT_NONE },
+	{ .operation_code = 0x88, .cdb_length = 16, .name = "READ(16)",                     .event = SCSI_EVENT_READ,
+	  .lba_offset = 2, .lba_size = 8, .length_offset = 10, .length_size = 4 },
+	{ .operation_code = 0x8A, .cdb_length = 16, .name = "WRITE(16)",                    .event = SCSI_EVENT_WRITE,
+	  .lba_offset = 2, .lba_size = 8, .length_offset = 10, .length_size = 4 },
+	{ .operation_code = 0x91, .cdb_length = 16, .name = "SYNCHRONIZE CACHE(16)",        .event = SCSI_EVENT_SYNC },
+	{ .operation_code = 0x9E, .cdb_length = 16, .name = "READ CAPACITY(16)",            .event = SCSI_EVENT_NONE },
+	{ .operation_code = 0xA8, .cdb_length = 12, .name = "READ(12)",                     .event = SCSI_EVENT_READ,
+	  .lba_offset = 2, .lba_size = 4, .length_offset = 6, .length_size = 4 },
+	{ .operation_code = 0xAA, .cdb_length = 12, .name = "WRITE(12)",                    .event = SCSI_EVENT_WRITE,
+	  .lba_offset = 2, .lba_size = 4, .length_offset = 6, .length_size = 4 },
+};
+
+//--------------------------------------------
+static const scsi_command_t *find_scsi_command(const usb_msc_bot_cbw_t *cbw)
+{
+	for (size_t cnt = 0; cnt < sizeof(scsi_commands) / sizeof(scsi_commands[0]); cnt++)
+	{
+		if (scsi_commands[cnt].operation_code == cbw->CB[0])
+		{
+			return cbw->bCBLength >= scsi_commands[cnt].cdb_length ? &scsi_commands[cnt] : NULL;
+		}
+	}
+	return NULL;
+}
+
+//--------------------------------------------
+static uint64_t get_cdb_field(const uint8_t *cdb, uint8_t offset, uint8_t size)
+{
+	uint64_t value = 0;
+	for (uint8_t cnt = 0; cnt < size; cnt++)
+	{
+		value = value << 8 | cdb[offset + cnt];
+	}
+	return value;
+}
+
+//--------------------------------------------
+// Transfers are tracked by URB: a submission is paired with its completion by the
+// URB ID (irpId of USBPcap, id of usbmon), OUT data is taken from the submission and
+// used once the completion reports success, IN data comes with the completion.
+// Completed URBs drive a bulk-only transport transaction per device:
+// CBW -> data in any number of URBs -> CSW.
+
+//--------------------------------------------
+#define USB_MSC_BOT_CSW_SIGNATURE       0x53425355
+#define USB_TRANSFER_BULK               3
+#define USB_DIR_IN                      0x80
+#define USBPCAP_INFO_PDO_TO_FDO         0x01
+#define USBMON_TYPE_SUBMISSION          'S'
+#define MSC_TRANSACTIONS_MAX            8
+
+//--------------------------------------------
+// Command Status Wrapper
+#pragma pack(push, 1)
+typedef struct
+{
+	uint32_t dSignature;
+	uint32_t dTag;
+	uint32_t dDataResidue;
+	uint8_t bStatus;
+} usb_msc_bot_csw_t;
 #pragma pack(pop)
 
 //--------------------------------------------
-static uint8_t *data_buffer;
-static bool fs_reboot;
-static bool data_comparison;
+// Bulk URB of a capture record
+typedef struct
+{
+	uint64_t id;
+	bool is_completion;
+	bool is_ok;                 // status of a completion
+	uint16_t bus;
+	uint16_t device;
+	uint8_t endpoint;
+	uint32_t actual_length;     // transferred length of a completion, 0 if the capture doesn't tell
+	const uint8_t *data;
+	uint32_t data_length;
+	uint32_t captured_length;   // of data, less than data_length if the record is truncated
+} usb_urb_t;
 
 //--------------------------------------------
-void pcap_callback(u_char *ptr, const struct pcap_pkthdr *header, const u_char *packet)
+// Submitted URB waiting for its completion
+typedef struct
 {
-	static size_t packet_num;
-	static uint16_t dev_addr;
-	static bool read_data;
-	static bool write_data;
-	static uint32_t lba;
-	static uint16_t lbn;
+	uint64_t id;
+	uint16_t bus;
+	uint16_t device;
+	uint8_t endpoint;
+	size_t packet_num;          // of the submission
+	uint8_t *data;              // copy of the OUT data
 	uint32_t data_length;
-	size_t header_length;
-	uint16_t actual_dev_addr;
+} pending_urb_t;
 
-	packet_num++;
+//--------------------------------------------
+// Bulk-only transport transaction of a device
+typedef struct
+{
+	bool is_used;
+	bool is_open;               // CBW seen, CSW not yet
+	uint16_t bus;
+	uint16_t device;
+	uint32_t tag;
+	const scsi_command_t *command;
+	uint32_t lba;
+	uint32_t lbn;
+	uint32_t transferred;       // data stage bytes so far
+	uint8_t *buffer;            // sectors rendered for a READ, received for a WRITE
+	size_t packet_num;          // submission of the last data URB
+	bool is_applied;            // WRITE data handed to mimic_fat
+	size_t trace_command;       // record of the trace written with -o
+} msc_transaction_t;
+
+//--------------------------------------------
+static pending_urb_t *pending_urbs;
+static size_t pending_urb_num;
+static size_t pending_urb_max;
+static msc_transaction_t transactions[MSC_TRANSACTIONS_MAX];
+static uint16_t dev_addr;
+static uint64_t packet_time_us; // of the record in pcap_callback
+static bool is_demuxed;         // only the URBs of the addresses of demux_instance are replayed
+static size_t demux_instance;
+
+//--------------------------------------------
+// USB address of a mass storage device in the capture (-d)
+// A device that is pulled out and reinserted comes back with a new address.
+typedef struct
+{
+	uint16_t bus;
+	uint16_t device;
+	size_t first_packet;        // first CBW
+	size_t last_packet;         // last URB
+	size_t instance;            // replaying the address
+} demux_address_t;
+
+static demux_address_t demux_addresses[MSC_TRANSACTIONS_MAX];
+static size_t demux_address_num;
+
+//--------------------------------------------
+static bool is_demux_address(uint16_t bus, uint16_t device)
+{
+	for (size_t cnt = 0; cnt < demux_address_num; cnt++)
+	{
+		if (demux_addresses[cnt].instance == demux_instance
+			&& demux_addresses[cnt].bus == bus && demux_addresses[cnt].device == device)
+		{
+			return true;
+		}
+	}
+	return false;
+}
 
+//--------------------------------------------
+static bool parse_urb(const struct pcap_pkthdr *header, const u_char *packet, usb_urb_t *urb)
+{
+	memset(urb, 0, sizeof(usb_urb_t));
 	switch (dlt)
 	{
 		case LINKTYPE_USBPCAP:
 		{
 			usbpcap_packet_header_t *usbpcap_packet_header = (usbpcap_packet_header_t *)packet;
-			data_length = usbpcap_packet_header->dataLength;
-			actual_dev_addr = usbpcap_packet_header->device;
-			header_length = sizeof(usbpcap_packet_header_t);
+			if (header->caplen < sizeof(usbpcap_packet_header_t) || usbpcap_packet_header->transfer != USB_TRANSFER_BULK)
+			{
+				return false;
+			}
+			urb->id = usbpcap_packet_header->irpId;
+			urb->is_completion = (usbpcap_packet_header->info & USBPCAP_INFO_PDO_TO_FDO) != 0;
+			urb->is_ok = usbpcap_packet_header->status == 0;
+			urb->bus = usbpcap_packet_header->bus;
+			urb->device = usbpcap_packet_header->device;
+			urb->endpoint = usbpcap_packet_header->endpoint;
+			urb->data = packet + usbpcap_packet_header->headerLen;
+			urb->data_length = usbpcap_packet_header->dataLength;
+			if (usbpcap_packet_header->headerLen > header->caplen)
+			{
+				return false;
+			}
+			urb->captured_length = header->caplen - usbpcap_packet_header->headerLen;
 			break;
 		}
 		case LINKTYPE_USB_LINUX_MMAPPED:
 		{
 			usbmon_packet_header_t *usbmon_packet_header = (usbmon_packet_header_t *)packet;
-			data_length = usbmon_packet_header->len_cap;
-			actual_dev_addr = usbmon_packet_header->devnum;
-			header_length = sizeof(usbmon_packet_header_t);
+			if (header->caplen < sizeof(usbmon_packet_header_t) || usbmon_packet_header->xfer_type != USB_TRANSFER_BULK)
+			{
+				return false;
+			}
+			urb->id = usbmon_packet_header->id;
+			urb->is_completion = usbmon_packet_header->type != USBMON_TYPE_SUBMISSION;
+			urb->is_ok = usbmon_packet_header->status == 0;
+			urb->bus = usbmon_packet_header->busnum;
+			urb->device = usbmon_packet_header->devnum;
+			urb->endpoint = usbmon_packet_header->epnum;
+			urb->actual_length = usbmon_packet_header->length;
+			urb->data = packet + sizeof(usbmon_packet_header_t);
+			urb->data_length = usbmon_packet_header->len_cap;
+			urb->captured_length = header->caplen - sizeof(usbmon_packet_header_t);
 			break;
 		}
+		default:
+			return false;
+	}
+	if (urb->captured_length > urb->data_length)
+	{
+		urb->captured_length = urb->data_length;
+	}
+	return true;
+}
+
+//--------------------------------------------
+static pending_urb_t *find_pending_urb(const usb_urb_t *urb)
+{
+	for (size_t cnt = 0; cnt < pending_urb_num; cnt++)
+	{
+		if (pending_urbs[cnt].id == urb->id && pending_urbs[cnt].bus == urb->bus)
+		{
+			return &pending_urbs[cnt];
+		}
+	}
+	return NULL;
+}
+
+//--------------------------------------------
+static void submit_urb(const usb_urb_t *urb, size_t packet_num)
+{
+	pending_urb_t *pending = find_pending_urb(urb);
+	if (pending)
+	{
+		free(pending->data);  // its completion is not in the capture
+	}
+	else
+	{
+		if (pending_urb_num == pending_urb_max)
+		{
+			pending_urb_max = pending_urb_max ? pending_urb_max * 2 : 16;
+			pending_urbs = (pending_urb_t *)realloc(pending_urbs, pending_urb_max * sizeof(pending_urb_t));
+			assert(pending_urbs);
+		}
+		pending = &pending_urbs[pending_urb_num++];
 	}
+	pending->id = urb->id;
+	pending->bus = urb->bus;
+	pending->device = urb->device;
+	pending->endpoint = urb->endpoint;
+	pending->packet_num = packet_num;
+	pending->data = NULL;
+	pending->data_length = 0;
+	if (!(urb->endpoint & USB_DIR_IN) && urb->captured_length)
+	{
+		pending->data = (uint8_t *)malloc(urb->captured_length);
+		assert(pending->data);
+		memcpy(pending->data, urb->data, urb->captured_length);
+		pending->data_length = urb->captured_length;
+	}
+}
+
+//--------------------------------------------
+static void release_pending_urb(pending_urb_t *pending)
+{
+	free(pending->data);
+	*pending = pending_urbs[--pending_urb_num];
+}
 
-	if (data_length == sizeof(usb_msc_bot_cbw_t))
+//--------------------------------------------
+static msc_transaction_t *find_transaction(uint16_t bus, uint16_t device)
+{
+	msc_transaction_t *unused = NULL;
+	for (size_t cnt = 0; cnt < MSC_TRANSACTIONS_MAX; cnt++)
 	{
-		usb_msc_bot_cbw_t *usb_msc_bot_cbw = (usb_msc_bot_cbw_t *)(packet + header_length);
-		if (usb_msc_bot_cbw->dSignature == USB_MSC_BOT_CBW_SIGNATURE && usb_msc_bot_cbw->bCBLength == sizeof(cdb_rw_10_t))
+		if (transactions[cnt].is_used && transactions[cnt].bus == bus && transactions[cnt].device == device)
+		{
+			return &transactions[cnt];
+		}
+		if (!transactions[cnt].is_used && !unused)
 		{
-			if (dev_addr != actual_dev_addr)
+			unused = &transactions[cnt];
+		}
+	}
+	if (unused)
+	{
+		memset(unused, 0, sizeof(msc_transaction_t));
+		unused->is_used = true;
+		unused->bus = bus;
+		unused->device = device;
+	}
+	return unused;
+}
+
+//--------------------------------------------
+static void apply_write_data(msc_transaction_t *t)
+{
+	uint32_t sectors = t->transferred / 512;
+
+	if (t->is_applied || !sectors)
+	{
+		return;
+	}
+	printf(ANSI_YELLOW"\r\nPacket No %ld, write %u sectors from %u\r\n"ANSI_CLEAR, t->packet_num, sectors, t->lba);
+	write_behind_write(t->lba, t->buffer, sectors);
+	t->is_applied = true;
+}
+
+//--------------------------------------------
+static void close_transaction(msc_transaction_t *t)
+{
+	if (ts.opt_o_arg && t->is_open)
+	{
+		msc_trace_close_command(t->trace_command);
+	}
+	if (t->command && t->command->event == SCSI_EVENT_WRITE)
+	{
+		apply_write_data(t);  // the sectors the device has received
+	}
+	free(t->buffer);
+	t->buffer = NULL;
+	t->command = NULL;
+	t->is_open = false;
+}
+
+//--------------------------------------------
+static void compare_read_data(msc_transaction_t *t, const uint8_t *read_buffer, uint32_t length)
+{
+	for (size_t cnt = 0; cnt < length && t->transferred + cnt < t->lbn * 512; cnt++)
+	{
+		size_t pos = t->transferred + cnt;
+		if (t->buffer[pos] != read_buffer[cnt])
+		{
+			printf(ANSI_YELLOW"Data is not equal, sector %d, byte %d, actual data = 0x%02x, read data = 0x%02x\r\n"ANSI_CLEAR,
+				(int)(t->lba + pos / 512), (int)(pos % 512), t->buffer[pos], read_buffer[cnt]);
+		}
+	}
+}
+
+//--------------------------------------------
+static size_t trace_command_block(const usb_msc_bot_cbw_t *usb_msc_bot_cbw, const scsi_command_t *command, const usb_urb_t *urb, size_t packet_num)
+{
+	msc_trace_command_t record;
+
+	memset(&record, 0, sizeof(record));
+	record.timestamp_us = packet_time_us;
+	record.packet_num = (uint32_t)packet_num;
+	record.bus = urb->bus;
+	record.device = urb->device;
+	record.tag = usb_msc_bot_cbw->dTag;
+	record.cdb_length = usb_msc_bot_cbw->bCBLength;
+	memcpy(record.cdb, usb_msc_bot_cbw->CB, sizeof(record.cdb));
+	if (command && (command->event == SCSI_EVENT_READ || command->event == SCSI_EVENT_WRITE))
+	{
+		record.lba = (uint32_t)get_cdb_field(usb_msc_bot_cbw->CB, command->lba_offset, command->lba_size);
+		record.length = (uint32_t)get_cdb_field(usb_msc_bot_cbw->CB, command->length_offset, command->length_size);
+	}
+	return msc_trace_command(&record);
+}
+
+//--------------------------------------------
+static void command_block(const usb_msc_bot_cbw_t *usb_msc_bot_cbw, const usb_urb_t *urb, size_t packet_num)
+{
+	const scsi_command_t *command = find_scsi_command(usb_msc_bot_cbw);
+	msc_transaction_t *t = find_transaction(urb->bus, urb->device);
+	size_t trace_command = 0;
+
+	if (ts.opt_o_arg)
+	{
+		trace_command = trace_command_block(usb_msc_bot_cbw, command, urb, packet_num);
+	}
+
+	if (!t)
+	{
+		printf(ANSI_YELLOW"\r\nPacket No %ld, too many devices, the command is not replayed\r\n"ANSI_CLEAR, packet_num);
+		return;
+	}
+	if (t->is_open)
+	{
+		printf(ANSI_YELLOW"\r\nPacket No %ld, no CSW for the previous command of the device\r\n"ANSI_CLEAR, packet_num);
+		close_transaction(t);
+	}
+	if (!command)
+	{
+		return;
+	}
+	t->is_open = true;
+	t->tag = usb_msc_bot_cbw->dTag;
+	t->command = command;
+	t->transferred = 0;
+	t->is_applied = false;
+	t->trace_command = trace_command;
+
+	if (dev_addr != urb->device)
+	{
+		write_behind_barrier();
+		dev_addr = urb->device;
+		if (ts.opt_r)
+		{
+			printf(ANSI_YELLOW"\r\nReload littlefs and mimic_fat (It's equivalent to rebooting the MCU).\r\n"ANSI_CLEAR);
+			test->littlefs_reload();
+		}
+		else
+		{
+			printf(ANSI_YELLOW"\r\nUSB cable inserted (or pulled out and reinserted).\r\n"ANSI_CLEAR);
+		}
+	}
+	const uint8_t *cdb = usb_msc_bot_cbw->CB;
+	switch (command->event)
+	{
+	case SCSI_EVENT_READ:
+	case SCSI_EVENT_WRITE:
+		t->lba = (uint32_t)get_cdb_field(cdb, command->lba_offset, command->lba_size);
+		t->lbn = (uint32_t)get_cdb_field(cdb, command->length_offset, command->length_size);
+		if (!t->lbn)
+		{
+			break;
+		}
+		t->buffer = (uint8_t *)malloc(t->lbn * 512);
+		assert(t->buffer);
+		if (command->event == SCSI_EVENT_READ)
+		{
+			printf(ANSI_YELLOW"\r\nPacket No %ld, read %u sectors from %u\r\n"ANSI_CLEAR, packet_num, t->lbn, t->lba);
+			write_behind_barrier();  // the sectors may be rendered from queued writes
+			for (size_t cnt = 0; cnt < t->lbn; cnt++)
 			{
-				dev_addr = actual_dev_addr;
-				if (ts.opt_r)
-				{
-					printf(ANSI_YELLOW"\r\nReload littlefs and mimic_fat (It's equivalent to rebooting the MCU).\r\n"ANSI_CLEAR);
-					test->littlefs_reload();
-				}
-				else
-				{
-					printf(ANSI_YELLOW"\r\nUSB cable inserted (or pulled out and reinserted).\r\n"ANSI_CLEAR);
-				}
+				mimic_fat_read(0, t->lba + cnt, t->buffer + 512 * cnt, 512);
 			}
-			cdb_rw_10_t *cdb_rw_10 = (cdb_rw_10_t *)(packet + header_length + sizeof(usb_msc_bot_cbw_t) - sizeof(((usb_msc_bot_cbw_t *)0)->CB));
-			if (cdb_rw_10->operation_code == SCSI_READ_10 || cdb_rw_10->operation_code == SCSI_WRITE_10)
+		}
+		break;
+	case SCSI_EVENT_SYNC:
+		printf(ANSI_YELLOW"\r\nPacket No %ld, %s\r\n"ANSI_CLEAR, packet_num, command->name);
+		write_behind_barrier();
+		mimic_fat_sync();
+		break;
+	case SCSI_EVENT_START_STOP:
+		// LOEJ = 1, START = 0: the host ejects the medium
+		if ((cdb[4] & 0x03) == 0x02)
+		{
+			printf(ANSI_YELLOW"\r\nPacket No %ld, %s (eject)\r\n"ANSI_CLEAR, packet_num, command->name);
+			write_behind_barrier();
+			mimic_fat_eject();
+			break;
+		}
+		printf(ANSI_YELLOW"\r\nPacket No %ld, %s\r\n"ANSI_CLEAR, packet_num, command->name);
+		break;
+	default:
+		printf(ANSI_YELLOW"\r\nPacket No %ld, %s\r\n"ANSI_CLEAR, packet_num, command->name);
+		break;
+	}
+}
+
+//--------------------------------------------
+static void command_status(msc_transaction_t *t, const usb_msc_bot_csw_t *usb_msc_bot_csw, size_t packet_num)
+{
+	if (ts.opt_o_arg)
+	{
+		msc_trace_status(t->trace_command, usb_msc_bot_csw->dTag, usb_msc_bot_csw->bStatus, packet_num);
+	}
+	if (usb_msc_bot_csw->dTag != t->tag)
+	{
+		printf(ANSI_YELLOW"\r\nPacket No %ld, CSW tag 0x%08x doesn't match the CBW tag 0x%08x\r\n"ANSI_CLEAR, packet_num, usb_msc_bot_csw->dTag, t->tag);
+	}
+	else if (usb_msc_bot_csw->bStatus)
+	{
+		printf(ANSI_YELLOW"\r\nPacket No %ld, %s failed, CSW status %d\r\n"ANSI_CLEAR, packet_num, t->command->name, usb_msc_bot_csw->bStatus);
+	}
+	close_transaction(t);
+}
+
+//--------------------------------------------
+static void data_stage(msc_transaction_t *t, bool is_in, const uint8_t *data, uint32_t length, uint32_t captured, size_t packet_num)
+{
+	if (t->command->event == SCSI_EVENT_READ && is_in)
+	{
+		if (ts.opt_o_arg)
+		{
+			msc_trace_data(t->trace_command, t->transferred, data, length, captured, packet_num);
+		}
+		if (ts.opt_c)
+		{
+			compare_read_data(t, data, captured);
+		}
+		t->transferred += length;
+	}
+	else if (t->command->event == SCSI_EVENT_WRITE && !is_in)
+	{
+		uint32_t room = t->lbn * 512 - t->transferred;
+		if (ts.opt_o_arg)
+		{
+			msc_trace_data(t->trace_command, t->transferred, data, length, captured, packet_num);
+		}
+		memcpy(t->buffer + t->transferred, data, length < room ? length : room);
+		t->transferred += length < room ? length : room;
+		t->packet_num = packet_num;
+		if (t->transferred == t->lbn * 512)
+		{
+			apply_write_data(t);
+		}
+	}
+}
+
+//--------------------------------------------
+static void complete_urb(const usb_urb_t *urb, size_t packet_num)
+{
+	pending_urb_t *pending = find_pending_urb(urb);
+	const uint8_t *data;
+	uint32_t length;
+	uint32_t captured;
+	size_t submitted;
+
+	if (!pending)
+	{
+		return;  // submitted before the capture started
+	}
+	if (urb->endpoint & USB_DIR_IN)
+	{
+		data = urb->data;
+		length = urb->data_length;
+		captured = urb->captured_length;
+	}
+	else
+	{
+		data = pending->data;
+		length = pending->data_length;
+		if (urb->actual_length && urb->actual_length < length)
+		{
+			length = urb->actual_length;
+		}
+		captured = length;
+	}
+	submitted = pending->packet_num;
+
+	if (urb->is_ok && length)
+	{
+		msc_transaction_t *t = find_transaction(urb->bus, urb->device);
+		if (!(urb->endpoint & USB_DIR_IN) && captured == sizeof(usb_msc_bot_cbw_t)
+			&& ((usb_msc_bot_cbw_t *)data)->dSignature == USB_MSC_BOT_CBW_SIGNATURE)
+		{
+			command_block((usb_msc_bot_cbw_t *)data, urb, submitted);
+		}
+		else if (t && t->is_open && (urb->endpoint & USB_DIR_IN) && captured == sizeof(usb_msc_bot_csw_t)
+			&& ((usb_msc_bot_csw_t *)data)->dSignature == USB_MSC_BOT_CSW_SIGNATURE)
+		{
+			command_status(t, (usb_msc_bot_csw_t *)data, packet_num);
+		}
+		else if (t && t->is_open && t->buffer)
+		{
+			data_stage(t, (urb->endpoint & USB_DIR_IN) != 0, data, length, captured, submitted);
+		}
+	}
+	release_pending_urb(pending);
+}
+
+//--------------------------------------------
+static void transactions_cleanup(void)
+{
+	for (size_t cnt = 0; cnt < MSC_TRANSACTIONS_MAX; cnt++)
+	{
+		if (transactions[cnt].is_used)
+		{
+			close_transaction(&transactions[cnt]);
+			transactions[cnt].is_used = false;
+		}
+	}
+	while (pending_urb_num)
+	{
+		release_pending_urb(&pending_urbs[0]);
+	}
+	free(pending_urbs);
+	pending_urbs = NULL;
+	pending_urb_max = 0;
+}
+
+//--------------------------------------------
+void pcap_callback(u_char *ptr, const struct pcap_pkthdr *header, const u_char *packet)
+{
+	static size_t packet_num;
+	usb_urb_t urb;
+
+	packet_num++;
+	packet_time_us = (uint64_t)header->ts.tv_sec * 1000000 + header->ts.tv_usec;
+	if (!parse_urb(header, packet, &urb))
+	{
+		return;
+	}
+	if (is_demuxed && !is_demux_address(urb.bus, urb.device))
+	{
+		return;
+	}
+	if (urb.is_completion)
+	{
+		complete_urb(&urb, packet_num);
+	}
+	else
+	{
+		submit_urb(&urb, packet_num);
+	}
+}
+
+//--------------------------------------------
+// The commands of a trace written with -o go through the same transaction code
+// as the URBs of a capture, with the packet numbers of the capture.
+// The commands are read by index, the replay can stop after any of them.
+static void trace_loop(msc_trace_t *trace, size_t count)
+{
+	msc_trace_command_t command;
+	msc_trace_chunk_t chunk;
+	usb_msc_bot_cbw_t cbw;
+	usb_msc_bot_csw_t csw;
+	usb_urb_t urb;
+	msc_transaction_t *t;
+
+	for (size_t index = 0; index < count; index++)
+	{
+		if (!msc_trace_read_command(trace, index, &command))
+		{
+			printf(ANSI_YELLOW"trace_loop: can't read command %zu\r\n"ANSI_CLEAR, index);
+			return;
+		}
+		memset(&cbw, 0, sizeof(cbw));
+		cbw.dSignature = USB_MSC_BOT_CBW_SIGNATURE;
+		cbw.dTag = command.tag;
+		cbw.bCBLength = command.cdb_length;
+		memcpy(cbw.CB, command.cdb, sizeof(cbw.CB));
+		memset(&urb, 0, sizeof(urb));
+		urb.bus = command.bus;
+		urb.device = command.device;
+		packet_time_us = command.timestamp_us;
+		command_block(&cbw, &urb, command.packet_num);
+
+		t = find_transaction(command.bus, command.device);
+		if (t && t->is_open && t->buffer && command.chunk_count && command.sector_count <= t->lbn)
+		{
+			uint32_t size = t->lbn * 512;
+			uint32_t offset = 0;
+			bool is_in = t->command->event == SCSI_EVENT_READ;
+			uint8_t *data = (uint8_t *)calloc(1, size);
+			assert(data);
+			if (!msc_trace_read_data(trace, &command, data))
+			{
+				printf(ANSI_YELLOW"trace_loop: can't read the data of command %zu\r\n"ANSI_CLEAR, index);
+			}
+			for (uint32_t cnt = 0; cnt < command.chunk_count && msc_trace_read_chunk(trace, command.chunk_first + cnt, &chunk); cnt++)
 			{
-				lba =
-					cdb_rw_10->logical_block_address[0] << 24 |
-					cdb_rw_10->logical_block_address[1] << 16 |
-					cdb_rw_10->logical_block_address[2] << 8 |
-					cdb_rw_10->logical_block_address[3];
-				lbn =
-					cdb_rw_10->transfer_length[0] << 8 |
-					cdb_rw_10->transfer_length[1];
-				if (cdb_rw_10->operation_code == SCSI_READ_10)
-				{
-					assert(!data_buffer);
-					data_buffer = (uint8_t *)malloc(lbn * 512);
-					assert(data_buffer);
-					read_data = true;
-					printf(ANSI_YELLOW"\r\nPacket No %ld, read %d sectors from %d\r\n"ANSI_CLEAR, packet_num, lbn, lba);
-					for (size_t cnt = 0; cnt < lbn; cnt++)
-					{
-						mimic_fat_read(0, lba + cnt, data_buffer + 512 * cnt, 512);
-					}
-				}
-				if (cdb_rw_10->operation_code == SCSI_WRITE_10)
-				{
-					write_data = true;
-				}
+				data_stage(t, is_in, data + (offset < size ? offset : size), chunk.length, chunk.captured, command.data_packet_num);
+				offset += chunk.length;
 			}
+			free(data);
 		}
+		if (t && t->is_open && command.status_packet_num)
+		{
+			csw.dSignature = USB_MSC_BOT_CSW_SIGNATURE;
+			csw.dTag = command.status_tag;
+			csw.dDataResidue = 0;
+			csw.bStatus = command.status;
+			command_status(t, &csw, command.status_packet_num);
+		}
+	}
+}
+
+//--------------------------------------------
+// Only bulk URBs (of the replayed device) are delivered to pcap_callback,
+// libpcap drops control, interrupt and isochronous traffic while reading the capture.
+// The fields are little-endian, they are compared byte by byte.
+// Packet numbers count only the delivered records then, so the filter is optional:
+// without it (or if it can't be set) parse_urb classifies every record by itself.
+static void pcap_set_urb_filter(void)
+{
+	char filter[256];
+	struct bpf_program program;
+	size_t transfer_offset;
+	size_t bus_offset;
+	size_t device_offset;
+	size_t device_size;
+	int len;
+
+	if (dlt == LINKTYPE_USBPCAP)
+	{
+		transfer_offset = offsetof(usbpcap_packet_header_t, transfer);
+		bus_offset = offsetof(usbpcap_packet_header_t, bus);
+		device_offset = offsetof(usbpcap_packet_header_t, device);
+		device_size = sizeof(((usbpcap_packet_header_t *)0)->device);
+	}
+	else
+	{
+		transfer_offset = offsetof(usbmon_packet_header_t, xfer_type);
+		bus_offset = offsetof(usbmon_packet_header_t, busnum);
+		device_offset = offsetof(usbmon_packet_header_t, devnum);
+		device_size = sizeof(((usbmon_packet_header_t *)0)->devnum);
 	}
-	if (data_length >= 512)
+	len = snprintf(filter, sizeof(filter), "link[%zu] == %d", transfer_offset, USB_TRANSFER_BULK);
+	if (is_demuxed)
 	{
-		assert(read_data || write_data);
-		if (read_data)
+		const demux_address_t *address = NULL;
+		size_t address_num = 0;
+
+		for (size_t cnt = 0; cnt < demux_address_num; cnt++)
 		{
-			uint8_t *read_buffer = (uint8_t *)packet + header_length;
-			if (ts.opt_c)
+			if (demux_addresses[cnt].instance == demux_instance)
 			{
-#if 0
-				int res = memcmp(data_buffer, read_buffer, usbpcap_packet_header->dataLength);
-				assert(!res);
-#else
-				for (size_t cnt = 0; cnt < data_length; cnt++)
-				{
-					if (data_buffer[cnt] != read_buffer[cnt])
-					{
-						int32_t num = (int32_t)cnt;
-						uint32_t sec = lba;
-						while (num >= 0)
-						{
-							num -= 512;
-							sec++;
-						}
-						num += 512;
-						sec--;
-						printf(ANSI_YELLOW"Data is not equal, sector %d, byte %d, actual data = 0x%02x, read data = 0x%02x\r\n"ANSI_CLEAR, sec, num, data_buffer[cnt], read_buffer[cnt]);
-					}
-				}
-#endif
+				address = address ? address : &demux_addresses[cnt];
+				address_num++;
 			}
-			assert(data_buffer);
-			free(data_buffer);
-			data_buffer = 0;
-			read_data = false;
 		}
-		if (write_data)
+		assert(address);
+		len += snprintf(filter + len, sizeof(filter) - len, " and link[%zu] == %u and link[%zu] == %u",
+			bus_offset, address->bus & 0xFF, bus_offset + 1, address->bus >> 8);
+		// a reinserted device has several addresses, they are told apart by pcap_callback
+		if (address_num == 1)
 		{
-			printf(ANSI_YELLOW"\r\nPacket No %ld, write %d sectors from %d\r\n"ANSI_CLEAR, packet_num, lbn, lba);
-			for (size_t cnt = 0; cnt < data_length / 512; cnt++)
+			len += snprintf(filter + len, sizeof(filter) - len, " and link[%zu] == %u", device_offset, address->device & 0xFF);
+			if (device_size > 1)
 			{
-				mimic_fat_write(0, lba + cnt, (uint8_t *)packet + header_length + 512 * cnt, 512);
+				snprintf(filter + len, sizeof(filter) - len, " and link[%zu] == %u", device_offset + 1, address->device >> 8);
 			}
-			write_data = false;
 		}
 	}
+
+	if (pcap_compile(pd, &program, filter, 1, PCAP_NETMASK_UNKNOWN) < 0)
+	{
+		printf(ANSI_YELLOW"pcap_compile: %s, the capture is not prefiltered\n"ANSI_CLEAR, pcap_geterr(pd));
+		return;
+	}
+	if (pcap_setfilter(pd, &program) < 0)
+	{
+		printf(ANSI_YELLOW"pcap_setfilter: %s, the capture is not prefiltered\n"ANSI_CLEAR, pcap_geterr(pd));
+	}
+	else
+	{
+		printf(ANSI_YELLOW"filter: %s\n"ANSI_CLEAR, filter);
+	}
+	pcap_freecode(&program);
 }
 
 //--------------------------------------------
@@ -290,9 +921,348 @@ static int pcap_lib_init(const char *name)
 		printf(ANSI_YELLOW"FATAL ERROR: Link-layer header type %d in %s is not supported\n"ANSI_CLEAR, dlt, name);
 		return -1;
 	}
+	if (ts.opt_f)
+	{
+		pcap_set_urb_filter();
+	}
 	return 0;
 }
 
+//--------------------------------------------
+static void print_compression_stats(void)
+{
+	mimic_fat_compression_stats_t stats;
+
+	mimic_fat_compression_stats(&stats);
+	printf(ANSI_YELLOW"\r\nCompression: %zu of %zu clusters compressed, %llu bytes stored for %llu bytes, %llu bytes (%.1f%%) saved\r\n"ANSI_CLEAR,
+		stats.compressed_clusters, stats.clusters, (unsigned long long)stats.stored_bytes, (unsigned long long)stats.raw_bytes,
+		(unsigned long long)(stats.raw_bytes - stats.stored_bytes),
+		stats.raw_bytes ? 100.0 * (stats.raw_bytes - stats.stored_bytes) / stats.raw_bytes : 0.0);
+	printf(ANSI_YELLOW"Compression: %.3f ms to compress, %.3f ms to decompress\r\n"ANSI_CLEAR,
+		1000.0 * stats.compress_time / CLOCKS_PER_SEC, 1000.0 * stats.decompress_time / CLOCKS_PER_SEC);
+}
+
+//--------------------------------------------
+static void print_read_ahead_stats(void)
+{
+	mimic_fat_read_ahead_stats_t stats;
+
+	mimic_fat_read_ahead_stats(&stats);
+	printf(ANSI_YELLOW"\r\nRead-ahead: %zu of %zu file sectors served from RAM (%.1f%%), %llu bytes prefetched\r\n"ANSI_CLEAR,
+		stats.hits, stats.reads, stats.reads ? 100.0 * stats.hits / stats.reads : 0.0,
+		(unsigned long long)stats.prefetched_bytes);
+}
+
+//--------------------------------------------
+static void print_write_latency_stats(void)
+{
+	write_behind_stats_t stats;
+
+	write_behind_stats(&stats);
+	printf(ANSI_YELLOW"\r\nWrite latency: %zu commands, %zu sectors, ack avg %.3f ms max %.3f ms, apply avg %.3f ms max %.3f ms\r\n"ANSI_CLEAR,
+		stats.commands, stats.sectors,
+		stats.commands ? stats.ack_total_us / 1000.0 / stats.commands : 0.0, stats.ack_max_us / 1000.0,
+		stats.commands ? stats.apply_total_us / 1000.0 / stats.commands : 0.0, stats.apply_max_us / 1000.0);
+	if (ts.opt_w_arg)
+	{
+		printf(ANSI_YELLOW"Write-behind: %zu barriers, %zu waits for a full queue\r\n"ANSI_CLEAR, stats.barriers, stats.full_waits);
+	}
+}
+
+//--------------------------------------------
+static bool replay(void)
+{
+	bool passed;
+
+	msc_trace_t *trace = NULL;
+	size_t count = 0;
+
+	mimic_fat_set_compression(ts.opt_z);
+	test->littlefs_init();
+
+	if (ts.opt_i_arg)
+	{
+		if (!(trace = msc_trace_open(ts.opt_i_arg)))
+		{
+			exit(EXIT_FAILURE);
+		}
+		count = msc_trace_command_count(trace);
+		if (ts.opt_n_arg && (size_t)atoi(ts.opt_n_arg) < count)
+		{
+			count = (size_t)atoi(ts.opt_n_arg);
+		}
+		printf(ANSI_YELLOW"%s open, %zu of %zu commands\n"ANSI_CLEAR, ts.opt_i_arg, count, msc_trace_command_count(trace));
+	}
+	else if (pcap_lib_init(test->file) < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	if (ts.opt_o_arg && !msc_trace_create(ts.opt_o_arg))
+	{
+		exit(EXIT_FAILURE);
+	}
+
+	if (ts.opt_p_arg)
+	{
+		powerloss_start((size_t)atoi(ts.opt_p_arg), &lfs_pico_flash_config);
+	}
+
+	if (ts.opt_w_arg)
+	{
+		write_behind_start((size_t)atoi(ts.opt_w_arg));
+	}
+
+	if (trace)
+	{
+		trace_loop(trace, count);
+		msc_trace_close(trace);
+	}
+	else
+	{
+		pcap_loop(pd, 0, pcap_callback, NULL);
+		pcap_close(pd);
+	}
+	transactions_cleanup();
+	if (ts.opt_o_arg)
+	{
+		msc_trace_finish();
+	}
+
+	write_behind_finish();
+	powerloss_finish();
+	print_write_latency_stats();
+	print_read_ahead_stats();
+
+	if (ts.opt_z)
+	{
+		print_compression_stats();
+	}
+
+	passed = test->littlefs_check();
+	test->littlefs_cleanup();
+	return passed;
+}
+
+//--------------------------------------------
+// With -d the capture is scanned for the addresses that send a CBW,
+// then every device is replayed by its own emulator instance.
+// An instance is a forked process, so it has its own flash image, littlefs and
+// mimic_fat state, and it replays only the URBs of its addresses.
+// The instances run in parallel, their outputs go to temporary files
+// and are printed in the order of the devices, followed by the result of every instance.
+//
+// A capture doesn't tell a reinserted device from a second board. An address
+// whose first CBW comes after the last URB of another address on the same bus
+// is taken as that device reinserted, so it is replayed by the same instance.
+// Only devices used at the same time get instances of their own, a board that
+// replaces another one on the same bus is replayed as the first one.
+
+#ifndef _WIN32
+
+//--------------------------------------------
+typedef struct
+{
+	uint16_t bus;
+	uint16_t device;            // first address
+	size_t last_packet;         // of the last address
+	pid_t pid;
+	int status;                 // of the instance process
+	FILE *output;
+} demux_instance_t;
+
+//--------------------------------------------
+static demux_instance_t instances[MSC_TRANSACTIONS_MAX];
+static size_t instance_num;
+static bool is_address_skipped;  // the address table is full
+
+//--------------------------------------------
+static void demux_scan_callback(u_char *ptr, const struct pcap_pkthdr *header, const u_char *packet)
+{
+	static size_t packet_num;
+	usb_urb_t urb;
+	size_t cnt;
+
+	(void)ptr;
+	packet_num++;
+	if (!parse_urb(header, packet, &urb))
+	{
+		return;
+	}
+	for (cnt = 0; cnt < demux_address_num; cnt++)
+	{
+		if (demux_addresses[cnt].bus == urb.bus && demux_addresses[cnt].device == urb.device)
+		{
+			demux_addresses[cnt].last_packet = packet_num;
+			return;
+		}
+	}
+	if (urb.is_completion || (urb.endpoint & USB_DIR_IN)
+		|| urb.captured_length != sizeof(usb_msc_bot_cbw_t)
+		|| ((usb_msc_bot_cbw_t *)urb.data)->dSignature != USB_MSC_BOT_CBW_SIGNATURE)
+	{
+		return;
+	}
+	if (demux_address_num == MSC_TRANSACTIONS_MAX)
+	{
+		is_address_skipped = true;
+		return;
+	}
+	demux_addresses[demux_address_num].bus = urb.bus;
+	demux_addresses[demux_address_num].device = urb.device;
+	demux_addresses[demux_address_num].first_packet = packet_num;
+	demux_addresses[demux_address_num].last_packet = packet_num;
+	demux_address_num++;
+}
+
+//--------------------------------------------
+// Give every address an instance, an address that starts after a device on the same bus
+// has gone quiet is taken as that device reinserted
+static void demux_group(void)
+{
+	for (size_t cnt = 0; cnt < demux_address_num; cnt++)
+	{
+		demux_address_t *address = &demux_addresses[cnt];
+		demux_instance_t *instance = NULL;
+
+		for (size_t i = 0; i < instance_num; i++)
+		{
+			if (instances[i].bus == address->bus && instances[i].last_packet < address->first_packet
+				&& (!instance || instances[i].last_packet > instance->last_packet))
+			{
+				instance = &instances[i];  // the one gone quiet last
+			}
+		}
+		if (instance)
+		{
+			printf(ANSI_YELLOW"Device %u.%u is taken as %u.%u reinserted\r\n"ANSI_CLEAR,
+				address->bus, address->device, instance->bus, instance->device);
+		}
+		else
+		{
+			instance = &instances[instance_num++];
+			instance->bus = address->bus;
+			instance->device = address->device;
+		}
+		instance->last_packet = address->last_packet;
+		address->instance = instance - instances;
+	}
+}
+
+//--------------------------------------------
+static void demux_start(demux_instance_t *instance)
+{
+	instance->output = tmpfile();
+	if (!instance->output)
+	{
+		printf(ANSI_YELLOW"demux_start: tmpfile failed\r\n"ANSI_CLEAR);
+		return;
+	}
+	fflush(stdout);
+	instance->pid = fork();
+	if (instance->pid < 0)
+	{
+		printf(ANSI_YELLOW"demux_start: fork failed\r\n"ANSI_CLEAR);
+		fclose(instance->output);
+		instance->output = NULL;
+		return;
+	}
+	if (instance->pid == 0)
+	{
+		bool passed;
+
+		if (dup2(fileno(instance->output), STDOUT_FILENO) < 0)
+		{
+			_exit(EXIT_FAILURE);
+		}
+		is_demuxed = true;
+		demux_instance = instance - instances;
+		passed = replay();
+		fflush(stdout);
+		_exit(passed ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+}
+
+//--------------------------------------------
+static void demux_finish(demux_instance_t *instance)
+{
+	char buf[4096];
+	size_t len;
+
+	if (!instance->output)
+	{
+		return;
+	}
+	waitpid(instance->pid, &instance->status, 0);
+	printf(ANSI_YELLOW"\r\n======== Device %u.%u ========\r\n"ANSI_CLEAR, instance->bus, instance->device);
+	rewind(instance->output);
+	while ((len = fread(buf, 1, sizeof(buf), instance->output)) > 0)
+	{
+		fwrite(buf, 1, len, stdout);
+	}
+	fclose(instance->output);
+	instance->output = NULL;
+}
+
+//--------------------------------------------
+static void demux_replay(void)
+{
+	size_t cnt;
+
+	if (pcap_lib_init(test->file) < 0)
+	{
+		exit(EXIT_FAILURE);
+	}
+	pcap_loop(pd, 0, demux_scan_callback, NULL);
+	pcap_close(pd);
+	demux_group();
+	printf(ANSI_YELLOW"%zu devices in the capture\r\n"ANSI_CLEAR, instance_num);
+	if (is_address_skipped)
+	{
+		printf(ANSI_YELLOW"Only the first %d device addresses are replayed\r\n"ANSI_CLEAR, MSC_TRANSACTIONS_MAX);
+	}
+
+	for (cnt = 0; cnt < instance_num; cnt++)
+	{
+		demux_start(&instances[cnt]);
+	}
+	for (cnt = 0; cnt < instance_num; cnt++)
+	{
+		demux_finish(&instances[cnt]);
+	}
+
+	printf(ANSI_YELLOW"\r\n"ANSI_CLEAR);
+	for (cnt = 0; cnt < instance_num; cnt++)
+	{
+		int status = instances[cnt].status;
+		if (!instances[cnt].pid || instances[cnt].pid < 0)
+		{
+			printf(ANSI_YELLOW"Device %u.%u: not replayed\r\n"ANSI_CLEAR, instances[cnt].bus, instances[cnt].device);
+		}
+		else if (WIFEXITED(status))
+		{
+			printf(ANSI_YELLOW"Device %u.%u: check passed = %s\r\n"ANSI_CLEAR, instances[cnt].bus, instances[cnt].device,
+				WEXITSTATUS(status) == EXIT_SUCCESS ? "true" : "false");
+		}
+		else if (WIFSIGNALED(status))
+		{
+			printf(ANSI_YELLOW"Device %u.%u: crashed with signal %d\r\n"ANSI_CLEAR, instances[cnt].bus, instances[cnt].device,
+				WTERMSIG(status));
+		}
+	}
+}
+
+#else
+
+//--------------------------------------------
+static void demux_replay(void)
+{
+	printf(ANSI_YELLOW"Per-device replay is not supported on this platform\r\n"ANSI_CLEAR);
+	replay();
+}
+
+#endif
+
 //--------------------------------------------
 static void print_usage(void)
 {
@@ -302,6 +1272,16 @@ static void print_usage(void)
 	printf("  -t <test_id>          Test Id\n");
 	printf("Optional arguments for input:\n");
 	printf("  -c                    Compare actual and PCAP data\n");
+	printf("  -p <interval>         Simulate a power loss at every <interval>-th flash prog/erase\n");
+	printf("  -z                    Compress temporary cluster files and report the savings\n");
+	printf("  -w <depth>            Apply written sectors in a worker thread behind a queue of <depth> sectors (not with -p)\n");
+	printf("  -d                    Replay every USB device of the capture by its own emulator instance\n");
+	printf("                        (a new address on a bus gone quiet is taken as the device reinserted,\n");
+	printf("                        not as a second board)\n");
+	printf("  -f                    Drop non-bulk records with a BPF filter (packet numbers count only bulk records)\n");
+	printf("  -o <trace>            Write the mass storage commands of the replay to a trace file\n");
+	printf("  -i <trace>            Replay a trace file written with -o instead of the capture of the test\n");
+	printf("  -n <count>            Stop the replay of a trace after <count> commands\n");
 #if 0
 	printf("  -r                    Reload FS every time the USB device number changes\n");
 #endif
@@ -312,7 +1292,7 @@ int main(int argc, char *argv[])
 {
 	int option;
 
-	while ((option = getopt(argc, argv, "t:rc")) != -1)
+	while ((option = getopt(argc, argv, "t:rcp:zw:dfo:i:n:")) != -1)
 	{
 		switch (option)
 		{
@@ -328,6 +1308,30 @@ int main(int argc, char *argv[])
 		case 'c':
 			ts.opt_c = 1;
 			break;
+		case 'p':
+			ts.opt_p_arg = optarg;
+			break;
+		case 'z':
+			ts.opt_z = 1;
+			break;
+		case 'w':
+			ts.opt_w_arg = optarg;
+			break;
+		case 'd':
+			ts.opt_d = 1;
+			break;
+		case 'f':
+			ts.opt_f = 1;
+			break;
+		case 'o':
+			ts.opt_o_arg = optarg;
+			break;
+		case 'i':
+			ts.opt_i_arg = optarg;
+			break;
+		case 'n':
+			ts.opt_n_arg = optarg;
+			break;
 		default: // '?'
 			print_usage();
 			exit(EXIT_FAILURE);
@@ -346,22 +1350,26 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	test->littlefs_init();
-
-	if (pcap_lib_init(test->file) < 0)
+	// a power loss child is forked from the flash driver, it must not come from the worker thread
+	if ((ts.opt_p_arg && atoi(ts.opt_p_arg) <= 0) || (ts.opt_w_arg && (atoi(ts.opt_w_arg) <= 0 || ts.opt_p_arg)))
 	{
+		print_usage();
+		exit(EXIT_FAILURE);
+	}
+	// -n limits a trace replay, the instances of -d replay the capture and would write the same trace file
+	if ((ts.opt_n_arg && (atoi(ts.opt_n_arg) <= 0 || !ts.opt_i_arg)) || (ts.opt_d && (ts.opt_i_arg || ts.opt_o_arg)))
+	{
+		print_usage();
 		exit(EXIT_FAILURE);
 	}
 
-	pcap_loop(pd, 0, pcap_callback, NULL);
-	pcap_close(pd);
-
-	test->littlefs_check();
-	test->littlefs_cleanup();
-
-	if (data_buffer)
+	if (ts.opt_d)
+	{
+		demux_replay();
+	}
+	else
 	{
-		free(data_buffer);
+		replay();
 	}
 
 	exit(EXIT_SUCCESS);
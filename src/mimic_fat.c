@@ -5,6 +5,7 @@
  * SPDX-License-Identifier: BSD-3-Clause
  */
 #include "mimic_fat.h"
+#include "lz.h"
 
 
 #define ANSI_CLEAR     "\x1b[0m"
@@ -12,11 +13,6 @@
 #define ANSI_MAGENTA   "\x1b[35m"
 #define ANSI_CYAN      "\x1b[36m"
 
-#if 1
-#include "prng.h"
-#define rand prng
-#endif
-
 #ifdef  ENABLE_TRACE
 #define TRACE(...) (printf(__VA_ARGS__))
 #else
@@ -30,6 +26,7 @@ static const struct lfs_config *littlefs_lfs_config = NULL;
 
 #define FAT_SHORT_NAME_MAX           11
 #define FAT_LONG_FILENAME_CHUNK_MAX  13
+#define FAT_DIR_ENTRIES_PER_CLUSTER  (DISK_SECTOR_SIZE / sizeof(fat_dir_entry_t))
 
 
 static uint8_t fat_disk_image[1][DISK_SECTOR_SIZE] = {
@@ -94,7 +91,6 @@ static uint8_t fat_disk_image[1][DISK_SECTOR_SIZE] = {
 static lfs_t real_filesystem;
 static bool usb_device_is_enabled = false;
 
-static lfs_file_t fat_cache;
 
 void mimic_fat_init(const struct lfs_config *c) {
     littlefs_lfs_config = c;
@@ -198,154 +194,388 @@ static int is_fat_sfn_symbol(uint8_t c) {
     }
 }
 
-static uint16_t read_fat(int cluster) {
-    uint16_t offset = (uint16_t)floor((float)cluster + ((float)cluster / 2));
-    lfs_soff_t o = lfs_file_seek(&real_filesystem, &fat_cache, offset, LFS_SEEK_SET);
-    if (o < 0) {
-        printf("read_fat: lfs_file_seek error=%ld\n", o);
-        return 0xFFF;
+#define END_OF_CLUSTER_CHAIN  0xFFF
+
+static uint32_t cluster_size(void);
+static size_t fat_sector_size(void);
+static void delete_directory(const char *path);
+
+/*
+ * Rendered sector cache
+ *
+ * The host re-reads the boot sector, the FAT and the directories over and over. Rendered sectors
+ * are kept by LBA in MIMIC_FAT_RENDER_CACHE_SIZE bytes, the least recently used one is replaced.
+ * A host write drops its own LBA, a FAT sector is dropped when an entry in it changes, and the
+ * directory sectors, which may be rendered from littlefs entries, are dropped by any host write.
+ */
+#ifndef MIMIC_FAT_RENDER_CACHE_SIZE
+#define MIMIC_FAT_RENDER_CACHE_SIZE  (16 * DISK_SECTOR_SIZE)
+#endif
+#define RENDER_CACHE_SECTORS  (MIMIC_FAT_RENDER_CACHE_SIZE / DISK_SECTOR_SIZE)
+
+typedef struct {
+    uint32_t sector;
+    uint32_t last_used;  // 0 if the slot is unused
+    bool is_directory;
+    uint8_t buffer[DISK_SECTOR_SIZE];
+} rendered_sector_t;
+
+static rendered_sector_t rendered_sectors[RENDER_CACHE_SECTORS];
+static uint32_t rendered_sector_clock = 0;
+
+static bool load_rendered_sector(uint32_t sector, void *buffer, uint32_t bufsize) {
+    if (bufsize != DISK_SECTOR_SIZE)
+        return false;
+    for (size_t i = 0; i < RENDER_CACHE_SECTORS; i++) {
+        rendered_sector_t *r = &rendered_sectors[i];
+        if (r->last_used != 0 && r->sector == sector) {
+            memcpy(buffer, r->buffer, DISK_SECTOR_SIZE);
+            r->last_used = ++rendered_sector_clock;
+            return true;
+        }
     }
-    uint8_t current[2] = {0};
-    lfs_ssize_t s = lfs_file_read(&real_filesystem, &fat_cache, current, sizeof(current));
-    if (s < 0) {
-        printf("read_fat: lfs_file_read error=%ld\n", s);
+    return false;
+}
+
+static void store_rendered_sector(uint32_t sector, const void *buffer, uint32_t bufsize, bool is_directory) {
+    if (bufsize != DISK_SECTOR_SIZE)
+        return;
+    rendered_sector_t *r = &rendered_sectors[0];
+    for (size_t i = 0; i < RENDER_CACHE_SECTORS; i++) {
+        if (rendered_sectors[i].last_used == 0 || rendered_sectors[i].sector == sector) {
+            r = &rendered_sectors[i];
+            break;
+        }
+        if (rendered_sectors[i].last_used < r->last_used)
+            r = &rendered_sectors[i];
     }
+    memcpy(r->buffer, buffer, DISK_SECTOR_SIZE);
+    r->sector = sector;
+    r->is_directory = is_directory;
+    r->last_used = ++rendered_sector_clock;
+}
 
-    int16_t result = 0;
-    if (cluster & 0x01) {
-        result = (current[0] >> 4) | ((uint16_t)current[1] << 4);
-    } else {
-        result = current[0] | ((uint16_t)(current[1] & 0x0F) << 8);
+static void invalidate_rendered_sector(uint32_t sector) {
+    for (size_t i = 0; i < RENDER_CACHE_SECTORS; i++) {
+        if (rendered_sectors[i].sector == sector)
+            rendered_sectors[i].last_used = 0;
     }
-    return result;
 }
 
-static void update_fat(uint32_t cluster, uint16_t value) {
-    size_t offset = (size_t)floor((float)cluster + ((float)cluster / 2));
+/*
+ * Drop the FAT sectors holding the entries of clusters first to last
+ */
+static void invalidate_rendered_fat(uint32_t first, uint32_t last) {
+    uint32_t first_sector = (first + first / 2) / DISK_SECTOR_SIZE + 1;
+    uint32_t last_sector = (last + last / 2 + 1) / DISK_SECTOR_SIZE + 1;
+    for (uint32_t sector = first_sector; sector <= last_sector; sector++)
+        invalidate_rendered_sector(sector);
+}
 
-    uint8_t previous[2] = {0};
-    lfs_soff_t o = lfs_file_seek(&real_filesystem, &fat_cache, offset, LFS_SEEK_SET);
-    if (o < 0) {
-        printf("update_fat: lfs_file_seek error=%ld\n", o);
-        return;
-    }
-    lfs_ssize_t s = lfs_file_read(&real_filesystem, &fat_cache, previous, sizeof(previous));
-    if (s < 0) {
-        printf("update_fat: lfs_file_read error=%ld\n", s);
-        return;
+static void invalidate_rendered_directories(void) {
+    for (size_t i = 0; i < RENDER_CACHE_SECTORS; i++) {
+        if (rendered_sectors[i].is_directory)
+            rendered_sectors[i].last_used = 0;
     }
-    if (cluster & 0x01) {
-        previous[0] = (previous[0] & 0x0F) | (value << 4);
-        previous[1] = value >> 4;
-    } else {
-        previous[0] = value;
-        previous[1] = (previous[1] & 0xF0) | ((value >> 8) & 0x0F);
+}
+
+static void invalidate_rendered_sectors(void) {
+    for (size_t i = 0; i < RENDER_CACHE_SECTORS; i++)
+        rendered_sectors[i].last_used = 0;
+}
+
+/*
+ * File Allocation Table
+ *
+ * create_dir_entry_cache() gives a file consecutive clusters, so the allocation is kept as a
+ * sorted list of extents and the FAT12 bytes are synthesized when they are read. FAT sectors
+ * written by the host are saved as .mimic/FAT/<sector> files and take precedence over the extents.
+ */
+typedef struct {
+    uint16_t start;
+    uint16_t length;
+    uint16_t next;  // FAT entry of the last cluster of the extent
+} fat_extent_t;
+
+static fat_extent_t *fat_extents = NULL;
+static size_t fat_extent_num = 0;
+static size_t fat_extent_max = 0;
+
+static uint8_t *fat_sector_written = NULL;  // bitmap of FAT sectors written by the host
+static uint32_t fat_sector_cached = 0;
+static uint8_t fat_sector_cache[DISK_SECTOR_SIZE];
+static uint32_t fat_version = 0;  // changes with every FAT update, for state derived from the chains
+
+/*
+ * Index of the first extent that ends after cluster
+ */
+static size_t fat_extent_lower_bound(uint32_t cluster) {
+    size_t low = 0;
+    size_t high = fat_extent_num;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if ((uint32_t)fat_extents[mid].start + fat_extents[mid].length <= cluster)
+            low = mid + 1;
+        else
+            high = mid;
     }
+    return low;
+}
 
-    o = lfs_file_seek(&real_filesystem, &fat_cache, offset, LFS_SEEK_SET);
-    if (o < 0) {
-        printf("update_fat: lfs_file_seek error=%ld\n", o);
-        return;
+static fat_extent_t *find_fat_extent(uint32_t cluster) {
+    size_t i = fat_extent_lower_bound(cluster);
+    if (i < fat_extent_num && fat_extents[i].start <= cluster)
+        return &fat_extents[i];
+    return NULL;
+}
+
+/*
+ * Insert an extent into the sorted list, merged with the previous one when the chain continues
+ */
+static bool insert_fat_extent(uint32_t start, uint32_t length, uint16_t next) {
+    size_t i = fat_extent_lower_bound(start);
+    if (i < fat_extent_num && fat_extents[i].start < start + length)
+        return false;  // overlaps
+    invalidate_rendered_fat(start, start + length - 1);
+    fat_version++;
+    if (i > 0) {
+        fat_extent_t *prev = &fat_extents[i - 1];
+        if (start == (uint32_t)prev->start + prev->length && prev->next == start) {
+            prev->length += length;
+            prev->next = next;
+            return true;
+        }
     }
-    s = lfs_file_write(&real_filesystem, &fat_cache, previous, sizeof(previous));
-    if (s != sizeof(previous)) {
-        printf("update_fat: lfs_file_write error=%ld\n", s);
+    if (fat_extent_num == fat_extent_max) {
+        size_t max = fat_extent_max > 0 ? fat_extent_max * 2 : 32;
+        fat_extent_t *extents = realloc(fat_extents, sizeof(fat_extent_t) * max);
+        if (extents == NULL) {
+            printf("insert_fat_extent: can't allocate %u extents\n", max);
+            return false;
+        }
+        fat_extents = extents;
+        fat_extent_max = max;
+    }
+    memmove(&fat_extents[i + 1], &fat_extents[i], sizeof(fat_extent_t) * (fat_extent_num - i));
+    fat_extents[i].start = start;
+    fat_extents[i].length = length;
+    fat_extents[i].next = next;
+    fat_extent_num++;
+    return true;
+}
+
+static void synthesize_fat_bytes(size_t offset, uint8_t *buffer, size_t size) {
+    memset(buffer, 0, size);
+
+    uint32_t first = offset * 2 / 3;
+    uint32_t last = (offset + size) * 2 / 3 + 1;
+    if (last > cluster_size())
+        last = cluster_size();
+    size_t i = fat_extent_lower_bound(first);
+    for (uint32_t cluster = first; cluster <= last; cluster++) {
+        uint16_t value = 0;
+        if (cluster == 0) {
+            value = 0xFF8;
+        } else if (cluster == 1) {
+            value = 0xFFF;
+        } else {
+            while (i < fat_extent_num && (uint32_t)fat_extents[i].start + fat_extents[i].length <= cluster)
+                i++;
+            if (i < fat_extent_num && fat_extents[i].start <= cluster) {
+                if (cluster == (uint32_t)fat_extents[i].start + fat_extents[i].length - 1)
+                    value = fat_extents[i].next;
+                else
+                    value = cluster + 1;
+            }
+        }
+
+        size_t position = cluster + cluster / 2;
+        uint8_t entry[2];
+        if (cluster & 0x01) {
+            entry[0] = (value << 4) & 0xF0;
+            entry[1] = value >> 4;
+        } else {
+            entry[0] = value & 0xFF;
+            entry[1] = (value >> 8) & 0x0F;
+        }
+        for (size_t j = 0; j < 2; j++) {
+            if (position + j >= offset && position + j < offset + size)
+                buffer[position + j - offset] |= entry[j];
+        }
     }
 }
 
-#define BUFFER_SIZE  512
-#define END_OF_CLUSTER_CHAIN  0xFFF
+static bool is_fat_sector_written(uint32_t sector) {
+    return fat_sector_written != NULL && sector <= fat_sector_size()
+        && (fat_sector_written[(sector - 1) / 8] & (1 << ((sector - 1) % 8)));
+}
 
-static size_t bulk_update_fat_buffer_read(size_t offset, void *buffer, size_t size) {
-    lfs_soff_t o = lfs_file_seek(&real_filesystem, &fat_cache, offset, LFS_SEEK_SET);
-    if (o < 0) {
-         printf("bulk_update_fat_buffer_read: lfs_file_seek error=%ld\n", o);
-         return 0;
+static void fat_sector_filename(char *filename, size_t size, uint32_t sector) {
+    snprintf(filename, size, ".mimic/FAT/%lu", sector);
+}
+
+static uint8_t *read_written_fat_sector(uint32_t sector) {
+    if (fat_sector_cached == sector)
+        return fat_sector_cache;
+
+    char filename[LFS_NAME_MAX + 1];
+    lfs_file_t f;
+    fat_sector_filename(filename, sizeof(filename), sector);
+    int err = lfs_file_open(&real_filesystem, &f, filename, LFS_O_RDONLY);
+    if (err != LFS_ERR_OK) {
+        printf("read_written_fat_sector: can't open '%s': err=%d\n", filename, err);
+        return NULL;
     }
-    lfs_ssize_t s = lfs_file_read(&real_filesystem, &fat_cache, buffer, size);
-    if (s < 0) {
-        printf("bulk_update_fat_buffer_read: lfs_file_read error=%ld\n", s);
-        return 0;
+    lfs_ssize_t s = lfs_file_read(&real_filesystem, &f, fat_sector_cache, sizeof(fat_sector_cache));
+    lfs_file_close(&real_filesystem, &f);
+    if (s != sizeof(fat_sector_cache)) {
+        printf("read_written_fat_sector: can't read '%s': size=%ld\n", filename, s);
+        fat_sector_cached = 0;
+        return NULL;
     }
-    return (size_t)s;
+    fat_sector_cached = sector;
+    return fat_sector_cache;
 }
 
-static size_t bulk_update_fat_buffer_write(size_t offset, void *buffer, size_t size) {
-    lfs_soff_t o = lfs_file_seek(&real_filesystem, &fat_cache, offset, LFS_SEEK_SET);
-    if (o < 0) {
-        printf("bulk_update_fat_buffer_write: lfs_file_seek error=%ld\n", o);
-        return 0;
+/*
+ * Keep a FAT sector written by the host, a sector equal to the synthesized one is dropped
+ */
+static void write_fat_sector(uint32_t sector, const uint8_t *buffer) {
+    char filename[LFS_NAME_MAX + 1];
+    uint8_t synthesized[DISK_SECTOR_SIZE];
+
+    invalidate_rendered_sector(sector);
+    fat_version++;
+    fat_sector_filename(filename, sizeof(filename), sector);
+    synthesize_fat_bytes((sector - 1) * DISK_SECTOR_SIZE, synthesized, sizeof(synthesized));
+    if (memcmp(buffer, synthesized, sizeof(synthesized)) == 0) {
+        if (is_fat_sector_written(sector)) {
+            lfs_remove(&real_filesystem, filename);
+            fat_sector_written[(sector - 1) / 8] &= ~(1 << ((sector - 1) % 8));
+        }
+        if (fat_sector_cached == sector)
+            fat_sector_cached = 0;
+        return;
     }
-    lfs_ssize_t s = lfs_file_write(&real_filesystem, &fat_cache, buffer, size);
-    if (s < 0) {
-        printf("bulk_update_fat_buffer_write: lfs_file_read error=%ld\n", s);
-        return 0;
+
+    lfs_file_t f;
+    int err = lfs_file_open(&real_filesystem, &f, filename, LFS_O_WRONLY|LFS_O_CREAT|LFS_O_TRUNC);
+    if (err != LFS_ERR_OK) {
+        printf("write_fat_sector: can't open '%s': err=%d\n", filename, err);
+        return;
     }
-    return (size_t)s;
+    lfs_ssize_t s = lfs_file_write(&real_filesystem, &f, buffer, DISK_SECTOR_SIZE);
+    lfs_file_close(&real_filesystem, &f);
+    if (s != DISK_SECTOR_SIZE) {
+        printf("write_fat_sector: lfs_file_write error=%ld\n", s);
+        return;
+    }
+    fat_sector_written[(sector - 1) / 8] |= 1 << ((sector - 1) % 8);
+    memcpy(fat_sector_cache, buffer, sizeof(fat_sector_cache));
+    fat_sector_cached = sector;
 }
 
-static size_t bulk_update_fat(uint32_t start_cluster, size_t size) {
-    size_t num_clusters = ceil((double)size / 512);
-    unsigned char buffer[BUFFER_SIZE + 1];
-    unsigned int current_cluster = start_cluster;
-    unsigned int next_cluster;
-    int initial_offset = (3 * start_cluster) / 2;
-    int initial_sector = initial_offset / BUFFER_SIZE;
-
-    size_t read = bulk_update_fat_buffer_read(initial_sector * BUFFER_SIZE, buffer, sizeof(buffer));
-    if (read == 0)
-        return 0;
+static void read_fat_bytes(size_t offset, uint8_t *buffer, size_t size) {
+    while (size > 0) {
+        uint32_t sector = offset / DISK_SECTOR_SIZE + 1;
+        size_t sector_offset = offset % DISK_SECTOR_SIZE;
+        size_t chunk = DISK_SECTOR_SIZE - sector_offset;
+        if (chunk > size)
+            chunk = size;
+
+        uint8_t *written = is_fat_sector_written(sector) ? read_written_fat_sector(sector) : NULL;
+        if (written != NULL)
+            memcpy(buffer, written + sector_offset, chunk);
+        else
+            synthesize_fat_bytes(offset, buffer, chunk);
 
-    int sector_size = 512;
+        offset += chunk;
+        buffer += chunk;
+        size -= chunk;
+    }
+}
 
-    for (unsigned int i = 0; i < num_clusters; i++) {
-        int offset = floor((3 * current_cluster) / 2.0);
-        int buffer_index = offset % sector_size;
+static uint16_t read_fat(int cluster) {
+    uint8_t current[2];
+    read_fat_bytes(cluster + cluster / 2, current, sizeof(current));
 
-        next_cluster = (i < num_clusters - 1) ? current_cluster + 1 : END_OF_CLUSTER_CHAIN;
-        if (current_cluster & 0x01) {
-            buffer[buffer_index] = (buffer[buffer_index] & 0x0F) | (next_cluster << 4);
-            buffer[buffer_index + 1] = (next_cluster >> 4) & 0xFF;
-        } else {
-            buffer[buffer_index] = next_cluster & 0xFF;
-            buffer[buffer_index + 1] = (buffer[buffer_index + 1] & 0xF0) | ((next_cluster >> 8) & 0x0F);
-        }
+    uint16_t result = 0;
+    if (cluster & 0x01) {
+        result = (current[0] >> 4) | ((uint16_t)current[1] << 4);
+    } else {
+        result = current[0] | ((uint16_t)(current[1] & 0x0F) << 8);
+    }
+    return result;
+}
 
-        // FAT12 sector boundaries
-        if (((current_cluster & 0x01) && buffer_index + 2 >= sector_size) ||
-             (buffer_index + 1 >= sector_size))
-        {
+/*
+ * Update an entry that can't be expressed by the extents as an explicit FAT sector
+ */
+static void update_fat_sector(uint32_t cluster, uint16_t value) {
+    size_t position = cluster + cluster / 2;
+    uint8_t sector_buffer[DISK_SECTOR_SIZE];
+
+    for (size_t j = 0; j < 2; j++) {
+        uint32_t sector = (position + j) / DISK_SECTOR_SIZE + 1;
+        size_t index = (position + j) % DISK_SECTOR_SIZE;
+        read_fat_bytes((sector - 1) * DISK_SECTOR_SIZE, sector_buffer, sizeof(sector_buffer));
+        if ((cluster & 0x01) && j == 0)
+            sector_buffer[index] = (sector_buffer[index] & 0x0F) | ((value << 4) & 0xF0);
+        else if (cluster & 0x01)
+            sector_buffer[index] = value >> 4;
+        else if (j == 0)
+            sector_buffer[index] = value & 0xFF;
+        else
+            sector_buffer[index] = (sector_buffer[index] & 0xF0) | ((value >> 8) & 0x0F);
+        write_fat_sector(sector, sector_buffer);
+    }
+}
 
-            size_t write = bulk_update_fat_buffer_write(initial_sector * BUFFER_SIZE, buffer, sizeof(buffer));
-            if (write == 0)
-                return 0;
+static void update_fat(uint32_t cluster, uint16_t value) {
+    if (cluster < 2)
+        return;  // reserved entries
+
+    size_t position = cluster + cluster / 2;
+    if (is_fat_sector_written(position / DISK_SECTOR_SIZE + 1)
+        || is_fat_sector_written((position + 1) / DISK_SECTOR_SIZE + 1))
+    {
+        update_fat_sector(cluster, value);
+        return;
+    }
 
-            initial_sector++;
+    fat_extent_t *extent = find_fat_extent(cluster);
+    if (extent != NULL) {
+        if (cluster == (uint32_t)extent->start + extent->length - 1 && value != 0) {
+            extent->next = value;
+            invalidate_rendered_fat(cluster, cluster);
+            fat_version++;
+            return;
+        }
+        if (value == cluster + 1)
+            return;
+    } else if (value != 0 && insert_fat_extent(cluster, 1, value)) {
+        return;
+    } else if (value == 0) {
+        return;
+    }
+    update_fat_sector(cluster, value);
+}
 
-            read = bulk_update_fat_buffer_read(initial_sector * BUFFER_SIZE, buffer, sizeof(buffer));
-            if (read == 0)
-                return 0;
+/*
+ * Allocate consecutive clusters for a file of size bytes from start_cluster
+ */
+static size_t bulk_update_fat(uint32_t start_cluster, size_t size) {
+    size_t num_clusters = ceil((double)size / DISK_SECTOR_SIZE);
 
-            buffer_index = 0;
-            if (current_cluster & 0x01) {
-                buffer[buffer_index] = (next_cluster >> 4) & 0xFF;
-            } else {
-                buffer[buffer_index] = (buffer[buffer_index] & 0xF0) | ((next_cluster >> 8) & 0x0F);
-            }
+    if (!insert_fat_extent(start_cluster, num_clusters, END_OF_CLUSTER_CHAIN)) {
+        for (size_t i = 0; i < num_clusters; i++) {
+            update_fat(start_cluster + i, i < num_clusters - 1 ? start_cluster + i + 1 : END_OF_CLUSTER_CHAIN);
         }
-        current_cluster++;
     }
-
-    size_t write = bulk_update_fat_buffer_write(initial_sector * BUFFER_SIZE, buffer, sizeof(buffer));
-    if (write == 0)
-        return 0;
     return start_cluster + num_clusters + 1;
 }
 
 static void init_fat(void) {
-    uint64_t storage_size = littlefs_lfs_config->block_count * littlefs_lfs_config->block_size;
-    uint32_t cluster_size = storage_size / (DISK_SECTOR_SIZE * 1);
-
     struct lfs_info finfo;
     int err = lfs_stat(&real_filesystem, ".mimic", &finfo);
     if (err == LFS_ERR_NOENT) {
@@ -355,28 +585,28 @@ static void init_fat(void) {
             return;
         }
     }
-
-    err = lfs_file_open(&real_filesystem, &fat_cache, ".mimic/FAT", LFS_O_RDWR|LFS_O_CREAT);
-    assert(err == 0);
-
-    uint8_t head[3] = {0xF8, 0xFF, 0xFF};
-    head[0] = 0xF8;
-    head[1] = 0xFF;
-    head[2] = 0xFF;
-    lfs_ssize_t s = lfs_file_write(&real_filesystem, &fat_cache, head, sizeof(head));
-    if (s != sizeof(head)) {
-        printf("init_fat: lfs_file_write error=%ld\n", s);
-        return;
+    err = lfs_stat(&real_filesystem, ".mimic/FAT", &finfo);
+    if (err == LFS_ERR_OK && finfo.type == LFS_TYPE_REG) {
+        lfs_remove(&real_filesystem, ".mimic/FAT");  // the whole table was kept as a file before
+        err = LFS_ERR_NOENT;
     }
-
-    uint8_t pair[3] = {0x00, 0x00, 0x00};
-    for (size_t i = 0; i < (float)cluster_size / 2; i++) {
-        s = lfs_file_write(&real_filesystem, &fat_cache, pair, sizeof(pair));
-        if (s != sizeof(pair)) {
-            printf("init_fat: lfs_file_write error=%ld\n", s);
-            break;
+    if (err == LFS_ERR_NOENT) {
+        err = lfs_mkdir(&real_filesystem, ".mimic/FAT");
+        if (err != LFS_ERR_OK) {
+            printf("init_fat: can't create .mimic/FAT directory: err=%d\n", err);
+            return;
         }
+    } else {
+        delete_directory(".mimic/FAT");  // the sectors are forgotten with the bitmap below
     }
+
+    fat_extent_num = 0;
+    invalidate_rendered_sectors();
+    fat_version++;
+    free(fat_sector_written);
+    fat_sector_written = calloc((fat_sector_size() + 7) / 8, 1);
+    assert(fat_sector_written != NULL);
+    fat_sector_cached = 0;
 }
 
 
@@ -441,13 +671,16 @@ static bool is_short_filename_file(uint8_t *filename) {
     if (filename[0] == '.')
         return false;
 
-    strncpy(buffer, (const char *)filename, sizeof(buffer));
+    strncpy(buffer, (const char *)filename, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = '\0';
     unsigned char *name = (unsigned char *)strtok(buffer, ".");
-    if (strlen((char *)name) > 8) {
+    if (name == NULL || strlen((char *)name) > 8) {
         return false;
     }
     unsigned char *ext = (unsigned char *)strtok(NULL, ".");
-    if (strlen((char *)ext) > 3) {
+    if (ext == NULL) {
+        ext = (unsigned char *)"";
+    } else if (strlen((char *)ext) > 3 || strtok(NULL, ".") != NULL) {
         return false;
     }
 
@@ -476,16 +709,6 @@ static bool is_short_filename_file(uint8_t *filename) {
     return true;
 }
 
-static void to_uppercase(char *str) {
-    if (str == NULL)
-        return;
-
-    while (*str) {
-        *str = toupper((unsigned char) *str);
-        str++;
-    }
-}
-
 static bool is_short_filename_dir(uint8_t *filename) {
     uint8_t buffer[LFS_NAME_MAX + 1];
     strncpy((char *)buffer, (const char *)filename, sizeof(buffer));
@@ -506,26 +729,119 @@ static bool is_short_filename_dir(uint8_t *filename) {
     return true;
 }
 
-static void create_shortened_short_filename(uint8_t *sfn, const char *long_filename) {
-    uint8_t buffer[LFS_NAME_MAX + 1];
-    uint8_t filename[FAT_SHORT_NAME_MAX + 1];
+/*
+ * Short file names used in one directory
+ *
+ * Holds a hash of every short name, so a generated name is checked for collisions in O(1).
+ * A false hit on a hash only skips a candidate name, it never lets a duplicate through.
+ * The table grows with the directory, every name of it is kept.
+ */
+#define SFN_INDEX_MIN_SIZE  128
 
-    strncpy((char *)buffer, long_filename, sizeof(buffer));
-    char *name = strtok((char *)buffer, ".");
-    (void)name;
-    char *ext = strtok(NULL, ".");
-    ext[3] = '\0';
-    to_uppercase(ext);
-    snprintf((char *)filename, sizeof(filename), "FIL~%04X%-3s", rand() % 0xFFFF, ext);
-    memcpy(sfn, filename, FAT_SHORT_NAME_MAX);
+typedef struct {
+    uint32_t *hash;  // open addressing, 0 for a free slot
+    size_t size;     // slots, a power of two
+    size_t count;
+} sfn_index_t;
+
+static void sfn_index_init(sfn_index_t *index) {
+    memset(index, 0, sizeof(*index));
+}
+
+static void sfn_index_free(sfn_index_t *index) {
+    free(index->hash);
+    sfn_index_init(index);
+}
+
+static uint32_t sfn_index_hash(const uint8_t *sfn) {
+    uint32_t hash = lfs_crc(0xFFFFFFFF, sfn, FAT_SHORT_NAME_MAX);
+    return hash != 0 ? hash : 1;
+}
+
+static void sfn_index_put(uint32_t *table, size_t size, uint32_t hash) {
+    size_t slot = hash & (size - 1);
+    while (table[slot] != 0)
+        slot = (slot + 1) & (size - 1);
+    table[slot] = hash;
+}
+
+/*
+ * Double the slots, the table is never more than half full
+ */
+static void sfn_index_grow(sfn_index_t *index) {
+    size_t size = index->size != 0 ? index->size * 2 : SFN_INDEX_MIN_SIZE;
+    uint32_t *hash = calloc(size, sizeof(uint32_t));
+    assert(hash != NULL);
+    for (size_t i = 0; i < index->size; i++) {
+        if (index->hash[i] != 0)
+            sfn_index_put(hash, size, index->hash[i]);
+    }
+    free(index->hash);
+    index->hash = hash;
+    index->size = size;
+}
+
+static bool sfn_index_contains(sfn_index_t *index, const uint8_t *sfn) {
+    uint32_t hash = sfn_index_hash(sfn);
+    for (size_t i = 0; i < index->size; i++) {
+        uint32_t slot = index->hash[(hash + i) & (index->size - 1)];
+        if (slot == 0)
+            return false;
+        if (slot == hash)
+            return true;
+    }
+    return false;
+}
+
+static void sfn_index_insert(sfn_index_t *index, const uint8_t *sfn) {
+    if (sfn_index_contains(index, sfn))
+        return;
+    if ((index->count + 1) * 2 > index->size)
+        sfn_index_grow(index);
+    sfn_index_put(index->hash, index->size, sfn_index_hash(sfn));
+    index->count++;
 }
 
-static void create_shortened_short_filename_dir(uint8_t *sfn, const char *long_filename) {
-    (void)long_filename;
+/*
+ * Derive a "<prefix>~XXXX<ext>" short name from a stable hash of the long name
+ *
+ * The same tree yields the same short names on every mimic_fat_create_cache().
+ * On a collision within the directory the next hash value is tried.
+ */
+static void create_hashed_short_filename(uint8_t *sfn, sfn_index_t *index, const char *prefix,
+                                         const char *long_filename, const char *ext)
+{
     uint8_t filename[FAT_SHORT_NAME_MAX + 1];
+    uint32_t hash = lfs_crc(0xFFFFFFFF, long_filename, strlen(long_filename));
+    uint16_t tail = (hash ^ (hash >> 16)) & 0xFFFF;
 
-    snprintf((char *)filename, sizeof(filename), "DIR~%04X   ", rand() % 0xFFFF);
+    for (uint32_t i = 0; i <= 0xFFFF; i++) {
+        snprintf((char *)filename, sizeof(filename), "%s~%04X%-3s", prefix, (uint16_t)(tail + i), ext);
+        if (index == NULL || !sfn_index_contains(index, filename))
+            break;
+    }
     memcpy(sfn, filename, FAT_SHORT_NAME_MAX);
+    if (index != NULL)
+        sfn_index_insert(index, sfn);
+}
+
+static void create_shortened_short_filename(uint8_t *sfn, sfn_index_t *index, const char *long_filename) {
+    char ext[3 + 1] = "";
+
+    const char *dot = strrchr(long_filename, '.');
+    if (dot != NULL && dot != long_filename) {
+        size_t i = 0;
+        for (const char *p = dot + 1; *p != '\0' && i < 3; p++) {
+            if (isalnum((unsigned char)*p) || is_fat_sfn_symbol((unsigned char)*p))
+                ext[i++] = toupper((unsigned char)*p);
+        }
+        ext[i] = '\0';
+    }
+    create_hashed_short_filename(sfn, index, "FIL", long_filename, ext);
+}
+
+static void create_shortened_short_filename_dir(uint8_t *sfn, sfn_index_t *index, const char *long_filename) {
+    create_hashed_short_filename(sfn, index, "DIR", long_filename, "");
 }
 
 static uint8_t filename_check_sum(const uint8_t *filename) {
@@ -606,95 +922,443 @@ static void set_long_file_entry(fat_dir_entry_t *dir, uint16_t *lfn_chunk, uint8
 
 
 /*
- * Save buffers sent by the host to LFS temporary files
+ * RAM staging of clusters the host writes before it allocates them
+ *
+ * Hosts like Linux write the file data before the FAT and the directory entry. Such clusters
+ * are held in RAM until littlefs_write() copies them into the file, and are saved as temporary
+ * files only when the staging area is full. A cluster copied out of the staging area is marked
+ * as written through, its data is then found in the littlefs file.
  */
-static bool save_temporary_file(uint32_t cluster, void *buffer) {
-    TRACE("save_temporary_file: cluster=%lu\n", cluster);
+#ifndef MIMIC_FAT_STAGING_CLUSTERS
+#define MIMIC_FAT_STAGING_CLUSTERS  16
+#endif
 
-    char filename[LFS_NAME_MAX + 1];
-    int tens = (cluster / 10) % 10;
-    int hundreds = (cluster / 100) % 10;
-    int thousands = (cluster / 1000) % 10;
+typedef struct {
+    uint32_t cluster;  // 0 if the slot is free
+    uint32_t stamp;
+    uint8_t buffer[DISK_SECTOR_SIZE];
+} staged_cluster_t;
 
-    snprintf(filename, sizeof(filename), ".mimic/%d", thousands);
-    struct lfs_info finfo;
-    int err = lfs_stat(&real_filesystem, filename, &finfo);
-    if (err == LFS_ERR_NOENT) {
-        err = lfs_mkdir(&real_filesystem, filename);
-        if (err != LFS_ERR_OK) {
-            printf("save_temporary_file: can't create '%s' directory: err=%d\n", filename, err);
-            return false;
-        }
-    }
-    snprintf(filename, sizeof(filename), ".mimic/%d/%1d", thousands, hundreds);
-    err = lfs_stat(&real_filesystem, filename, &finfo);
-    if (err == LFS_ERR_NOENT) {
-        err = lfs_mkdir(&real_filesystem, filename);
-        if (err != LFS_ERR_OK) {
-            printf("save_temporary_file: can't create '%s' directory: err=%d\n", filename, err);
-            return false;
-        }
-    }
-    snprintf(filename, sizeof(filename), ".mimic/%d/%1d/%1d", thousands, hundreds, tens);
-    err = lfs_stat(&real_filesystem, filename, &finfo);
-    if (err == LFS_ERR_NOENT) {
-        err = lfs_mkdir(&real_filesystem, filename);
-        if (err != LFS_ERR_OK) {
-            printf("save_temporary_file: can't create '%s' directory: err=%d\n", filename, err);
-            return false;
-        }
-    }
+static staged_cluster_t staged_clusters[MIMIC_FAT_STAGING_CLUSTERS];
+static uint32_t staging_stamp = 0;
 
-    snprintf(filename, sizeof(filename), ".mimic/%d/%1d/%1d/%04ld", thousands, hundreds,tens, cluster);
-    lfs_file_t f;
-    err = lfs_file_open(&real_filesystem, &f, filename, LFS_O_RDWR|LFS_O_CREAT);
-    if (err != LFS_ERR_OK) {
-        printf("save_temporary_file: can't lfs_file_open '%s' err=%d\n", filename, err);
-        return false;
-    }
-    lfs_file_write(&real_filesystem, &f, buffer, 512);
-    lfs_file_close(&real_filesystem, &f);
-    return 1;
+/*
+ * Per cluster flags of the cluster store
+ *
+ * A sector of only 0x00 or only 0xFF bytes is kept as a flag instead of a temporary file.
+ */
+static uint8_t *written_through = NULL;
+static uint8_t *zero_filled = NULL;
+static uint8_t *erase_filled = NULL;
+
+static uint8_t *alloc_cluster_bitmap(uint8_t *bitmap) {
+    free(bitmap);
+    bitmap = calloc((cluster_size() + 7) / 8 + 1, 1);
+    assert(bitmap != NULL);
+    return bitmap;
 }
 
-static int read_temporary_file(uint32_t cluster, void *buffer) {
-    lfs_file_t f;
-    char filename[LFS_NAME_MAX + 1];
+static void set_cluster_bit(uint8_t *bitmap, uint32_t cluster, bool value) {
+    if (bitmap == NULL || cluster > cluster_size())
+        return;
+    if (value)
+        bitmap[cluster / 8] |= 1 << (cluster % 8);
+    else
+        bitmap[cluster / 8] &= ~(1 << (cluster % 8));
+}
 
-    int tens = (cluster/ 10) % 10;
-    int hundreds = (cluster/ 100) % 10;
-    int thousands = (cluster/ 1000) % 10;
-    snprintf(filename, sizeof(filename), ".mimic/%d/%1d/%1d/%04ld", thousands, hundreds,tens, cluster);
-    int err = lfs_file_open(&real_filesystem, &f, filename, LFS_O_RDONLY);
-    if (err != LFS_ERR_OK) {
-        if (err == LFS_ERR_NOENT)
-            return err;
-        printf("read_temporary_file: can't open '%s': err=%d\n", filename, err);
-        return err;
-    }
+static bool get_cluster_bit(const uint8_t *bitmap, uint32_t cluster) {
+    return bitmap != NULL && cluster <= cluster_size() && (bitmap[cluster / 8] & (1 << (cluster % 8)));
+}
 
-    lfs_ssize_t size = lfs_file_read(&real_filesystem, &f, buffer, 512);
-    if (size != 512) {
-        printf("read_temporary_file: can't read '%s': size=%lu\n", filename, size);
-        lfs_file_close(&real_filesystem, &f);
-        return err;
+/*
+ * The byte a sector is filled with, 0x00 or 0xFF, or -1 for any other content
+ *
+ * Compared a word at a time, buffers from the USB stack need not be aligned.
+ */
+static int uniform_sector_fill(const void *buffer) {
+    uint32_t first;
+    memcpy(&first, buffer, sizeof(first));
+    if (first != 0x00000000 && first != 0xFFFFFFFF)
+        return -1;
+    for (size_t i = sizeof(first); i < DISK_SECTOR_SIZE; i += sizeof(first)) {
+        uint32_t word;
+        memcpy(&word, (const uint8_t *)buffer + i, sizeof(word));
+        if (word != first)
+            return -1;
     }
-
-    lfs_file_close(&real_filesystem, &f);
-    return LFS_ERR_OK;
+    return first & 0xFF;
 }
 
 /*
-static bool delete_temporary_file(uint32_t cluster) {
-    printf("delete_temporary_file: cluster=%lu\n", cluster);
+ * Optional compression of the temporary files
+ *
+ * A cluster is stored compressed only if it shrinks to MIMIC_FAT_COMPRESS_THRESHOLD bytes or
+ * less, otherwise it's stored raw. The file size tells the two apart: only a raw file is
+ * DISK_SECTOR_SIZE bytes long, so clusters saved either way read back whatever the setting.
+ */
+#ifndef MIMIC_FAT_COMPRESS_THRESHOLD
+#define MIMIC_FAT_COMPRESS_THRESHOLD  448
+#endif
 
-    char filename[LFS_NAME_MAX + 1];
-    int tens = (file_id / 10) % 10;
-    int hundreds = (file_id / 100) % 10;
-    int thousands = (file_id / 1000) % 10;
-    snprintf(filename, sizeof(filename), ".mimic/%d/%1d/%1d/%04ld", thousands, hundreds,tens, cluster);
-    int err = lfs_remove(&real_filesystem, filename);
-    if (err != LFS_ERR_OK) {
+static bool compression_is_enabled = false;
+static mimic_fat_compression_stats_t compression_stats;
+
+void mimic_fat_set_compression(bool enable) {
+    compression_is_enabled = enable;
+}
+
+void mimic_fat_compression_stats(mimic_fat_compression_stats_t *stats) {
+    *stats = compression_stats;
+}
+
+static size_t compress_cluster(const void *buffer, uint8_t *compressed) {
+    clock_t start = clock();
+    size_t size = lz_compress(buffer, DISK_SECTOR_SIZE, compressed, MIMIC_FAT_COMPRESS_THRESHOLD);
+    compression_stats.compress_time += clock() - start;
+    compression_stats.clusters++;
+    compression_stats.raw_bytes += DISK_SECTOR_SIZE;
+    if (size > 0)
+        compression_stats.compressed_clusters++;
+    compression_stats.stored_bytes += size > 0 ? size : DISK_SECTOR_SIZE;
+    return size;
+}
+
+static bool decompress_cluster(const uint8_t *compressed, size_t size, void *buffer) {
+    clock_t start = clock();
+    size_t length = lz_decompress(compressed, size, buffer, DISK_SECTOR_SIZE);
+    compression_stats.decompress_time += clock() - start;
+    return length == DISK_SECTOR_SIZE;
+}
+
+static staged_cluster_t *find_staged_cluster(uint32_t cluster) {
+    for (size_t i = 0; i < MIMIC_FAT_STAGING_CLUSTERS; i++) {
+        if (cluster != 0 && staged_clusters[i].cluster == cluster)
+            return &staged_clusters[i];
+    }
+    return NULL;
+}
+
+/*
+ * Content addressed store of the temporary files
+ *
+ * Clusters with the same content share one .mimic/C/<x>/<id> file, where <id> is the CRC of
+ * the content, or the next free value if that one is taken by another content. A reference
+ * count per file removes it along with the last cluster using it.
+ */
+#define CONTENT_BLOB_MIN_SLOTS  64
+
+typedef struct {
+    uint32_t id;    // 0 if the slot has never been used
+    uint16_t refs;  // 0 if the file has been removed
+} content_blob_t;
+
+static content_blob_t *content_blobs = NULL;
+static size_t content_blob_slots = 0;
+static size_t content_blob_used = 0;
+static uint16_t *cluster_blob = NULL;  // content_blobs slot + 1 for each cluster, 0 if none
+
+static void content_blob_filename(char *filename, size_t size, uint32_t id) {
+    snprintf(filename, size, ".mimic/C/%lX/%08lX", (unsigned long)(id >> 28), (unsigned long)id);
+}
+
+/*
+ * The slot holding id, or the never used slot where it would be inserted
+ */
+static size_t content_blob_slot(uint32_t id) {
+    size_t slot = id & (content_blob_slots - 1);
+    while (content_blobs[slot].id != 0 && content_blobs[slot].id != id)
+        slot = (slot + 1) & (content_blob_slots - 1);
+    return slot;
+}
+
+/*
+ * Rebuild the slot table without removed files, growing it while it's more than half full
+ */
+static void rehash_content_blobs(void) {
+    size_t live = 0;
+    for (size_t i = 0; i < content_blob_slots; i++) {
+        if (content_blobs[i].refs > 0)
+            live++;
+    }
+    size_t old_slots = content_blob_slots;
+    content_blob_t *old = content_blobs;
+    while (live * 2 >= content_blob_slots)
+        content_blob_slots *= 2;
+    content_blobs = calloc(content_blob_slots, sizeof(content_blob_t));
+    uint16_t *moved = calloc(old_slots, sizeof(uint16_t));
+    assert(content_blobs != NULL && moved != NULL);
+
+    content_blob_used = 0;
+    for (size_t i = 0; i < old_slots; i++) {
+        if (old[i].refs == 0)
+            continue;
+        size_t slot = content_blob_slot(old[i].id);
+        content_blobs[slot] = old[i];
+        moved[i] = slot + 1;
+        content_blob_used++;
+    }
+    for (uint32_t cluster = 0; cluster <= cluster_size(); cluster++) {
+        if (cluster_blob[cluster] != 0)
+            cluster_blob[cluster] = moved[cluster_blob[cluster] - 1];
+    }
+    free(moved);
+    free(old);
+}
+
+static void init_content_blobs(void) {
+    free(content_blobs);
+    content_blob_slots = CONTENT_BLOB_MIN_SLOTS;
+    content_blob_used = 0;
+    content_blobs = calloc(content_blob_slots, sizeof(content_blob_t));
+    free(cluster_blob);
+    cluster_blob = calloc(cluster_size() + 1, sizeof(uint16_t));
+    assert(content_blobs != NULL && cluster_blob != NULL);
+}
+
+static void init_cluster_store(void) {
+    memset(staged_clusters, 0, sizeof(staged_clusters));
+    staging_stamp = 0;
+    written_through = alloc_cluster_bitmap(written_through);
+    zero_filled = alloc_cluster_bitmap(zero_filled);
+    erase_filled = alloc_cluster_bitmap(erase_filled);
+    init_content_blobs();
+}
+
+/*
+ * Drop the reference of cluster to its file, the file is removed with the last reference
+ */
+static void release_content_blob(uint32_t cluster) {
+    if (cluster_blob == NULL || cluster > cluster_size() || cluster_blob[cluster] == 0)
+        return;
+
+    content_blob_t *blob = &content_blobs[cluster_blob[cluster] - 1];
+    cluster_blob[cluster] = 0;
+    if (--blob->refs > 0)
+        return;
+
+    char filename[LFS_NAME_MAX + 1];
+    content_blob_filename(filename, sizeof(filename), blob->id);
+    int err = lfs_remove(&real_filesystem, filename);
+    if (err != LFS_ERR_OK)
+        printf("release_content_blob: can't lfs_remove '%s' error=%d\n", filename, err);
+}
+
+static bool make_directory(const char *path) {
+    struct lfs_info finfo;
+    int err = lfs_stat(&real_filesystem, path, &finfo);
+    if (err == LFS_ERR_NOENT) {
+        err = lfs_mkdir(&real_filesystem, path);
+        if (err != LFS_ERR_OK) {
+            printf("make_directory: can't create '%s' directory: err=%d\n", path, err);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool write_cluster_file(const char *filename, const void *buffer) {
+    uint8_t compressed[MIMIC_FAT_COMPRESS_THRESHOLD];
+    size_t size = compression_is_enabled ? compress_cluster(buffer, compressed) : 0;
+
+    lfs_file_t f;
+    int err = lfs_file_open(&real_filesystem, &f, filename, LFS_O_RDWR|LFS_O_CREAT|LFS_O_TRUNC);
+    if (err != LFS_ERR_OK) {
+        printf("write_cluster_file: can't lfs_file_open '%s' err=%d\n", filename, err);
+        return false;
+    }
+    if (size > 0)
+        lfs_file_write(&real_filesystem, &f, compressed, size);
+    else
+        lfs_file_write(&real_filesystem, &f, buffer, DISK_SECTOR_SIZE);
+    lfs_file_close(&real_filesystem, &f);
+    return true;
+}
+
+static int read_cluster_file(const char *filename, void *buffer) {
+    lfs_file_t f;
+    int err = lfs_file_open(&real_filesystem, &f, filename, LFS_O_RDONLY);
+    if (err != LFS_ERR_OK) {
+        printf("read_cluster_file: can't open '%s': err=%d\n", filename, err);
+        return err;
+    }
+
+    lfs_ssize_t size = lfs_file_size(&real_filesystem, &f);
+    if (size > 0 && size < DISK_SECTOR_SIZE) {
+        uint8_t compressed[DISK_SECTOR_SIZE];
+        if (lfs_file_read(&real_filesystem, &f, compressed, size) != size
+            || !decompress_cluster(compressed, size, buffer))
+        {
+            printf("read_cluster_file: can't decompress '%s': size=%lu\n", filename, size);
+            lfs_file_close(&real_filesystem, &f);
+            return LFS_ERR_CORRUPT;
+        }
+        lfs_file_close(&real_filesystem, &f);
+        return LFS_ERR_OK;
+    }
+
+    size = lfs_file_read(&real_filesystem, &f, buffer, DISK_SECTOR_SIZE);
+    lfs_file_close(&real_filesystem, &f);
+    if (size != DISK_SECTOR_SIZE) {
+        printf("read_cluster_file: can't read '%s': size=%lu\n", filename, size);
+        return LFS_ERR_CORRUPT;
+    }
+    return LFS_ERR_OK;
+}
+
+/*
+ * Save buffers sent by the host to LFS temporary files
+ */
+static bool save_temporary_file(uint32_t cluster, void *buffer) {
+    TRACE("save_temporary_file: cluster=%lu\n", cluster);
+
+    char filename[LFS_NAME_MAX + 1];
+    uint8_t stored[DISK_SECTOR_SIZE];
+
+    staged_cluster_t *staged = find_staged_cluster(cluster);
+    if (staged != NULL)
+        staged->cluster = 0;
+    set_cluster_bit(written_through, cluster, false);
+
+    int fill = uniform_sector_fill(buffer);
+    set_cluster_bit(zero_filled, cluster, fill == 0x00);
+    set_cluster_bit(erase_filled, cluster, fill == 0xFF);
+    if (fill >= 0 && cluster != 0) {
+        release_content_blob(cluster);  // a previous content of the cluster is dropped
+        return true;
+    }
+
+    if (content_blob_used * 4 >= content_blob_slots * 3)
+        rehash_content_blobs();
+
+    uint32_t id = lfs_crc(0xFFFFFFFF, buffer, DISK_SECTOR_SIZE);
+    while (true) {
+        if (id == 0)
+            id = 1;
+        size_t slot = content_blob_slot(id);
+        content_blob_t *blob = &content_blobs[slot];
+        content_blob_filename(filename, sizeof(filename), id);
+        if (blob->refs == 0) {
+            snprintf(filename, sizeof(filename), ".mimic/C/%lX", (unsigned long)(id >> 28));
+            if (!make_directory(".mimic/C") || !make_directory(filename))
+                return false;
+            content_blob_filename(filename, sizeof(filename), id);
+            if (!write_cluster_file(filename, buffer))
+                return false;
+            if (blob->id == 0)
+                content_blob_used++;
+            blob->id = id;
+        } else if (cluster_blob[cluster] != slot + 1) {
+            if (read_cluster_file(filename, stored) != LFS_ERR_OK
+                || memcmp(stored, buffer, DISK_SECTOR_SIZE) != 0)
+            {
+                id++;  // another content has this id
+                continue;
+            }
+            TRACE("save_temporary_file: cluster=%lu shares '%s'\n", cluster, filename);
+        } else {
+            if (read_cluster_file(filename, stored) == LFS_ERR_OK
+                && memcmp(stored, buffer, DISK_SECTOR_SIZE) == 0)
+            {
+                return true;  // rewritten with the same content
+            }
+            id++;
+            continue;
+        }
+        release_content_blob(cluster);
+        blob->refs++;
+        cluster_blob[cluster] = slot + 1;
+        return true;
+    }
+}
+
+/*
+ * Whether read_temporary_file() has a content for cluster, without reading flash
+ */
+static bool has_temporary_file(uint32_t cluster) {
+    if (find_staged_cluster(cluster) != NULL)
+        return true;
+    if (get_cluster_bit(written_through, cluster))
+        return false;
+    if (get_cluster_bit(zero_filled, cluster) || get_cluster_bit(erase_filled, cluster))
+        return true;
+    return cluster_blob != NULL && cluster <= cluster_size() && cluster_blob[cluster] != 0;
+}
+
+static int read_temporary_file(uint32_t cluster, void *buffer) {
+    char filename[LFS_NAME_MAX + 1];
+
+    staged_cluster_t *staged = find_staged_cluster(cluster);
+    if (staged != NULL) {
+        memcpy(buffer, staged->buffer, DISK_SECTOR_SIZE);
+        return LFS_ERR_OK;
+    }
+    // copied from the staging area into littlefs, an older saved copy is out of date
+    if (get_cluster_bit(written_through, cluster))
+        return LFS_ERR_NOENT;
+    if (get_cluster_bit(zero_filled, cluster) || get_cluster_bit(erase_filled, cluster)) {
+        memset(buffer, get_cluster_bit(zero_filled, cluster) ? 0x00 : 0xFF, DISK_SECTOR_SIZE);
+        return LFS_ERR_OK;
+    }
+    if (cluster_blob == NULL || cluster > cluster_size() || cluster_blob[cluster] == 0)
+        return LFS_ERR_NOENT;
+
+    content_blob_filename(filename, sizeof(filename), content_blobs[cluster_blob[cluster] - 1].id);
+    return read_cluster_file(filename, buffer);
+}
+
+/*
+ * Keep a cluster written before its allocation, the least recently written one is saved when full
+ */
+static void stage_cluster(uint32_t cluster, void *buffer) {
+    TRACE("stage_cluster: cluster=%lu\n", cluster);
+
+    staged_cluster_t *staged = find_staged_cluster(cluster);
+    if (staged == NULL) {
+        staged = &staged_clusters[0];
+        for (size_t i = 0; i < MIMIC_FAT_STAGING_CLUSTERS; i++) {
+            if (staged_clusters[i].cluster == 0) {
+                staged = &staged_clusters[i];
+                break;
+            }
+            if (staged_clusters[i].stamp < staged->stamp)
+                staged = &staged_clusters[i];
+        }
+        if (staged->cluster != 0)
+            save_temporary_file(staged->cluster, staged->buffer);  // frees the slot
+    }
+    memcpy(staged->buffer, buffer, DISK_SECTOR_SIZE);
+    staged->cluster = cluster;
+    staged->stamp = ++staging_stamp;
+    set_cluster_bit(written_through, cluster, false);
+    // a sector saved before is out of date
+    set_cluster_bit(zero_filled, cluster, false);
+    set_cluster_bit(erase_filled, cluster, false);
+    release_content_blob(cluster);
+}
+
+/*
+ * Release a staged cluster whose data has been written into littlefs
+ */
+static void release_staged_cluster(uint32_t cluster) {
+    staged_cluster_t *staged = find_staged_cluster(cluster);
+    if (staged == NULL)
+        return;
+    staged->cluster = 0;
+    set_cluster_bit(written_through, cluster, true);
+}
+
+/*
+static bool delete_temporary_file(uint32_t cluster) {
+    printf("delete_temporary_file: cluster=%lu\n", cluster);
+
+    char filename[LFS_NAME_MAX + 1];
+    int tens = (file_id / 10) % 10;
+    int hundreds = (file_id / 100) % 10;
+    int thousands = (file_id / 1000) % 10;
+    snprintf(filename, sizeof(filename), ".mimic/%d/%1d/%1d/%04ld", thousands, hundreds,tens, cluster);
+    int err = lfs_remove(&real_filesystem, filename);
+    if (err != LFS_ERR_OK) {
         printf("delete_temporary_file: can't lfs_remove '%s' error=%d\n", filename, err);
         return false;
     }
@@ -702,6 +1366,227 @@ static bool delete_temporary_file(uint32_t cluster) {
 }
 */
 
+
+/*
+ * Iterate over the entries of a directory cluster chain
+ *
+ * The root directory is the single fixed cluster 1, sub directories follow their FAT chain.
+ */
+typedef struct {
+    uint32_t cluster;
+    size_t index;
+    size_t limit;
+    fat_dir_entry_t entry[FAT_DIR_ENTRIES_PER_CLUSTER];
+} dir_entry_iterator_t;
+
+static int read_dir_cluster(uint32_t cluster, void *buffer);
+
+static int dir_entry_iterator_init(dir_entry_iterator_t *it, uint32_t cluster) {
+    it->cluster = cluster == 0 ? 1 : cluster;
+    it->index = 0;
+    it->limit = cluster_size();
+    return read_dir_cluster(it->cluster, it->entry);
+}
+
+static fat_dir_entry_t *dir_entry_iterator_next(dir_entry_iterator_t *it) {
+    if (it->index == FAT_DIR_ENTRIES_PER_CLUSTER) {
+        if (it->cluster == 1 || it->limit-- == 0)
+            return NULL;
+        uint16_t next_cluster = read_fat(it->cluster);
+        if (next_cluster < 2 || next_cluster >= 0xFF8)
+            return NULL;
+        if (read_dir_cluster(next_cluster, it->entry) != LFS_ERR_OK) {
+            printf("dir_entry_iterator_next: cluster=%u not found\n", next_cluster);
+            return NULL;
+        }
+        it->cluster = next_cluster;
+        it->index = 0;
+    }
+    return &it->entry[it->index++];
+}
+
+/*
+ * Stable cluster numbers
+ *
+ * The first cluster of an exported file or directory is kept in a littlefs user attribute and
+ * reused by the next mimic_fat_create_cache(), so a change on the littlefs side doesn't renumber
+ * the rest of the tree. Stored clusters are claimed before the export, entries without one are
+ * allocated from the clusters left over.
+ */
+#define MIMIC_FAT_CLUSTER_ATTR  0x4D
+
+static uint8_t *claimed_clusters = NULL;
+
+static void entry_path(char *buffer, size_t size, const char *path, const char *name) {
+    if (path[0] == '\0')
+        strncpy(buffer, name, size);
+    else
+        snprintf(buffer, size, "%s/%s", path, name);
+    buffer[LFS_NAME_MAX] = '\0';
+}
+
+static uint32_t entry_cluster_count(const struct lfs_info *finfo) {
+    if (finfo->type == LFS_TYPE_DIR)
+        return 1;
+    return ceil((double)finfo->size / DISK_SECTOR_SIZE);
+}
+
+static uint16_t load_entry_cluster(const char *filename) {
+    uint8_t value[2];
+    lfs_ssize_t size = lfs_getattr(&real_filesystem, filename, MIMIC_FAT_CLUSTER_ATTR, value, sizeof(value));
+    if (size != sizeof(value))
+        return 0;
+    return value[0] | (value[1] << 8);
+}
+
+static void store_entry_cluster(const char *filename, uint16_t cluster) {
+    if (load_entry_cluster(filename) == cluster)
+        return;
+    uint8_t value[2] = {cluster & 0xFF, cluster >> 8};
+    int err = lfs_setattr(&real_filesystem, filename, MIMIC_FAT_CLUSTER_ATTR, value, sizeof(value));
+    if (err != LFS_ERR_OK)
+        printf("store_entry_cluster: lfs_setattr('%s') error=%d\n", filename, err);
+}
+
+static bool is_cluster_range_claimed(uint32_t start, uint32_t num) {
+    for (uint32_t i = start; i < start + num; i++) {
+        if (get_cluster_bit(claimed_clusters, i))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * First cluster from start where num consecutive clusters are not claimed
+ */
+static uint32_t skip_claimed_clusters(uint32_t start, uint32_t num) {
+    for (uint32_t i = start; i < start + num; i++) {
+        if (get_cluster_bit(claimed_clusters, i))
+            start = i + 1;
+    }
+    return start;
+}
+
+/*
+ * Claim the stored first clusters of the tree under path
+ *
+ * A stored cluster that is out of range or overlaps an earlier claim is dropped, the entry is
+ * then allocated anew by the export.
+ */
+static void claim_stored_clusters(const char *path) {
+    char filename[LFS_NAME_MAX * 2 + 1 + 1];  // for sprintf "%s/%s"
+    lfs_dir_t dir;
+    struct lfs_info finfo;
+
+    if (lfs_dir_open(&real_filesystem, &dir, path) != LFS_ERR_OK)
+        return;
+    while (lfs_dir_read(&real_filesystem, &dir, &finfo) > 0) {
+        if (strcmp(finfo.name, ".") == 0 || strcmp(finfo.name, "..") == 0)
+            continue;
+        if (path[0] == '\0' && strcmp(finfo.name, ".mimic") == 0)
+            continue;
+        if (finfo.type != LFS_TYPE_DIR && finfo.type != LFS_TYPE_REG)
+            continue;
+
+        entry_path(filename, sizeof(filename), path, finfo.name);
+        if (finfo.type == LFS_TYPE_DIR)
+            claim_stored_clusters(filename);
+
+        uint32_t num = entry_cluster_count(&finfo);
+        uint16_t cluster = num > 0 ? load_entry_cluster(filename) : 0;
+        if (cluster == 0)
+            continue;
+        if (cluster < 2 || cluster + num - 1 > cluster_size() || is_cluster_range_claimed(cluster, num)) {
+            lfs_removeattr(&real_filesystem, filename, MIMIC_FAT_CLUSTER_ATTR);
+            continue;
+        }
+        for (uint32_t i = cluster; i < cluster + num; i++)
+            set_cluster_bit(claimed_clusters, i, true);
+    }
+    lfs_dir_close(&real_filesystem, &dir);
+}
+
+/*
+ * Append directory entries to a directory cluster chain
+ *
+ * When exporting, the chain is extended with a newly allocated cluster as a cluster fills up.
+ * When rendering, the chain is followed and only render_cluster is copied to render_buffer.
+ * The root directory can't grow beyond the FAT12 root directory region.
+ */
+typedef struct {
+    uint32_t cluster;
+    size_t count;
+    uint32_t *allocated_cluster;
+    uint32_t render_cluster;
+    void *render_buffer;
+    bool is_rendered;
+    sfn_index_t sfn_index;
+    fat_dir_entry_t entry[FAT_DIR_ENTRIES_PER_CLUSTER];
+} dir_entry_writer_t;
+
+static void dir_entry_writer_init(dir_entry_writer_t *w, uint32_t cluster, uint32_t *allocated_cluster) {
+    w->cluster = cluster;
+    w->count = 0;
+    w->allocated_cluster = allocated_cluster;
+    w->render_cluster = 0;
+    w->render_buffer = NULL;
+    w->is_rendered = false;
+    sfn_index_init(&w->sfn_index);
+    memset(w->entry, 0, sizeof(w->entry));
+}
+
+static void dir_entry_writer_init_render(dir_entry_writer_t *w, uint32_t cluster,
+                                         uint32_t render_cluster, void *render_buffer)
+{
+    dir_entry_writer_init(w, cluster, NULL);
+    w->render_cluster = render_cluster;
+    w->render_buffer = render_buffer;
+}
+
+static bool dir_entry_writer_has_room(dir_entry_writer_t *w, size_t num) {
+    return w->cluster != 1 || w->count + num <= FAT_DIR_ENTRIES_PER_CLUSTER;
+}
+
+static bool dir_entry_writer_is_done(dir_entry_writer_t *w) {
+    return w->render_buffer != NULL && w->is_rendered;
+}
+
+static void dir_entry_writer_render(dir_entry_writer_t *w) {
+    if (w->render_buffer != NULL && w->cluster == w->render_cluster) {
+        memcpy(w->render_buffer, w->entry, sizeof(w->entry));
+        w->is_rendered = true;
+    }
+}
+
+static fat_dir_entry_t *dir_entry_writer_next(dir_entry_writer_t *w) {
+    if (w->count == FAT_DIR_ENTRIES_PER_CLUSTER) {
+        if (w->cluster == 1)
+            return NULL;
+        uint32_t next_cluster;
+        if (w->allocated_cluster != NULL) {
+            *w->allocated_cluster = skip_claimed_clusters(*w->allocated_cluster + 1, 1);
+            next_cluster = *w->allocated_cluster;
+            update_fat(w->cluster, next_cluster);
+            update_fat(next_cluster, END_OF_CLUSTER_CHAIN);
+        } else {
+            dir_entry_writer_render(w);
+            next_cluster = w->cluster != 0 ? read_fat(w->cluster) : 0;
+            if (next_cluster < 2 || next_cluster >= 0xFF8)
+                next_cluster = 0;  // entries beyond the chain are dropped
+        }
+
+        memset(w->entry, 0, sizeof(w->entry));
+        w->cluster = next_cluster;
+        w->count = 0;
+    }
+    return &w->entry[w->count++];
+}
+
+static void dir_entry_writer_flush(dir_entry_writer_t *w) {
+    dir_entry_writer_render(w);
+}
+
+
 static fat_dir_entry_t *append_dir_entry_volume_label(fat_dir_entry_t *entry, const char *volume_label) {
     uint8_t name[FAT_SHORT_NAME_MAX + 1];
 
@@ -731,19 +1616,33 @@ static void long_filename_padding(uint16_t *filename, size_t length, size_t size
     }
 }
 
-static fat_dir_entry_t *append_dir_entry_directory(fat_dir_entry_t *entry, struct lfs_info *finfo, uint32_t cluster) {
+/*
+ * Number of directory entries, long file name entries included, needed for finfo
+ */
+static size_t dir_entry_count(struct lfs_info *finfo) {
+    bool is_short_filename = finfo->type == LFS_TYPE_DIR ?
+        is_short_filename_dir((uint8_t *)finfo->name) : is_short_filename_file((uint8_t *)finfo->name);
+    if (is_short_filename)
+        return 1;
+
+    uint16_t filename[LFS_NAME_MAX + 1];
+    size_t len = utf8_to_utf16le(filename, sizeof(filename), finfo->name, strlen(finfo->name));
+    return 1 + (len + FAT_LONG_FILENAME_CHUNK_MAX - 1) / FAT_LONG_FILENAME_CHUNK_MAX;
+}
+
+static void append_dir_entry_directory(dir_entry_writer_t *w, struct lfs_info *finfo, uint32_t cluster) {
     TRACE("append_dir_entry_directory '%s'\n", finfo->name);
 
     if (strcmp(finfo->name, ".") == 0 || strcmp(finfo->name, "..") == 0) {
-        set_directory_entry(entry, finfo->name, cluster == 1 ? 0 : cluster);
+        set_directory_entry(dir_entry_writer_next(w), finfo->name, cluster == 1 ? 0 : cluster);
     }
     else if (is_short_filename_dir((uint8_t *)finfo->name)) {
-        set_directory_entry(entry, finfo->name, cluster);
+        set_directory_entry(dir_entry_writer_next(w), finfo->name, cluster);
     } else {
         fat_dir_entry_t short_dir_entry;
 
         set_directory_entry(&short_dir_entry, finfo->name, cluster);
-        create_shortened_short_filename_dir(short_dir_entry.DIR_Name, finfo->name);
+        create_shortened_short_filename_dir(short_dir_entry.DIR_Name, &w->sfn_index, finfo->name);
         uint8_t check_sum = filename_check_sum(short_dir_entry.DIR_Name);
 
         uint16_t filename[LFS_NAME_MAX + 1];
@@ -758,24 +1657,22 @@ static fat_dir_entry_t *append_dir_entry_directory(fat_dir_entry_t *entry, struc
             memcpy(chunk, head, sizeof(chunk));
             if (i == long_filename_num)
                 order |= 0x40;
-            set_long_file_entry(entry, chunk, order, check_sum);
-            entry++;
+            set_long_file_entry(dir_entry_writer_next(w), chunk, order, check_sum);
         }
-        memcpy(entry, &short_dir_entry, sizeof(short_dir_entry));
+        memcpy(dir_entry_writer_next(w), &short_dir_entry, sizeof(short_dir_entry));
     }
-    entry++;
-    return entry;
 }
 
-static fat_dir_entry_t *append_dir_entry_file(fat_dir_entry_t *entry, struct lfs_info *finfo, uint32_t cluster) {
+static void append_dir_entry_file(dir_entry_writer_t *w, struct lfs_info *finfo, uint32_t cluster) {
     TRACE("append_dir_entry_file '%s' cluster=%lu\n", finfo->name, cluster);
 
     if (is_short_filename_file((uint8_t *)finfo->name)) {
-        set_file_entry(entry, finfo, cluster);
+        set_file_entry(dir_entry_writer_next(w), finfo, cluster);
     } else {
         fat_dir_entry_t short_dir_entry;
+
         set_file_entry(&short_dir_entry, finfo, cluster);
-        create_shortened_short_filename(short_dir_entry.DIR_Name, finfo->name);
+        create_shortened_short_filename(short_dir_entry.DIR_Name, &w->sfn_index, finfo->name);
 
         uint8_t check_sum = filename_check_sum(short_dir_entry.DIR_Name);
 
@@ -791,98 +1688,531 @@ static fat_dir_entry_t *append_dir_entry_file(fat_dir_entry_t *entry, struct lfs
             memcpy(chunk, head, sizeof(chunk));
             if (i == long_filename_num)
                 order |= 0x40;
-            set_long_file_entry(entry, chunk, order, check_sum);
-            entry++;
+            set_long_file_entry(dir_entry_writer_next(w), chunk, order, check_sum);
+        }
+        memcpy(dir_entry_writer_next(w), &short_dir_entry, sizeof(short_dir_entry));
+    }
+}
+
+/*
+ * Register the names of a directory that are short file names by themselves
+ *
+ * Done before any name is generated, so a generated name never takes the name of an entry read later.
+ */
+static void register_short_filenames(const char *path, sfn_index_t *index) {
+    lfs_dir_t dir;
+    struct lfs_info finfo;
+    fat_dir_entry_t entry;
+
+    int err = lfs_dir_open(&real_filesystem, &dir, path);
+    if (err != LFS_ERR_OK)
+        return;
+    while (lfs_dir_read(&real_filesystem, &dir, &finfo) > 0) {
+        if (finfo.type == LFS_TYPE_DIR && is_short_filename_dir((uint8_t *)finfo.name)) {
+            set_directory_entry(&entry, finfo.name, 0);
+            sfn_index_insert(index, entry.DIR_Name);
+        } else if (finfo.type == LFS_TYPE_REG && is_short_filename_file((uint8_t *)finfo.name)) {
+            set_fat_short_filename(entry.DIR_Name, finfo.name);
+            sfn_index_insert(index, entry.DIR_Name);
+        }
+    }
+    lfs_dir_close(&real_filesystem, &dir);
+}
+
+/*
+ * Where the rendering of a directory stopped, so its clusters read in order are rendered in one
+ * pass. The writer holds the entries already written to the next cluster. Like the read-ahead
+ * streams, the open lfs_dir_t is dropped before any write and on a cache rebuild.
+ */
+typedef struct {
+    dir_entry_writer_t writer;
+    lfs_dir_t dir;
+    size_t entry_index;
+} dir_render_t;
+
+/*
+ * Directories exported to the host
+ *
+ * The first cluster of every entry is kept in lfs_dir_read() order, so the clusters of a
+ * directory are rendered from littlefs when they are read instead of being stored at attach.
+ * Only directories the host has written to are kept as temporary files.
+ */
+typedef struct {
+    uint16_t cluster;
+    uint16_t parent_cluster;
+    bool is_materialized;
+    char *path;
+    uint16_t *entry_cluster;
+    size_t entry_num;
+    size_t entry_max;
+    dir_render_t *render;
+} mimic_dir_t;
+
+static mimic_dir_t *mimic_dirs = NULL;
+static size_t mimic_dir_num = 0;
+static size_t mimic_dir_max = 0;
+
+/*
+ * mimic_dirs index + 1 of the directory owning each cluster, 0 for none
+ *
+ * Built from the chains on the first lookup after the FAT or the directories have changed.
+ */
+static uint16_t *mimic_dir_map = NULL;
+static bool mimic_dir_map_is_valid = false;
+static uint32_t mimic_dir_map_version = 0;
+
+static void drop_dir_render(mimic_dir_t *d) {
+    if (d->render == NULL)
+        return;
+    lfs_dir_close(&real_filesystem, &d->render->dir);
+    sfn_index_free(&d->render->writer.sfn_index);
+    free(d->render);
+    d->render = NULL;
+}
+
+static void drop_dir_renders(void) {
+    for (size_t i = 0; i < mimic_dir_num; i++)
+        drop_dir_render(&mimic_dirs[i]);
+}
+
+static void clear_mimic_dirs(void) {
+    drop_dir_renders();
+    for (size_t i = 0; i < mimic_dir_num; i++) {
+        free(mimic_dirs[i].path);
+        free(mimic_dirs[i].entry_cluster);
+    }
+    mimic_dir_num = 0;
+    mimic_dir_map_is_valid = false;
+}
+
+static int add_mimic_dir(const char *path, uint32_t parent_cluster, uint32_t cluster) {
+    if (mimic_dir_num == mimic_dir_max) {
+        size_t max = mimic_dir_max > 0 ? mimic_dir_max * 2 : 8;
+        mimic_dir_t *dirs = realloc(mimic_dirs, sizeof(mimic_dir_t) * max);
+        if (dirs == NULL) {
+            printf("add_mimic_dir: can't allocate %u directories\n", max);
+            return -1;
+        }
+        mimic_dirs = dirs;
+        mimic_dir_max = max;
+    }
+    mimic_dir_t *d = &mimic_dirs[mimic_dir_num];
+    d->path = strdup(path);
+    if (d->path == NULL)
+        return -1;
+    d->cluster = cluster;
+    d->parent_cluster = parent_cluster;
+    d->is_materialized = false;
+    d->entry_cluster = NULL;
+    d->entry_num = 0;
+    d->entry_max = 0;
+    d->render = NULL;
+    mimic_dir_map_is_valid = false;
+    return mimic_dir_num++;
+}
+
+static bool add_mimic_dir_entry(mimic_dir_t *d, uint32_t cluster) {
+    if (d->entry_num == d->entry_max) {
+        size_t max = d->entry_max > 0 ? d->entry_max * 2 : 16;
+        uint16_t *entry_cluster = realloc(d->entry_cluster, sizeof(uint16_t) * max);
+        if (entry_cluster == NULL) {
+            printf("add_mimic_dir_entry: can't allocate %u entries\n", max);
+            return false;
+        }
+        d->entry_cluster = entry_cluster;
+        d->entry_max = max;
+    }
+    d->entry_cluster[d->entry_num++] = cluster;
+    return true;
+}
+
+static void build_mimic_dir_map(void) {
+    free(mimic_dir_map);
+    mimic_dir_map = calloc(cluster_size() + 1, sizeof(uint16_t));
+    assert(mimic_dir_map != NULL);
+    for (size_t i = 0; i < mimic_dir_num; i++) {
+        uint32_t next_cluster = mimic_dirs[i].cluster;
+        for (size_t limit = cluster_size(); limit > 0; limit--) {
+            if (next_cluster > cluster_size() || mimic_dir_map[next_cluster] != 0)
+                break;  // a cluster is owned by the first directory whose chain contains it
+            mimic_dir_map[next_cluster] = i + 1;
+            if (next_cluster == 1)
+                break;
+            next_cluster = read_fat(next_cluster);
+            if (next_cluster < 2 || next_cluster >= 0xFF8)
+                break;
+        }
+    }
+    mimic_dir_map_is_valid = true;
+    mimic_dir_map_version = fat_version;
+}
+
+/*
+ * Find the exported directory whose cluster chain contains cluster
+ */
+static mimic_dir_t *find_mimic_dir(uint32_t cluster) {
+    if (!mimic_dir_map_is_valid || mimic_dir_map_version != fat_version)
+        build_mimic_dir_map();
+    if (cluster > cluster_size() || mimic_dir_map[cluster] == 0)
+        return NULL;
+    return &mimic_dirs[mimic_dir_map[cluster] - 1];
+}
+
+/*
+ * Write the directory entries of mimic_dirs[index] to *w
+ *
+ * With allocated_cluster, clusters are allocated for the entries and their first clusters are
+ * recorded, and sub directories are exported recursively. Without it, the recorded clusters are used.
+ */
+static int create_dir_entry_cache(const char *path, uint32_t parent_cluster, uint32_t current_cluster, uint32_t *allocated_cluster);
+
+static int open_dir_entries(size_t index, dir_entry_writer_t *w, lfs_dir_t *dir) {
+    const char *path = mimic_dirs[index].path;
+
+    if (mimic_dirs[index].parent_cluster == 0) {
+        append_dir_entry_volume_label(dir_entry_writer_next(w), "littlefsUSB");
+    }
+    register_short_filenames(path, &w->sfn_index);
+
+    int err = lfs_dir_open(&real_filesystem, dir, path);
+    if (err != LFS_ERR_OK) {
+        printf("write_dir_entries: lfs_dir_open('%s') error=%d\n", path, err);
+        return err;
+    }
+    return LFS_ERR_OK;
+}
+
+/*
+ * Returns 1 if the writer has rendered its cluster, 0 at the end of the directory
+ */
+static int next_dir_entries(size_t index, dir_entry_writer_t *w, lfs_dir_t *dir, size_t *entry_index,
+                            uint32_t *allocated_cluster)
+{
+    const char *path = mimic_dirs[index].path;  // the string stays put when mimic_dirs grows
+    uint32_t parent_cluster = mimic_dirs[index].parent_cluster;
+    uint32_t current_cluster = mimic_dirs[index].cluster;
+    struct lfs_info finfo;
+    char directory_path[LFS_NAME_MAX * 2 + 1 + 1];  // for sprintf "%s/%s"
+    int err;
+
+    while (!dir_entry_writer_is_done(w)) {
+        err = lfs_dir_read(&real_filesystem, dir, &finfo);
+        if (err == 0)
+            break;
+        if (err < 0) {
+            printf("write_dir_entries: lfs_dir_read('%s') error=%d\n", path, err);
+            break;
+        }
+
+        if (finfo.type == LFS_TYPE_DIR && parent_cluster == 0 && strcmp(finfo.name, ".mimic") == 0) {
+            continue;
+        }
+        if (finfo.type == LFS_TYPE_DIR && parent_cluster == 0
+            && (strcmp(finfo.name, ".") == 0 || strcmp(finfo.name, "..") == 0))
+        {
+            continue;
+        }
+        if (finfo.type == LFS_TYPE_DIR  && strcmp(finfo.name, ".") == 0) {
+            append_dir_entry_directory(w, &finfo, current_cluster);
+            continue;
+        }
+        if (finfo.type == LFS_TYPE_DIR  && strcmp(finfo.name, "..") == 0) {
+            if (parent_cluster == 0)
+                append_dir_entry_directory(w, &finfo, 0);
+            else
+                append_dir_entry_directory(w, &finfo, parent_cluster);
+            continue;
+        }
+        if (finfo.type != LFS_TYPE_DIR && finfo.type != LFS_TYPE_REG) {
+            continue;
+        }
+
+        if (!dir_entry_writer_has_room(w, dir_entry_count(&finfo))) {
+            if (allocated_cluster != NULL)
+                printf("create_dir_entry_cache: root directory is full, '%s' is not exported\n", finfo.name);
+            continue;
+        }
+
+        entry_path(directory_path, sizeof(directory_path), path, finfo.name);
+        uint32_t entry_cluster;
+        if (allocated_cluster == NULL) {
+            if (*entry_index == mimic_dirs[index].entry_num)
+                break;  // not exported, littlefs has been changed since
+            entry_cluster = mimic_dirs[index].entry_cluster[(*entry_index)++];
+        } else if (entry_cluster_count(&finfo) > 0
+                   && (entry_cluster = load_entry_cluster(directory_path)) != 0) {
+            // claimed by claim_stored_clusters()
+            if (finfo.type == LFS_TYPE_DIR)
+                update_fat(entry_cluster, 0xFFF);
+            else
+                bulk_update_fat(entry_cluster, finfo.size);
+        } else if (finfo.type == LFS_TYPE_DIR) {
+            *allocated_cluster = skip_claimed_clusters(*allocated_cluster + 1, 1);
+            entry_cluster = *allocated_cluster;
+            update_fat(entry_cluster, 0xFFF);
+            store_entry_cluster(directory_path, entry_cluster);
+        } else {
+            entry_cluster = skip_claimed_clusters(*allocated_cluster + 1, entry_cluster_count(&finfo));
+            if (finfo.size > 0) {
+                *allocated_cluster = bulk_update_fat(entry_cluster, finfo.size);
+                store_entry_cluster(directory_path, entry_cluster);
+            }
+        }
+        if (allocated_cluster != NULL && !add_mimic_dir_entry(&mimic_dirs[index], entry_cluster))
+            return LFS_ERR_NOMEM;
+
+        if (finfo.type == LFS_TYPE_REG) {
+            append_dir_entry_file(w, &finfo, entry_cluster);
+            continue;
+        }
+        append_dir_entry_directory(w, &finfo, entry_cluster);
+        if (allocated_cluster == NULL)
+            continue;
+
+        err = create_dir_entry_cache((const char *)directory_path, current_cluster, entry_cluster, allocated_cluster);
+        if (err < 0)
+            return err;
+    }
+    return dir_entry_writer_is_done(w) ? 1 : 0;
+}
+
+static int write_dir_entries(size_t index, dir_entry_writer_t *w, uint32_t *allocated_cluster) {
+    lfs_dir_t dir;
+    size_t entry_index = 0;
+
+    int err = open_dir_entries(index, w, &dir);
+    if (err < 0)
+        return err;
+    err = next_dir_entries(index, w, &dir, &entry_index, allocated_cluster);
+    lfs_dir_close(&real_filesystem, &dir);
+    return err < 0 ? err : 0;
+}
+
+/*
+ * Create a directory entry cache corresponding to the base file system
+ *
+ * Recursively traverse the specified base file system directory and update the allocation table.
+ * Nothing is written to flash, the directory clusters are rendered by read_dir_cluster().
+ */
+static int create_dir_entry_cache(const char *path, uint32_t parent_cluster, uint32_t current_cluster, uint32_t *allocated_cluster) {
+    TRACE("create_dir_entry_cache('%s', %lu, %lu, %lu)\n", path, parent_cluster, current_cluster, *allocated_cluster);
+    dir_entry_writer_t writer;
+
+    int index = add_mimic_dir(path, parent_cluster, current_cluster);
+    if (index < 0)
+        return LFS_ERR_NOMEM;
+    update_fat(current_cluster, 0xFFF);
+
+    dir_entry_writer_init(&writer, current_cluster, allocated_cluster);
+    int err = write_dir_entries(index, &writer, allocated_cluster);
+    sfn_index_free(&writer.sfn_index);
+    return err;
+}
+
+/*
+ * Render a cluster of an exported directory from littlefs
+ *
+ * The rendering continues from where the previous one stopped if it stopped right before
+ * cluster, otherwise it starts over from the first entry.
+ */
+static int render_dir_cluster(mimic_dir_t *d, uint32_t cluster, void *buffer) {
+    TRACE("render_dir_cluster('%s', cluster=%lu)\n", d->path, cluster);
+    dir_render_t *r = d->render;
+
+    if (r != NULL && r->writer.cluster == cluster) {
+        r->writer.render_cluster = cluster;
+        r->writer.render_buffer = buffer;
+        r->writer.is_rendered = false;
+    } else {
+        drop_dir_render(d);
+        r = calloc(1, sizeof(dir_render_t));
+        assert(r != NULL);
+        dir_entry_writer_init_render(&r->writer, d->cluster, cluster, buffer);
+        int err = open_dir_entries(d - mimic_dirs, &r->writer, &r->dir);
+        if (err < 0) {
+            sfn_index_free(&r->writer.sfn_index);
+            free(r);
+            return err;
         }
-        memcpy(entry, &short_dir_entry, sizeof(short_dir_entry));
+        d->render = r;
     }
 
-    entry++;
-    return entry;
+    int err = next_dir_entries(d - mimic_dirs, &r->writer, &r->dir, &r->entry_index, NULL);
+    if (err == 1)
+        return LFS_ERR_OK;  // kept for the next cluster
+    if (err == 0)
+        dir_entry_writer_flush(&r->writer);
+    bool is_rendered = r->writer.is_rendered;
+    drop_dir_render(d);
+    if (err < 0)
+        return err;
+    if (!is_rendered)
+        memset(buffer, 0, DISK_SECTOR_SIZE);
+    return LFS_ERR_OK;
 }
 
 /*
- * Create a directory entry cache corresponding to the base file system
+ * Read a directory cluster, as written by the host or else rendered from littlefs
  *
- * Recursively traverse the specified base file system directory and update cache and allocation tables.
+ * A cluster of a directory not written to yet is rendered unless the host has written the cluster
+ * before linking it into the chain.
  */
-static int create_dir_entry_cache(const char *path, uint32_t parent_cluster, uint32_t *allocated_cluster) {
-    TRACE("create_dir_entry_cache('%s', %lu, %lu)\n", path, parent_cluster, *allocated_cluster);
-    uint32_t current_cluster = *allocated_cluster;
-    fat_dir_entry_t *entry;
-    fat_dir_entry_t dir_entry[DISK_SECTOR_SIZE / sizeof(fat_dir_entry_t)] = {0};
-    lfs_dir_t dir;
-    struct lfs_info finfo;
-    char directory_path[LFS_NAME_MAX * 2 + 1 + 1];  // for sprintf "%s/%s"
-    entry = dir_entry;
+static int read_dir_cluster(uint32_t cluster, void *buffer) {
+    mimic_dir_t *d = find_mimic_dir(cluster);
+    if (d != NULL && !d->is_materialized && !has_temporary_file(cluster))
+        return render_dir_cluster(d, cluster, buffer);
+    return read_temporary_file(cluster, buffer);
+}
 
-    if (parent_cluster == 0) {
-        entry = append_dir_entry_volume_label(entry, "littlefsUSB");
-        current_cluster = 1;
-    }
-    update_fat(current_cluster, 0xFFF);
+/*
+ * Keep all the clusters of the directory starting at base_cluster as temporary files
+ *
+ * Done before the host changes the directory, the clusters not written by the host
+ * can't be rendered from littlefs any more once its entries are changed.
+ */
+static void materialize_dir(uint32_t base_cluster) {
+    fat_dir_entry_t entry[FAT_DIR_ENTRIES_PER_CLUSTER];
 
-    int err = lfs_dir_open(&real_filesystem, &dir, path);
-    if (err != LFS_ERR_OK) {
-        printf("create_dir_entry_cache: lfs_dir_open('%s') error=%d\n", path, err);
-        return err;
-    }
+    mimic_dir_t *d = find_mimic_dir(base_cluster);
+    if (d == NULL || d->is_materialized)
+        return;
 
-    while (true) {
-        err = lfs_dir_read(&real_filesystem, &dir, &finfo);
-        if (err == 0)
+    uint32_t cluster = d->cluster;
+    for (size_t limit = cluster_size(); limit > 0; limit--) {
+        if (read_temporary_file(cluster, entry) == LFS_ERR_NOENT
+            && render_dir_cluster(d, cluster, entry) == LFS_ERR_OK)
+        {
+            save_temporary_file(cluster, entry);
+        }
+        if (cluster == 1)
             break;
-        if (err < 0) {
-            printf("create_dir_entry_cache: lfs_dir_read('%s') error=%d\n", path, err);
+        cluster = read_fat(cluster);
+        if (cluster < 2 || cluster >= 0xFF8)
             break;
-        }
+    }
+    drop_dir_render(d);
+    d->is_materialized = true;
+}
 
-        if (finfo.type == LFS_TYPE_DIR && parent_cluster == 0 && strcmp(finfo.name, ".mimic") == 0) {
-            continue;
-        }
-        if (finfo.type == LFS_TYPE_DIR && parent_cluster == 0
-            && (strcmp(finfo.name, ".") == 0 || strcmp(finfo.name, "..") == 0))
-        {
-            continue;
-        }
-        if (finfo.type == LFS_TYPE_DIR  && strcmp(finfo.name, ".") == 0) {
-            entry = append_dir_entry_directory(entry, &finfo, current_cluster);
-            continue;
-        }
-        if (finfo.type == LFS_TYPE_DIR  && strcmp(finfo.name, "..") == 0) {
-            if (parent_cluster == 0)
-                entry = append_dir_entry_directory(entry, &finfo, 0);
-            else
-                entry = append_dir_entry_directory(entry, &finfo, parent_cluster);
+/*
+ * Sequential read-ahead
+ *
+ * The host reads a large file one sector per READ(10). A file being read keeps its lfs_file_t
+ * open, and once the host asks for the sector following the last one, the next
+ * MIMIC_FAT_READ_AHEAD_SECTORS sectors are read into a window and served from RAM. The streams
+ * are dropped before any write and on a cache rebuild.
+ */
+#ifndef MIMIC_FAT_READ_AHEAD_SECTORS
+#define MIMIC_FAT_READ_AHEAD_SECTORS  8
+#endif
+#ifndef MIMIC_FAT_READ_AHEAD_STREAMS
+#define MIMIC_FAT_READ_AHEAD_STREAMS  2
+#endif
+
+typedef struct {
+    uint32_t base_cluster;   // 0 if the slot is unused
+    uint32_t next_offset;    // sector offset that continues the stream
+    uint32_t window_offset;  // sector offset of window[0]
+    uint32_t window_sectors;
+    uint32_t last_used;
+    lfs_file_t file;
+    uint8_t window[MIMIC_FAT_READ_AHEAD_SECTORS * DISK_SECTOR_SIZE];
+} read_ahead_stream_t;
+
+static read_ahead_stream_t read_ahead_streams[MIMIC_FAT_READ_AHEAD_STREAMS];
+static uint32_t read_ahead_clock = 0;
+static mimic_fat_read_ahead_stats_t read_ahead_stats;
+
+void mimic_fat_read_ahead_stats(mimic_fat_read_ahead_stats_t *stats) {
+    *stats = read_ahead_stats;
+}
+
+static void drop_read_ahead_streams(void) {
+    for (size_t i = 0; i < MIMIC_FAT_READ_AHEAD_STREAMS; i++) {
+        read_ahead_stream_t *s = &read_ahead_streams[i];
+        if (s->base_cluster == 0)
             continue;
-        }
+        lfs_file_close(&real_filesystem, &s->file);
+        s->base_cluster = 0;
+    }
+}
 
-        if (finfo.type == LFS_TYPE_DIR) {
-            *allocated_cluster += 1;
-            update_fat(*allocated_cluster, 0xFFF);
-            entry = append_dir_entry_directory(entry, &finfo, *allocated_cluster);
-            if (parent_cluster == 0)
-                strncpy(directory_path, finfo.name, sizeof(directory_path));
-            else
-                snprintf(directory_path, sizeof(directory_path), "%s/%s", path, finfo.name);
-            directory_path[LFS_NAME_MAX] = '\0';
+static read_ahead_stream_t *find_read_ahead_stream(uint32_t base_cluster) {
+    for (size_t i = 0; i < MIMIC_FAT_READ_AHEAD_STREAMS; i++) {
+        if (read_ahead_streams[i].base_cluster == base_cluster)
+            return &read_ahead_streams[i];
+    }
+    return NULL;
+}
 
-            err = create_dir_entry_cache((const char *)directory_path, current_cluster, allocated_cluster);
-            if (err < 0) {
-                lfs_dir_close(&real_filesystem, &dir);
-                return err;
-            }
+/*
+ * Read sectors from offset into the window of s, the part past the end of the file is zero
+ */
+static void fill_read_ahead_window(read_ahead_stream_t *s, uint32_t offset, uint32_t sectors) {
+    s->window_offset = offset;
+    s->window_sectors = 0;
+    memset(s->window, 0, sectors * DISK_SECTOR_SIZE);
 
-        } else if (finfo.type == LFS_TYPE_REG) {
-            uint32_t file_cluster = *allocated_cluster + 1;
-            if (finfo.size > 0)
-                *allocated_cluster = bulk_update_fat(file_cluster, finfo.size);
-            entry = append_dir_entry_file(entry, &finfo, file_cluster);
-        }
+    lfs_soff_t seek = lfs_file_seek(&real_filesystem, &s->file, offset * DISK_SECTOR_SIZE, LFS_SEEK_SET);
+    if (seek < 0) {
+        printf("fill_read_ahead_window: lfs_file_seek(offset=%u) error=%ld\n", offset * DISK_SECTOR_SIZE, seek);
+        return;
     }
-    lfs_dir_close(&real_filesystem, &dir);
-    save_temporary_file(current_cluster, dir_entry);
-    return 0;
+    lfs_ssize_t size = lfs_file_read(&real_filesystem, &s->file, s->window, sectors * DISK_SECTOR_SIZE);
+    if (size < 0) {
+        printf("fill_read_ahead_window: lfs_file_read(offset=%u) error=%ld\n", offset * DISK_SECTOR_SIZE, size);
+        return;
+    }
+    s->window_sectors = sectors;
+    if (size > DISK_SECTOR_SIZE)
+        read_ahead_stats.prefetched_bytes += size - DISK_SECTOR_SIZE;
+}
+
+/*
+ * Serve a file sector from an open stream
+ *
+ * Returns false if base_cluster has no stream, the caller opens one with open_read_ahead_stream().
+ */
+static bool read_ahead(uint32_t base_cluster, uint32_t offset, void *buffer) {
+    read_ahead_stream_t *s = find_read_ahead_stream(base_cluster);
+    if (s == NULL)
+        return false;
+
+    s->last_used = ++read_ahead_clock;
+    read_ahead_stats.reads++;
+    if (offset >= s->window_offset && offset < s->window_offset + s->window_sectors) {
+        read_ahead_stats.hits++;
+    } else if (offset == s->next_offset) {
+        fill_read_ahead_window(s, offset, MIMIC_FAT_READ_AHEAD_SECTORS);
+    } else {
+        fill_read_ahead_window(s, offset, 1);
+    }
+    if (offset < s->window_offset + s->window_sectors)
+        memcpy(buffer, s->window + (offset - s->window_offset) * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+    s->next_offset = offset + 1;
+    return true;
+}
+
+static void open_read_ahead_stream(uint32_t base_cluster, const char *path, uint32_t offset, void *buffer) {
+    read_ahead_stream_t *s = &read_ahead_streams[0];
+    for (size_t i = 1; i < MIMIC_FAT_READ_AHEAD_STREAMS; i++) {
+        if (read_ahead_streams[i].last_used < s->last_used)
+            s = &read_ahead_streams[i];
+    }
+    if (s->base_cluster != 0) {
+        lfs_file_close(&real_filesystem, &s->file);
+        s->base_cluster = 0;
+    }
+
+    int err = lfs_file_open(&real_filesystem, &s->file, path, LFS_O_RDONLY);
+    if (err != LFS_ERR_OK) {
+        printf("open_read_ahead_stream: lfs_file_open('%s') error=%d\n", path, err);
+        return;
+    }
+    s->base_cluster = base_cluster;
+    s->next_offset = UINT32_MAX;
+    s->window_sectors = 0;
+    read_ahead(base_cluster, offset, buffer);
 }
 
 /*
@@ -894,6 +2224,8 @@ void mimic_fat_create_cache(void) {
     TRACE(ANSI_RED "mimic_fat_create_cache()\n" ANSI_CLEAR);
 
 	if (real_filesystem.cfg) {
+		drop_read_ahead_streams();
+		drop_dir_renders();
 		lfs_unmount(&real_filesystem);
 	}
     int err = lfs_mount(&real_filesystem, littlefs_lfs_config);
@@ -905,9 +2237,14 @@ void mimic_fat_create_cache(void) {
     mimic_fat_cleanup_cache();
 
     init_fat();
+    init_cluster_store();
+    clear_mimic_dirs();
+
+    claimed_clusters = alloc_cluster_bitmap(claimed_clusters);
+    claim_stored_clusters("");
 
     uint32_t allocated_cluster = 1;
-    create_dir_entry_cache("", 0, &allocated_cluster);
+    create_dir_entry_cache("", 0, 1, &allocated_cluster);
 }
 
 static void delete_directory(const char *path) {
@@ -1017,33 +2354,14 @@ static void read_boot_sector(void *buffer, uint32_t bufsize) {
  * Build a FAT table based on littlefs files.
  */
 static void read_fat_sector(uint32_t sector, void *buffer, uint32_t bufsize) {
-    (void)bufsize;
     TRACE(ANSI_CYAN"Read sector=%lu read_fat_sector()"ANSI_CLEAR, sector);
 
-    lfs_soff_t offset = (sector - 1) * 512;
-    lfs_soff_t o = lfs_file_seek(&real_filesystem, &fat_cache, offset, LFS_SEEK_SET);
-    if (o < 0) {
-        printf("read_fat_sector: lfs_file_seek err=%ld\n", o);
-        return;
-    }
-
-    lfs_ssize_t s = lfs_file_read(&real_filesystem, &fat_cache, buffer, bufsize);
-    if (s < 0) {
-        printf("read_fat_sector: lfs_file_read error=%ld\n", s);
-    }
+    read_fat_bytes((sector - 1) * DISK_SECTOR_SIZE, buffer, bufsize);
 }
 
 static void save_fat_sector(uint32_t request_block, void *buffer, size_t bufsize) {
-    size_t offset = (request_block - 1) * bufsize;
-    lfs_soff_t o = lfs_file_seek(&real_filesystem, &fat_cache, offset, LFS_SEEK_SET);
-    if (o < 0) {
-        printf("save_fat_sector: lfs_file_seek error=%ld\n", o);
-        return;
-    }
-    lfs_ssize_t s = lfs_file_write(&real_filesystem, &fat_cache, buffer, bufsize);
-    if (s != (lfs_ssize_t)bufsize) {
-        printf("save_fat_sector: lfs_file_read error=%ld\n", s);
-    }
+    (void)bufsize;
+    write_fat_sector(request_block, buffer);
 }
 
 /*
@@ -1061,7 +2379,8 @@ static void restore_file_from(char *result_filename, uint32_t directory_cluster_
     int parent = 1;
     int target = file_cluster_id;
 
-    fat_dir_entry_t dir[16];
+    dir_entry_iterator_t it;
+    fat_dir_entry_t *dir;
     uint8_t result[LFS_NAME_MAX * 2 + 1 + 1] = {0}; // for sprintf "%s/%s"
     if (directory_cluster_id == 0 && file_cluster_id == 0) {
         TRACE("  this is initial cluster\n");
@@ -1071,11 +2390,8 @@ static void restore_file_from(char *result_filename, uint32_t directory_cluster_
     uint32_t self = 0;
     while (cluster_id >= 0) {
         TRACE("restore_file_from: cluster_id=%u, parent=%u, target=%u\n", cluster_id, parent, target);
-        if ((cluster_id == 0 || cluster_id == 1) && read_temporary_file(1, &dir[0]) != 0) {
-            printf("temporary file '.mimic/%04d' not found\n", 1);
-            break;
-        } else if (read_temporary_file(cluster_id, &dir[0]) != 0) {
-            printf("temporary file '.mimic/%04d' not found\n", cluster_id);
+        if (dir_entry_iterator_init(&it, cluster_id) != 0) {
+            printf("temporary file '.mimic/%04d' not found\n", cluster_id == 0 ? 1 : cluster_id);
             break;
         }
 
@@ -1086,20 +2402,20 @@ static void restore_file_from(char *result_filename, uint32_t directory_cluster_
         char filename[LFS_NAME_MAX + 1];
         uint16_t long_filename[LFS_NAME_MAX + 1];
         bool is_long_filename = false;
-        for (int i = 0; i < 16; i++) {
-            if (dir[i].DIR_Attr == 0x08) {
+        while ((dir = dir_entry_iterator_next(&it)) != NULL) {
+            if (dir->DIR_Attr == 0x08) {
                 parent = -1;
                 continue;
             }
-            if (dir[i].DIR_Name[0] == '\0') {
+            if (dir->DIR_Name[0] == '\0') {
                 break;
             }
-            if (memcmp(dir[i].DIR_Name, ".          ", 11) == 0) {
-                self = dir[i].DIR_FstClusLO;
+            if (memcmp(dir->DIR_Name, ".          ", 11) == 0) {
+                self = dir->DIR_FstClusLO;
                 continue;
             }
-            if (memcmp(dir[i].DIR_Name, "..         ", 11) == 0) {
-                parent = dir[i].DIR_FstClusLO;
+            if (memcmp(dir->DIR_Name, "..         ", 11) == 0) {
+                parent = dir->DIR_FstClusLO;
                 if (parent == 0) {
                     /* NOTE: According to the FAT specification, the reference to the root
                      * directory is `cluster==0`, but the actual state of the root directory
@@ -1109,11 +2425,11 @@ static void restore_file_from(char *result_filename, uint32_t directory_cluster_
                 }
                 continue;
             }
-            if (dir[i].DIR_Name[0] == 0xE5)
+            if (dir->DIR_Name[0] == 0xE5)
                 continue;
 
-            if ((dir[i].DIR_Attr & 0x0F) == 0x0F) {
-                fat_lfn_t *long_file = (fat_lfn_t *)&dir[i];
+            if ((dir->DIR_Attr & 0x0F) == 0x0F) {
+                fat_lfn_t *long_file = (fat_lfn_t *)dir;
                 if (long_file->LDIR_Ord & 0x40) {
                     memset(long_filename, 0xFF, sizeof(long_filename));
                     is_long_filename = true;
@@ -1125,14 +2441,14 @@ static void restore_file_from(char *result_filename, uint32_t directory_cluster_
                 continue;
             }
 
-            if (dir[i].DIR_Attr & 0x10) { // is directory
+            if (dir->DIR_Attr & 0x10) { // is directory
                 if (is_long_filename) {
                     utf16le_to_utf8(filename, sizeof(filename), long_filename, sizeof(long_filename));
                 } else {
-                    restore_from_short_dirname(filename, (const char *)dir[i].DIR_Name);
+                    restore_from_short_dirname(filename, (const char *)dir->DIR_Name);
                 }
 
-                if (dir[i].DIR_FstClusLO == target) {
+                if (dir->DIR_FstClusLO == target) {
                     strcpy((char *)child_filename, (const char *)result);
                     snprintf((char *)result, sizeof(result), "%s/%s", filename, child_filename);
                     result[LFS_NAME_MAX] = '\0';
@@ -1141,14 +2457,14 @@ static void restore_file_from(char *result_filename, uint32_t directory_cluster_
 
                 is_long_filename = false;
                 continue;
-            } else if (dir[i].DIR_Attr & 0x20 || dir[i].DIR_Attr == 0x00) { // is file
+            } else if (dir->DIR_Attr & 0x20 || dir->DIR_Attr == 0x00) { // is file
                 if (is_long_filename) {
                     utf16le_to_utf8(filename, sizeof(filename), long_filename, sizeof(long_filename));
                 } else {
-                    restore_from_short_filename(filename, (const char *)dir[i].DIR_Name);
+                    restore_from_short_filename(filename, (const char *)dir->DIR_Name);
                 }
 
-                if (dir[i].DIR_FstClusLO == target) {
+                if (dir->DIR_FstClusLO == target) {
                     strcpy((char *)result, (const char *)filename);
                     target = cluster_id;
                     break;
@@ -1156,7 +2472,7 @@ static void restore_file_from(char *result_filename, uint32_t directory_cluster_
                 }
                 is_long_filename = false;
             } else {
-                TRACE("  unknown DIR_Attr=0x%02X\n", dir[i].DIR_Attr);
+                TRACE("  unknown DIR_Attr=0x%02X\n", dir->DIR_Attr);
             }
         }
 
@@ -1252,16 +2568,13 @@ static void restore_directory_from(char *directory, uint32_t base_directory_clus
     int parent = 0;
     int target = directory_cluster_id;
 
-    fat_dir_entry_t dir[16];
+    dir_entry_iterator_t it;
+    fat_dir_entry_t *dir;
     uint8_t result[LFS_NAME_MAX * 2 + 1 + 1] = {0};  // for sprintf "%s/%s"
 
     while (cluster_id >= 0) {
-        if ((cluster_id == 0 || cluster_id == 1) && read_temporary_file(1, &dir[0]) != 0) {
-            TRACE("temporary file '.mimic/%04d' not found\n", 1);
-            break;
-
-        } else if (read_temporary_file(cluster_id, &dir[0]) != 0) {
-            TRACE("temporary file '.mimic/%04d' not found\n", cluster_id);
+        if (dir_entry_iterator_init(&it, cluster_id) != 0) {
+            TRACE("temporary file '.mimic/%04d' not found\n", cluster_id == 0 ? 1 : cluster_id);
             break;
         }
 
@@ -1270,30 +2583,30 @@ static void restore_directory_from(char *directory, uint32_t base_directory_clus
         uint16_t long_filename[LFS_NAME_MAX + 1];
 
         bool is_long_filename = false;
-        for (int i = 0; i < 16; i++) {
-            if (dir[i].DIR_Attr == 0x08) {
+        while ((dir = dir_entry_iterator_next(&it)) != NULL) {
+            if (dir->DIR_Attr == 0x08) {
                 parent = -1;
                 continue;
             }
-            if (dir[i].DIR_Name[0] == '\0') {
+            if (dir->DIR_Name[0] == '\0') {
                 break;
             }
-            if (memcmp(dir[i].DIR_Name,    ".          ", 11) == 0) {
+            if (memcmp(dir->DIR_Name,    ".          ", 11) == 0) {
                 continue;
             }
-            if (memcmp(dir[i].DIR_Name, "..         ", 11) == 0) {
+            if (memcmp(dir->DIR_Name, "..         ", 11) == 0) {
                 /* NOTE: According to the FAT specification, the reference to the root
                  * directory is `cluster==0`, but the actual state of the root directory
                  * is `cluster==1`, so it needs to be corrected.
                  */
-                parent = dir[i].DIR_FstClusLO != 0 ? dir[i].DIR_FstClusLO : 1;
+                parent = dir->DIR_FstClusLO != 0 ? dir->DIR_FstClusLO : 1;
                 continue;
             }
-            if (dir[i].DIR_Name[0] == 0xE5)
+            if (dir->DIR_Name[0] == 0xE5)
                 continue;
 
-            if ((dir[i].DIR_Attr & 0x0F) == 0x0F) {
-                fat_lfn_t *long_file = (fat_lfn_t *)&dir[i];
+            if ((dir->DIR_Attr & 0x0F) == 0x0F) {
+                fat_lfn_t *long_file = (fat_lfn_t *)dir;
                 if (long_file->LDIR_Ord & 0x40) {
                     memset(long_filename, 0xFF, sizeof(long_filename));
                     is_long_filename = true;
@@ -1304,14 +2617,14 @@ static void restore_directory_from(char *directory, uint32_t base_directory_clus
                 memcpy(&long_filename[offset * 13 + 5 + 6], long_file->LDIR_Name3, sizeof(uint16_t) * 2);
                 continue;
             }
-            if (dir[i].DIR_Attr & 0x10) { // is directory
+            if (dir->DIR_Attr & 0x10) { // is directory
                 if (is_long_filename) {
                     utf16le_to_utf8(filename, sizeof(filename), long_filename, sizeof(long_filename));
                 } else {
-                    restore_from_short_dirname(filename, (const char *)dir[i].DIR_Name);
+                    restore_from_short_dirname(filename, (const char *)dir->DIR_Name);
                 }
 
-                if (dir[i].DIR_FstClusLO == target) {
+                if (dir->DIR_FstClusLO == target) {
                     strcpy((char *)child_filename, (const char *)result);
                     if (strlen((const char *)child_filename) == 0)
                         strncpy((char *)result, (const char *)filename, sizeof(result));
@@ -1345,37 +2658,42 @@ typedef enum find_dir_entry_cache_return_t {
 
 static find_dir_entry_cache_return_t find_dir_entry_cache(find_dir_entry_cache_result_t *result, uint32_t base_cluster, uint32_t target_cluster) {
     TRACE("find_dir_entry_cache(base=%lu, target=%lu)\n", base_cluster, target_cluster);
-    fat_dir_entry_t entry[16];
+    dir_entry_iterator_t it;
+    fat_dir_entry_t *entry;
 
-    int err = read_temporary_file(base_cluster, entry);
+    int err = dir_entry_iterator_init(&it, base_cluster);
     if (err != LFS_ERR_OK) {
         TRACE("find_dir_entry_cache: read_temporary_file(cluster=%lu) error=%d\n", base_cluster, err);
         return FIND_DIR_ENTRY_CACHE_RESULT_ERROR;
     }
 
-    for (int i = (base_cluster == 1 ? 1 : 2); i < 16; i++) {
-        if (strncmp((const char *)entry[i].DIR_Name, "..         ", 11) == 0)
+    // skip the volume label of the root directory, or the dot entries of a sub directory
+    for (int i = (base_cluster == 1 ? 1 : 2); i > 0; i--) {
+        dir_entry_iterator_next(&it);
+    }
+    while ((entry = dir_entry_iterator_next(&it)) != NULL) {
+        if (strncmp((const char *)entry->DIR_Name, "..         ", 11) == 0)
             continue;
-        if (entry[i].DIR_Name[0] == 0xE5)
+        if (entry->DIR_Name[0] == 0xE5)
             continue;
-        if (entry[i].DIR_Name[0] == 0)
+        if (entry->DIR_Name[0] == 0)
             break;
 
-        if (entry[i].DIR_FstClusLO == target_cluster) {
+        if (entry->DIR_FstClusLO == target_cluster) {
             result->is_found = true;
             result->directory_cluster = base_cluster;
-            result->is_directory = (entry[i].DIR_Attr & 0x10) ? true : false;
-            result->size = entry[i].DIR_FileSize;
+            result->is_directory = (entry->DIR_Attr & 0x10) ? true : false;
+            result->size = entry->DIR_FileSize;
             if (result->is_directory)
                 restore_directory_from(result->path, base_cluster, target_cluster);
             else
                 restore_file_from(result->path, base_cluster, target_cluster);
             return FIND_DIR_ENTRY_CACHE_RESULT_FOUND;
         }
-        if ((entry[i].DIR_Attr & 0x10) == 0)
+        if ((entry->DIR_Attr & 0x10) == 0)
             continue;
 
-        find_dir_entry_cache_return_t r = find_dir_entry_cache(result, entry[i].DIR_FstClusLO, target_cluster);
+        find_dir_entry_cache_return_t r = find_dir_entry_cache(result, entry->DIR_FstClusLO, target_cluster);
         if (r != FIND_DIR_ENTRY_CACHE_RESULT_NOT_FOUND)
             return r;
     }
@@ -1398,11 +2716,18 @@ void mimic_fat_read(uint8_t lun, uint32_t sector, void *buffer, uint32_t bufsize
     (void)lun;
 	memset((uint8_t *)buffer, 0, bufsize);
 
+    if (load_rendered_sector(sector, buffer, bufsize)) {
+        TRACE("mimic_fat_read: rendered sector cache hit\n");
+        return;
+    }
+
     if (sector == 0) {
         read_boot_sector(buffer, bufsize);
+        store_rendered_sector(sector, buffer, bufsize, false);
         return;
     } else if (is_fat_sector(sector)) {
         read_fat_sector(sector, buffer, bufsize);
+        store_rendered_sector(sector, buffer, bufsize, false);
         return;
     }
 
@@ -1411,7 +2736,8 @@ void mimic_fat_read(uint8_t lun, uint32_t sector, void *buffer, uint32_t bufsize
     find_dir_entry_cache_result_t result = {0};
 
     if (cluster == 1) {
-        read_temporary_file(cluster, buffer);
+        if (read_dir_cluster(cluster, buffer) == LFS_ERR_OK)
+            store_rendered_sector(sector, buffer, bufsize, true);
         return;
     }
 
@@ -1420,16 +2746,25 @@ void mimic_fat_read(uint8_t lun, uint32_t sector, void *buffer, uint32_t bufsize
         return;
     }
 
+    if (bufsize == DISK_SECTOR_SIZE && read_ahead(base_cluster, offset, buffer))
+        return;
+
     find_dir_entry_cache_return_t r = find_dir_entry_cache(&result, 1, base_cluster);
     if (r != FIND_DIR_ENTRY_CACHE_RESULT_FOUND)
         return;
     if (result.is_directory) {
-        read_temporary_file(cluster, buffer);
+        if (read_dir_cluster(cluster, buffer) == LFS_ERR_OK)
+            store_rendered_sector(sector, buffer, bufsize, true);
         return;
     }
 
     TRACE("mimic_fat_read: result.path='%s'\n", result.path);
 
+    if (bufsize == DISK_SECTOR_SIZE) {
+        open_read_ahead_stream(base_cluster, result.path, offset, buffer);
+        return;
+    }
+
     lfs_file_t f;
     int err = lfs_file_open(&real_filesystem, &f, result.path, LFS_O_RDONLY);
     if (err != LFS_ERR_OK) {
@@ -1448,11 +2783,185 @@ void mimic_fat_read(uint8_t lun, uint32_t sector, void *buffer, uint32_t bufsize
     lfs_file_close(&real_filesystem, &f);
 }
 
+/*
+ * Long file name run collected from the LFN entries preceding a short entry
+ */
+typedef struct {
+    uint16_t long_filename[LFS_NAME_MAX + 1];
+    uint8_t check_sum;
+    bool is_long_filename;
+} long_filename_state_t;
+
+static void long_filename_update(long_filename_state_t *state, fat_dir_entry_t *entry) {
+    fat_lfn_t *long_file = (fat_lfn_t *)entry;
+    if (long_file->LDIR_Ord & 0x40) {
+        memset(state->long_filename, 0xFF, sizeof(state->long_filename));
+        state->check_sum = long_file->LDIR_Chksum;
+        state->is_long_filename = true;
+    }
+    int offset = (long_file->LDIR_Ord & 0x3F) - 1;
+    if (offset < 0 || (offset + 1) * FAT_LONG_FILENAME_CHUNK_MAX > LFS_NAME_MAX + 1) {
+        state->is_long_filename = false;
+        return;
+    }
+    memcpy(&state->long_filename[offset * 13], long_file->LDIR_Name1, sizeof(uint16_t) * 5);
+    memcpy(&state->long_filename[offset * 13 + 5], long_file->LDIR_Name2, sizeof(uint16_t) * 6);
+    memcpy(&state->long_filename[offset * 13 + 5 + 6], long_file->LDIR_Name3, sizeof(uint16_t) * 2);
+}
+
+/*
+ * Name of a short entry in bytes, the long file name run is used if it belongs to the entry
+ */
+static size_t long_filename_name(long_filename_state_t *state, fat_dir_entry_t *entry, const void **name) {
+    size_t length;
+    if (state->is_long_filename && state->check_sum == filename_check_sum(entry->DIR_Name)) {
+        length = 0;
+        while (length < LFS_NAME_MAX
+               && state->long_filename[length] != 0x0000 && state->long_filename[length] != 0xFFFF) {
+            length++;
+        }
+        *name = state->long_filename;
+        length *= sizeof(uint16_t);
+    } else {
+        *name = entry->DIR_Name;
+        length = FAT_SHORT_NAME_MAX;
+    }
+    state->is_long_filename = false;
+    return length;
+}
+
+typedef struct {
+    fat_dir_entry_t *entry;
+    uint32_t name_hash;
+    const uint8_t *name;  // NULL if it didn't fit in the name buffer
+    size_t name_length;
+    bool is_matched;
+} dir_entry_key_t;
+
+#define DIR_ENTRY_DIFF_MAX    (FAT_DIR_ENTRIES_PER_CLUSTER + 2)
+#define DIR_ENTRY_TABLE_SIZE  64
+// names of the entries of a cluster, the run of a name may start in the previous cluster and end in the next one
+#define DIR_ENTRY_NAMES_SIZE  (FAT_DIR_ENTRIES_PER_CLUSTER * 3 * FAT_LONG_FILENAME_CHUNK_MAX * sizeof(uint16_t))
+
+static bool dir_entry_key_name_equals(const dir_entry_key_t *a, const dir_entry_key_t *b) {
+    if (a->name_hash != b->name_hash)
+        return false;
+    if (a->name == NULL || b->name == NULL)
+        return true;
+    return a->name_length == b->name_length && memcmp(a->name, b->name, a->name_length) == 0;
+}
+
+/*
+ * Collect the files and directories of one directory cluster with their names and name hashes
+ *
+ * *state carries in a long file name run started in the previous cluster of the chain.
+ * A run left open at the end of the cluster is closed by the first short entry of *next.
+ * The names are copied to names, of DIR_ENTRY_NAMES_SIZE bytes.
+ * With keys == NULL, only *state is advanced.
+ */
+static size_t collect_dir_entry_keys(dir_entry_key_t *keys, uint8_t *names, fat_dir_entry_t *entries,
+                                     long_filename_state_t *state, fat_dir_entry_t *next)
+{
+    size_t num = 0;
+    size_t names_used = 0;
+    for (size_t i = 0; i < FAT_DIR_ENTRIES_PER_CLUSTER * 2; i++) {
+        fat_dir_entry_t *entry;
+        if (i < FAT_DIR_ENTRIES_PER_CLUSTER) {
+            entry = &entries[i];
+        } else if (next != NULL && state->is_long_filename) {
+            entry = &next[i - FAT_DIR_ENTRIES_PER_CLUSTER];
+        } else {
+            break;
+        }
+
+        if (entry->DIR_Name[0] == '\0') {
+            state->is_long_filename = false;
+            break;
+        }
+        if (entry->DIR_Name[0] == 0xE5) {
+            state->is_long_filename = false;
+            continue;
+        }
+        if ((entry->DIR_Attr & 0x0F) == 0x0F) {
+            long_filename_update(state, entry);
+            continue;
+        }
+        if (strncmp((const char *)entry->DIR_Name, ".          ", 11) == 0
+            || strncmp((const char *)entry->DIR_Name, "..         ", 11) == 0
+            || (entry->DIR_Attr & 0x08) == 0x08) // volume label
+        {
+            state->is_long_filename = false;
+            continue;
+        }
+
+        const void *name;
+        size_t name_length = long_filename_name(state, entry, &name);
+        if (keys != NULL) {
+            keys[num].entry = entry;
+            keys[num].name_hash = lfs_crc(0xFFFFFFFF, name, name_length);
+            keys[num].name = NULL;
+            keys[num].name_length = name_length;
+            if (names_used + name_length <= DIR_ENTRY_NAMES_SIZE) {
+                memcpy(&names[names_used], name, name_length);
+                keys[num].name = &names[names_used];
+                names_used += name_length;
+            }
+            keys[num].is_matched = false;
+            num++;
+        }
+        if (i >= FAT_DIR_ENTRIES_PER_CLUSTER)
+            break;
+    }
+    return num;
+}
+
+/*
+ * Entries are matched by their first cluster, files without clusters and
+ * entries whose first cluster has changed (truncated and rewritten by the host) by their name
+ */
+static dir_entry_key_t **dir_entry_table_slot(dir_entry_key_t **table, dir_entry_key_t *key, bool by_name) {
+    uint16_t cluster = by_name ? 0 : key->entry->DIR_FstClusLO;
+    uint32_t index = (cluster != 0 ? cluster : key->name_hash) * 2654435761u;
+    for (size_t i = 0; i < DIR_ENTRY_TABLE_SIZE; i++) {
+        dir_entry_key_t **slot = &table[(index + i) % DIR_ENTRY_TABLE_SIZE];
+        if (*slot == NULL)
+            return slot;
+        if (by_name ? dir_entry_key_name_equals(*slot, key)
+                    : (*slot)->entry->DIR_FstClusLO == cluster
+                      && (cluster != 0 || dir_entry_key_name_equals(*slot, key)))
+            return slot;
+    }
+    return NULL;
+}
+
+typedef enum {
+    DIR_ENTRY_CREATE,
+    DIR_ENTRY_DELETE,
+    DIR_ENTRY_RENAME,
+    DIR_ENTRY_RESIZE,
+} dir_entry_event_t;
+
+/*
+ * Find the changes between the original and the new content of a directory cluster
+ *
+ * *prev and *next are the neighbouring clusters of the directory chain, or NULL.
+ * Created and resized entries are emitted to *update, deleted ones to *delete, and a rename to both.
+ * Names are joined by their hash and then compared. Deleted (0xE5) entries are never joined, so
+ * a file deleted and copied again into the same cluster keeps living (test1w).
+ */
 static void difference_of_dir_entry(fat_dir_entry_t *orig, fat_dir_entry_t *new,
+                                    fat_dir_entry_t *prev, fat_dir_entry_t *next,
                                     fat_dir_entry_t *update,
                                     fat_dir_entry_t *delete)
 {
-    bool is_found = false;
+    static const char *event_name[] = {"create", "delete", "rename", "resize"};
+    long_filename_state_t state;
+    dir_entry_key_t orig_keys[DIR_ENTRY_DIFF_MAX];
+    dir_entry_key_t new_keys[DIR_ENTRY_DIFF_MAX];
+    dir_entry_key_t *table[DIR_ENTRY_TABLE_SIZE] = {0};
+    static uint8_t orig_names[DIR_ENTRY_NAMES_SIZE];  // off the stack
+    static uint8_t new_names[DIR_ENTRY_NAMES_SIZE];
+
     TRACE("difference_of_dir_entry-----\n");
     print_dir_entry(orig);
     TRACE("----------------------------\n");
@@ -1463,78 +2972,82 @@ static void difference_of_dir_entry(fat_dir_entry_t *orig, fat_dir_entry_t *new,
         return;
     }
 
-    for (int i = 0; i < 16; i++) {
-        if (strncmp((const char *)new[i].DIR_Name, ".          ", 11) == 0
-            || strncmp((const char *)new[i].DIR_Name, "..         ", 11) == 0
-            || (new[i].DIR_Attr & 0x0F) == 0x0F
-            || (new[i].DIR_Attr & 0x08) == 0x08) // volume label
-        {
-            continue;
-        }
+    state.is_long_filename = false;
+    if (prev != NULL)
+        collect_dir_entry_keys(NULL, NULL, prev, &state, NULL);
+    size_t orig_num = collect_dir_entry_keys(orig_keys, orig_names, orig, &state, next);
 
-        if (new[i].DIR_Name[0] == 0xE5) {
-            for (int j = 0; j < 16; j++) {
-                if ((orig[j].DIR_Attr & 0x08) == 0x08) // volume label
-                    continue;
-                if (new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO
-                    && new[i].DIR_FileSize == orig[j].DIR_FileSize
-                    && orig[j].DIR_Name[0] != 0xE5
-                    && new[i].DIR_FileSize != 0)
-                {
-                    // `delete` or `rename`.
-                    memcpy(delete, &orig[j], sizeof(fat_dir_entry_t));
-                    delete++;
-                    break;
-                }
+    state.is_long_filename = false;
+    if (prev != NULL)
+        collect_dir_entry_keys(NULL, NULL, prev, &state, NULL);
+    size_t new_num = collect_dir_entry_keys(new_keys, new_names, new, &state, next);
 
-                if (orig[j].DIR_Attr & 0x10  // directory
-                    && new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO
-                    && new[i].DIR_FileSize == 0
-                    && orig[j].DIR_Name[0] != 0xE5
-                    && i == j)
-                {
-                    // `delete` or `rename`.
-                    memcpy(delete, &orig[j], sizeof(fat_dir_entry_t));
-                    delete++;
-                    break;
-                }
-            }
+    for (size_t i = 0; i < orig_num; i++) {
+        dir_entry_key_t **slot = dir_entry_table_slot(table, &orig_keys[i], false);
+        if (slot != NULL && *slot == NULL)
+            *slot = &orig_keys[i];
+    }
+
+    dir_entry_key_t *found[DIR_ENTRY_DIFF_MAX];
+    for (size_t i = 0; i < new_num; i++) {
+        dir_entry_key_t **slot = dir_entry_table_slot(table, &new_keys[i], false);
+        found[i] = (slot != NULL) ? *slot : NULL;
+        if (found[i] != NULL)
+            found[i]->is_matched = true;
+    }
+
+    // second pass: entries that are left over on both sides are joined by their name
+    memset(table, 0, sizeof(table));
+    for (size_t i = 0; i < orig_num; i++) {
+        if (orig_keys[i].is_matched)
+            continue;
+        dir_entry_key_t **slot = dir_entry_table_slot(table, &orig_keys[i], true);
+        if (slot != NULL && *slot == NULL)
+            *slot = &orig_keys[i];
+    }
+    for (size_t i = 0; i < new_num; i++) {
+        if (found[i] != NULL)
             continue;
+        dir_entry_key_t **slot = dir_entry_table_slot(table, &new_keys[i], true);
+        if (slot != NULL && *slot != NULL && !(*slot)->is_matched) {
+            found[i] = *slot;
+            found[i]->is_matched = true;
         }
+    }
 
-        is_found = false;
-        for (int j = 0; j < 16; j++) {
-            if (new[i].DIR_Name[0] == 0xE5
-               || strncmp((const char *)orig[j].DIR_Name, ".          ", 11) == 0
-               || strncmp((const char *)orig[j].DIR_Name, "..         ", 11) == 0
-               || (orig[j].DIR_Attr & 0x0F) == 0x0F
-               || (orig[j].DIR_Attr & 0x08) == 0x08)  // volume label
-            {
-                continue;
-            }
-
-            if (strncmp((const char *)new[i].DIR_Name, (const char *)orig[j].DIR_Name, 11) == 0 &&
-                new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO &&
-                new[i].DIR_FileSize == orig[j].DIR_FileSize)
-            {
-                is_found = true;
-                break;
-            }
+    for (size_t i = 0; i < new_num; i++) {
+        fat_dir_entry_t *entry = new_keys[i].entry;
+        dir_entry_event_t event;
 
-            // rename
-            if (i == j &&
-                new[i].DIR_FstClusLO == orig[j].DIR_FstClusLO &&
-                new[i].DIR_FileSize == orig[j].DIR_FileSize)
-            {
-                memcpy(delete, &orig[j], sizeof(fat_dir_entry_t));
-                delete++;
-                break;
-            }
+        if (found[i] == NULL) {
+            event = DIR_ENTRY_CREATE;
+        } else if (!dir_entry_key_name_equals(found[i], &new_keys[i])) {
+            event = DIR_ENTRY_RENAME;
+        } else if (found[i]->entry->DIR_FileSize != entry->DIR_FileSize
+                   || found[i]->entry->DIR_FstClusLO != entry->DIR_FstClusLO) {
+            event = DIR_ENTRY_RESIZE;
+        } else {
+            continue;
         }
-        if (!is_found) {
-            memcpy(update, &new[i], sizeof(fat_dir_entry_t));
-            update++;
+
+        TRACE("difference_of_dir_entry: %s cluster=%u size=%lu\n",
+              event_name[event], entry->DIR_FstClusLO, entry->DIR_FileSize);
+        if (event == DIR_ENTRY_RENAME) {
+            memcpy(delete, found[i]->entry, sizeof(fat_dir_entry_t));
+            delete++;
         }
+        memcpy(update, entry, sizeof(fat_dir_entry_t));
+        update++;
+    }
+
+    for (size_t i = 0; i < orig_num; i++) {
+        // files without clusters can't be found by restore_file_from(), they are left alone
+        if (orig_keys[i].is_matched || orig_keys[i].entry->DIR_FstClusLO == 0)
+            continue;
+        TRACE("difference_of_dir_entry: %s cluster=%u size=%lu\n",
+              event_name[DIR_ENTRY_DELETE], orig_keys[i].entry->DIR_FstClusLO, orig_keys[i].entry->DIR_FileSize);
+        memcpy(delete, orig_keys[i].entry, sizeof(fat_dir_entry_t));
+        delete++;
     }
 }
 
@@ -1575,16 +3088,30 @@ static int littlefs_write(const char *filename, uint32_t cluster, size_t size) {
 
     while (true) {
         err = read_temporary_file(cluster, buffer);
-        if (err != LFS_ERR_OK) {
+        if (err == LFS_ERR_NOENT && get_cluster_bit(written_through, cluster)
+            && lfs_file_size(&real_filesystem, &f) >= lfs_file_tell(&real_filesystem, &f) + (lfs_soff_t)sizeof(buffer))
+        {
+            // copied from the staging area by an earlier call, the file has the data already
+            lfs_file_seek(&real_filesystem, &f, sizeof(buffer), LFS_SEEK_CUR);
+        } else if (err != LFS_ERR_OK) {
             TRACE("littlefs_write: read_temporary_file error=%d\n", err);
             lfs_file_close(&real_filesystem, &f);
             return err;
-        }
-        size_t s = lfs_file_write(&real_filesystem, &f, buffer, sizeof(buffer));
-        if (s != 512) {
-            TRACE("littlefs_write: lfs_file_write, %u < %u\n", s, 512);
-            lfs_file_close(&real_filesystem, &f);
-            return -1;
+        } else {
+            // the final size is known, a large file skips the inline stage
+            err = lfs_file_reserve(&real_filesystem, &f, size);
+            if (err != LFS_ERR_OK) {
+                TRACE("littlefs_write: lfs_file_reserve error=%d\n", err);
+                lfs_file_close(&real_filesystem, &f);
+                return err;
+            }
+            size_t s = lfs_file_write(&real_filesystem, &f, buffer, sizeof(buffer));
+            if (s != 512) {
+                TRACE("littlefs_write: lfs_file_write, %u < %u\n", s, 512);
+                lfs_file_close(&real_filesystem, &f);
+                return -1;
+            }
+            release_staged_cluster(cluster);
         }
         int next_cluster = read_fat(cluster);
         if (next_cluster == 0x00) // not allocated
@@ -1622,7 +3149,8 @@ static int littlefs_remove(const char *filename) {
 /*
  * Update a file or directory from the difference indicated by *src in dir_cluster_id
  *
- * *src is an array of differences created by diff_dir_entry()
+ * *src is an array of differences created by diff_dir_entry(). The updates run in an lfs batch,
+ * a created file gets its directory entry in the commit of its contents.
  */
 static void update_lfs_file_or_directory(fat_dir_entry_t *src, uint32_t dir_cluster_id) {
     TRACE("update_lfs_file_or_directory(dir_cluster_id=%lu)\n", dir_cluster_id);
@@ -1632,8 +3160,9 @@ static void update_lfs_file_or_directory(fat_dir_entry_t *src, uint32_t dir_clus
 
     strcpy(directory, "");
 
+    lfs_batch_begin(&real_filesystem);
     bool is_long_filename = false;
-    for (int i = 0; i < 16; i++) {
+    for (int i = 0; i < DIR_ENTRY_DIFF_MAX; i++) {
         fat_dir_entry_t *dir = &src[i];
         if (dir->DIR_Name[0] == '\0')
             break;
@@ -1665,7 +3194,8 @@ static void update_lfs_file_or_directory(fat_dir_entry_t *src, uint32_t dir_clus
             // FIXME: If there is a directory to be deleted with the same name,
             //        the files in the directory must be copied.
             restore_directory_from(directory, dir_cluster_id, dir->DIR_FstClusLO);
-            littlefs_mkdir(directory);
+            if (littlefs_mkdir(directory) == LFS_ERR_OK)
+                store_entry_cluster(directory, dir->DIR_FstClusLO);
             create_blank_dir_entry_cache(dir->DIR_FstClusLO, dir_cluster_id);
 
             is_long_filename = false;
@@ -1684,7 +3214,8 @@ static void update_lfs_file_or_directory(fat_dir_entry_t *src, uint32_t dir_clus
             }
 
             restore_file_from(filename, dir_cluster_id,  dir->DIR_FstClusLO);
-            littlefs_write((const char *)filename, dir->DIR_FstClusLO, dir->DIR_FileSize);
+            if (littlefs_write((const char *)filename, dir->DIR_FstClusLO, dir->DIR_FileSize) == 0)
+                store_entry_cluster(filename, dir->DIR_FstClusLO);
             is_long_filename = false;
             continue;
         } else {
@@ -1692,6 +3223,9 @@ static void update_lfs_file_or_directory(fat_dir_entry_t *src, uint32_t dir_clus
         }
         is_long_filename = false;
     }
+    int err = lfs_batch_commit(&real_filesystem);
+    if (err != LFS_ERR_OK)
+        printf("update_lfs_file_or_directory: lfs_batch_commit() error=%d\n", err);
 }
 
 /*
@@ -1738,7 +3272,7 @@ static void save_file_clusters(uint32_t cluster, const char *filename) {
 static void delete_dir_entry_cache(fat_dir_entry_t *src, uint32_t dir_cluster_id) {
     char filename[LFS_NAME_MAX + 1];
 
-    for (int i = 0; i < 16; i++) {
+    for (int i = 0; i < DIR_ENTRY_DIFF_MAX; i++) {
         fat_dir_entry_t *dir = &src[i];
         if (dir->DIR_Name[0] == '\0')
             break;
@@ -1766,22 +3300,91 @@ static void delete_dir_entry_cache(fat_dir_entry_t *src, uint32_t dir_cluster_id
     }
 }
 
-static void update_dir_entry(uint32_t cluster, void *buffer) {
+/*
+ * Is the entry still listed in another cluster of the directory chain?
+ *
+ * The difference is taken one cluster at a time, so an entry the host moves to another cluster
+ * of the chain is a delete here and a create there. When the destination was written first, the
+ * delete must not remove the file again. Entries are matched by their first cluster, or by the
+ * short name for empty files.
+ */
+static bool is_dir_entry_moved(uint32_t base_cluster, uint32_t cluster, const fat_dir_entry_t *src) {
+    dir_entry_iterator_t it;
+    fat_dir_entry_t *entry;
+
+    if (dir_entry_iterator_init(&it, base_cluster) != LFS_ERR_OK)
+        return false;
+    while ((entry = dir_entry_iterator_next(&it)) != NULL) {
+        if (it.cluster == cluster)  // the cluster being written, still as it was
+            continue;
+        if (entry->DIR_Name[0] == '\0')
+            break;
+        if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Name[0] == '.' || entry->DIR_Attr == 0x0F)
+            continue;
+        if ((entry->DIR_Attr & 0x10) != (src->DIR_Attr & 0x10))
+            continue;
+        if (src->DIR_FstClusLO != 0 ? entry->DIR_FstClusLO == src->DIR_FstClusLO
+                                    : memcmp(entry->DIR_Name, src->DIR_Name, 11) == 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Update the cluster of a directory whose cluster chain starts at base_cluster
+ */
+static void update_dir_entry(uint32_t base_cluster, uint32_t cluster, void *buffer) {
     fat_dir_entry_t orig[16] = {0};
     fat_dir_entry_t *new = buffer;
-    fat_dir_entry_t dir_update[16] = {0};
-    fat_dir_entry_t dir_delete[16] = {0};
-
+    fat_dir_entry_t prev[16];
+    fat_dir_entry_t next[16];
+    bool has_prev = false;
+    bool has_next = false;
+    fat_dir_entry_t dir_update[DIR_ENTRY_DIFF_MAX] = {0};
+    fat_dir_entry_t dir_delete[DIR_ENTRY_DIFF_MAX] = {0};
+
+    materialize_dir(base_cluster);
     if (read_temporary_file(cluster, orig) != 0) {
-        printf("update_dir_entry: entry not found cluster=%lu\n", cluster);
-        return;
+        if (cluster == base_cluster) {
+            printf("update_dir_entry: entry not found cluster=%lu\n", cluster);
+            return;
+        }
+        // the host has just extended the directory with this cluster
+        memset(orig, 0, sizeof(orig));
     }
 
-    difference_of_dir_entry(orig, new, dir_update, dir_delete);
-    delete_dir_entry_cache(dir_delete, cluster);
+    // neighbouring clusters of the chain, for long file name runs crossing the cluster boundaries
+    uint32_t prev_cluster = base_cluster;
+    for (size_t limit = cluster_size(); prev_cluster != cluster && limit > 0; limit--) {
+        uint16_t next_cluster = read_fat(prev_cluster);
+        if (next_cluster == cluster) {
+            has_prev = read_temporary_file(prev_cluster, prev) == LFS_ERR_OK;
+            break;
+        }
+        if (next_cluster < 2 || next_cluster >= 0xFF8)
+            break;
+        prev_cluster = next_cluster;
+    }
+    uint16_t next_cluster = read_fat(cluster);
+    if (next_cluster >= 2 && next_cluster < 0xFF8) {
+        has_next = read_temporary_file(next_cluster, next) == LFS_ERR_OK;
+    }
+
+    difference_of_dir_entry(orig, new, has_prev ? prev : NULL, has_next ? next : NULL, dir_update, dir_delete);
+    size_t deletes = 0;
+    for (size_t i = 0; i < DIR_ENTRY_DIFF_MAX && dir_delete[i].DIR_Name[0] != '\0'; i++) {
+        if (is_dir_entry_moved(base_cluster, cluster, &dir_delete[i])) {
+            TRACE("update_dir_entry: '%.11s' moved to another cluster\n", dir_delete[i].DIR_Name);
+            continue;
+        }
+        dir_delete[deletes++] = dir_delete[i];
+    }
+    if (deletes < DIR_ENTRY_DIFF_MAX)
+        memset(&dir_delete[deletes], 0, sizeof(dir_delete[0]) * (DIR_ENTRY_DIFF_MAX - deletes));
+    delete_dir_entry_cache(dir_delete, base_cluster);
 
     save_temporary_file(cluster, buffer);
-    update_lfs_file_or_directory(dir_update, cluster);
+    update_lfs_file_or_directory(dir_update, base_cluster);
 }
 
 /*
@@ -1812,6 +3415,9 @@ static void update_file_entry(uint32_t cluster, void *buffer, uint32_t bufsize,
         lfs_file_seek(&real_filesystem, &f, offset * DISK_SECTOR_SIZE, LFS_SEEK_SET);
     }
 
+    // no lfs_file_reserve() here: every sector is an append in a new open, which copies the
+    // last incomplete CTZ block anyway, so keeping the first sector inline saves an erase
+
     lfs_ssize_t size = lfs_file_write(&real_filesystem, &f, buffer, bufsize);
     if (size < 0 || size != 512) {
         printf("update_file_entry: lfs_file_write('%s') error=%ld\n", result->path, size);
@@ -1834,8 +3440,7 @@ static void update_file_entry(uint32_t cluster, void *buffer, uint32_t bufsize,
     }
 }
 
-void mimic_fat_write(uint8_t lun, uint32_t request_block, void *buffer, uint32_t bufsize) {
-    (void)lun;
+static void write_sector(uint32_t request_block, void *buffer, uint32_t bufsize) {
     find_dir_entry_cache_result_t result;
 
     if (request_block == 0) // master boot record
@@ -1853,11 +3458,12 @@ void mimic_fat_write(uint8_t lun, uint32_t request_block, void *buffer, uint32_t
         TRACE("mimic_fat_write: update root dir_entry\n");
 
         fat_dir_entry_t orig[16] = {0};
-        fat_dir_entry_t dir_update[16] = {0};
-        fat_dir_entry_t dir_delete[16] = {0};
+        fat_dir_entry_t dir_update[DIR_ENTRY_DIFF_MAX] = {0};
+        fat_dir_entry_t dir_delete[DIR_ENTRY_DIFF_MAX] = {0};
 
+        materialize_dir(cluster);
         read_temporary_file(cluster, orig);
-        difference_of_dir_entry(&orig[0], (fat_dir_entry_t *)buffer, dir_update, dir_delete);
+        difference_of_dir_entry(&orig[0], (fat_dir_entry_t *)buffer, NULL, NULL, dir_update, dir_delete);
 
         delete_dir_entry_cache(dir_delete, cluster);
 
@@ -1871,7 +3477,7 @@ void mimic_fat_write(uint8_t lun, uint32_t request_block, void *buffer, uint32_t
 
         if (base_cluster == 0) {
             TRACE("mimic_fat_write: not allocated cluster\n");
-            save_temporary_file(cluster, buffer);
+            stage_cluster(cluster, buffer);
 
             // For hosts that write to unallocated space first
             find_dir_entry_cache_return_t r = find_dir_entry_cache(&result, 1, cluster);
@@ -1892,13 +3498,62 @@ void mimic_fat_write(uint8_t lun, uint32_t request_block, void *buffer, uint32_t
         }
         if (r == FIND_DIR_ENTRY_CACHE_RESULT_NOT_FOUND) {
             TRACE(ANSI_RED "find_dir_entry_cache not found cluster=%lu\n" ANSI_CLEAR, base_cluster);
-            save_temporary_file(cluster, buffer);
+            stage_cluster(cluster, buffer);
             return;
         }
 
         if (result.is_directory)
-            update_dir_entry(cluster, buffer);
+            update_dir_entry(base_cluster, cluster, buffer);
         else
             update_file_entry(cluster, buffer, bufsize, &result, offset);
     }
 }
+
+/*
+ * Apply a sector written by the host
+ *
+ * Files created on its behalf get their directory entry in the commit of their contents.
+ */
+void mimic_fat_write(uint8_t lun, uint32_t request_block, void *buffer, uint32_t bufsize) {
+    (void)lun;
+
+    drop_read_ahead_streams();
+    drop_dir_renders();
+    invalidate_rendered_sector(request_block);
+    invalidate_rendered_directories();
+    lfs_batch_begin(&real_filesystem);
+    write_sector(request_block, buffer, bufsize);
+    int err = lfs_batch_commit(&real_filesystem);
+    if (err != LFS_ERR_OK)
+        printf("mimic_fat_write: lfs_batch_commit() error=%d\n", err);
+}
+
+/*
+ * Flush point of the host (SYNCHRONIZE CACHE)
+ *
+ * The clusters written before their allocation and still staged in RAM are saved as temporary files.
+ */
+void mimic_fat_sync(void) {
+    TRACE("mimic_fat_sync()\n");
+
+    lfs_batch_begin(&real_filesystem);
+    for (size_t i = 0; i < MIMIC_FAT_STAGING_CLUSTERS; i++) {
+        if (staged_clusters[i].cluster != 0)
+            save_temporary_file(staged_clusters[i].cluster, staged_clusters[i].buffer);  // frees the slot
+    }
+    int err = lfs_batch_commit(&real_filesystem);
+    if (err != LFS_ERR_OK)
+        printf("mimic_fat_sync: lfs_batch_commit() error=%d\n", err);
+}
+
+/*
+ * The host has ejected the medium (START STOP UNIT), littlefs is left to the device
+ */
+void mimic_fat_eject(void) {
+    TRACE("mimic_fat_eject()\n");
+
+    mimic_fat_sync();
+    drop_read_ahead_streams();
+    drop_dir_renders();
+    usb_device_is_enabled = false;
+}
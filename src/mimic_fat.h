@@ -11,6 +11,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 #include <lfs.h>
 #include "unicode.h"
 
@@ -46,6 +47,21 @@ typedef struct {
 
 #define DISK_SECTOR_SIZE   512
 
+typedef struct {
+    size_t clusters;             // clusters saved as temporary files
+    size_t compressed_clusters;  // of them stored compressed
+    uint64_t raw_bytes;
+    uint64_t stored_bytes;
+    clock_t compress_time;
+    clock_t decompress_time;
+} mimic_fat_compression_stats_t;
+
+typedef struct {
+    size_t reads;                // file sectors read by the host
+    size_t hits;                 // of them served from a read-ahead window
+    uint64_t prefetched_bytes;   // read from littlefs ahead of the host
+} mimic_fat_read_ahead_stats_t;
+
 
 void mimic_fat_init(const struct lfs_config *c);
 size_t mimic_fat_total_sector_size(void);
@@ -53,7 +69,12 @@ void mimic_fat_create_cache(void);
 void mimic_fat_cleanup_cache(void);
 void mimic_fat_read(uint8_t lun, uint32_t sector, void *buffer, uint32_t bufsize);
 void mimic_fat_write(uint8_t lun, uint32_t sector, void *buffer, uint32_t bufsize);
+void mimic_fat_sync(void);
+void mimic_fat_eject(void);
 bool mimic_fat_usb_device_is_enabled(void);
 void mimic_fat_update_usb_device_is_enabled(bool enable);
+void mimic_fat_set_compression(bool enable);
+void mimic_fat_compression_stats(mimic_fat_compression_stats_t *stats);
+void mimic_fat_read_ahead_stats(mimic_fat_read_ahead_stats_t *stats);
 
 #endif
@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2024, Vladimir Alemasov
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* malloc */
+#include <stdio.h>      /* printf, fopen */
+#include <string.h>     /* memcpy */
+#include <stdbool.h>    /* bool */
+#include <assert.h>     /* assert */
+#include "mimic_fat.h"
+#include "tests.h"
+#include "msc_trace.h"
+
+//--------------------------------------------
+// A trace keeps the mass storage transactions of a capture already decoded:
+//   header
+//   commands   fixed-size records in CBW order, the index of the trace
+//   chunks     data URBs of the commands, in command order
+//   map        sector numbers of the data stages, in command order
+//   sectors    unique 512-byte sectors of the data stages
+// A data stage is stored as whole sectors of the command buffer, equal sectors
+// (zeros, FAT copies, rewritten clusters) are stored once.
+// Fields are in host byte order.
+
+//--------------------------------------------
+#define MSC_TRACE_MAGIC                 0x5443534D  // "MSCT"
+#define MSC_TRACE_VERSION               1
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t command_count;
+	uint32_t chunk_count;
+	uint32_t map_count;
+	uint32_t sector_count;
+	uint64_t commands_offset;
+	uint64_t chunks_offset;
+	uint64_t map_offset;
+	uint64_t sectors_offset;
+} msc_trace_header_t;
+
+//--------------------------------------------
+struct msc_trace
+{
+	FILE *file;
+	msc_trace_header_t header;
+};
+
+//--------------------------------------------
+// Command of the writer waiting for its data stage to end
+typedef struct
+{
+	size_t index;
+	uint8_t *data;
+	uint32_t data_size;         // buffer of the command
+	uint32_t data_end;          // bytes of the buffer received so far
+	msc_trace_chunk_t *chunks;
+	size_t chunk_num;
+	size_t chunk_max;
+} open_command_t;
+
+//--------------------------------------------
+static FILE *file;
+static msc_trace_command_t *commands;
+static size_t command_num;
+static size_t command_max;
+static msc_trace_chunk_t *chunks;
+static size_t chunk_num;
+static size_t chunk_max;
+static uint32_t *map;
+static size_t map_num;
+static size_t map_max;
+static uint8_t *sectors;
+static size_t sector_num;
+static size_t sector_max;
+static uint32_t *slots;         // hash table of the sectors, sector number + 1, 0 for a free slot
+static size_t slot_num;
+static open_command_t *open_commands;
+static size_t open_command_num;
+static size_t open_command_max;
+
+//--------------------------------------------
+static void *grow(void *array, size_t *max, size_t size)
+{
+	*max = *max ? *max * 2 : 64;
+	array = realloc(array, *max * size);
+	assert(array);
+	return array;
+}
+
+//--------------------------------------------
+static uint32_t hash_sector(const uint8_t *sector)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t cnt = 0; cnt < DISK_SECTOR_SIZE; cnt++)
+	{
+		hash = (hash ^ sector[cnt]) * 16777619u;
+	}
+	return hash;
+}
+
+//--------------------------------------------
+static void rehash_sectors(void)
+{
+	free(slots);
+	slot_num = slot_num ? slot_num * 2 : 1024;
+	slots = (uint32_t *)calloc(slot_num, sizeof(uint32_t));
+	assert(slots);
+	for (size_t cnt = 0; cnt < sector_num; cnt++)
+	{
+		size_t slot = hash_sector(sectors + DISK_SECTOR_SIZE * cnt) & (slot_num - 1);
+		while (slots[slot])
+		{
+			slot = (slot + 1) & (slot_num - 1);
+		}
+		slots[slot] = (uint32_t)cnt + 1;
+	}
+}
+
+//--------------------------------------------
+static uint32_t store_sector(const uint8_t *sector)
+{
+	size_t slot;
+
+	if (2 * (sector_num + 1) > slot_num)
+	{
+		rehash_sectors();
+	}
+	slot = hash_sector(sector) & (slot_num - 1);
+	while (slots[slot])
+	{
+		if (!memcmp(sectors + DISK_SECTOR_SIZE * (slots[slot] - 1), sector, DISK_SECTOR_SIZE))
+		{
+			return slots[slot] - 1;
+		}
+		slot = (slot + 1) & (slot_num - 1);
+	}
+	if (sector_num == sector_max)
+	{
+		sectors = (uint8_t *)grow(sectors, &sector_max, DISK_SECTOR_SIZE);
+	}
+	memcpy(sectors + DISK_SECTOR_SIZE * sector_num, sector, DISK_SECTOR_SIZE);
+	slots[slot] = (uint32_t)++sector_num;
+	return (uint32_t)(sector_num - 1);
+}
+
+//--------------------------------------------
+static open_command_t *find_open_command(size_t index)
+{
+	for (size_t cnt = 0; cnt < open_command_num; cnt++)
+	{
+		if (open_commands[cnt].index == index)
+		{
+			return &open_commands[cnt];
+		}
+	}
+	return NULL;
+}
+
+//--------------------------------------------
+bool msc_trace_create(const char *name)
+{
+	file = fopen(name, "wb");
+	if (!file)
+	{
+		printf(ANSI_YELLOW"msc_trace_create: can't create %s\r\n"ANSI_CLEAR, name);
+		return false;
+	}
+	return true;
+}
+
+//--------------------------------------------
+size_t msc_trace_command(const msc_trace_command_t *command)
+{
+	open_command_t *open;
+
+	if (command_num == command_max)
+	{
+		commands = (msc_trace_command_t *)grow(commands, &command_max, sizeof(msc_trace_command_t));
+	}
+	commands[command_num] = *command;
+	if (open_command_num == open_command_max)
+	{
+		open_commands = (open_command_t *)grow(open_commands, &open_command_max, sizeof(open_command_t));
+	}
+	open = &open_commands[open_command_num++];
+	memset(open, 0, sizeof(open_command_t));
+	open->index = command_num;
+	open->data_size = command->length * DISK_SECTOR_SIZE;
+	return command_num++;
+}
+
+//--------------------------------------------
+void msc_trace_data(size_t index, uint32_t offset, const uint8_t *data, uint32_t length, uint32_t captured, size_t packet_num)
+{
+	open_command_t *open = find_open_command(index);
+
+	if (!open)
+	{
+		return;
+	}
+	if (!open->data)
+	{
+		open->data = (uint8_t *)calloc(1, open->data_size);
+		assert(open->data);
+	}
+	if (offset < open->data_size)
+	{
+		uint32_t size = open->data_size - offset;
+		if (captured < size)
+		{
+			size = captured;
+		}
+		memcpy(open->data + offset, data, size);
+		if (offset + size > open->data_end)
+		{
+			open->data_end = offset + size;
+		}
+	}
+	if (open->chunk_num == open->chunk_max)
+	{
+		open->chunks = (msc_trace_chunk_t *)grow(open->chunks, &open->chunk_max, sizeof(msc_trace_chunk_t));
+	}
+	open->chunks[open->chunk_num].length = length;
+	open->chunks[open->chunk_num].captured = captured;
+	open->chunk_num++;
+	commands[index].data_packet_num = (uint32_t)packet_num;
+}
+
+//--------------------------------------------
+void msc_trace_status(size_t index, uint32_t tag, uint8_t status, size_t packet_num)
+{
+	commands[index].status_tag = tag;
+	commands[index].status = status;
+	commands[index].status_packet_num = (uint32_t)packet_num;
+}
+
+//--------------------------------------------
+void msc_trace_close_command(size_t index)
+{
+	open_command_t *open = find_open_command(index);
+	msc_trace_command_t *command = &commands[index];
+
+	if (!open)
+	{
+		return;
+	}
+	command->chunk_first = (uint32_t)chunk_num;
+	command->chunk_count = (uint32_t)open->chunk_num;
+	for (size_t cnt = 0; cnt < open->chunk_num; cnt++)
+	{
+		if (chunk_num == chunk_max)
+		{
+			chunks = (msc_trace_chunk_t *)grow(chunks, &chunk_max, sizeof(msc_trace_chunk_t));
+		}
+		chunks[chunk_num++] = open->chunks[cnt];
+	}
+	command->sector_first = (uint32_t)map_num;
+	command->sector_count = (open->data_end + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE;
+	for (uint32_t cnt = 0; cnt < command->sector_count; cnt++)
+	{
+		if (map_num == map_max)
+		{
+			map = (uint32_t *)grow(map, &map_max, sizeof(uint32_t));
+		}
+		map[map_num++] = store_sector(open->data + DISK_SECTOR_SIZE * cnt);
+	}
+	free(open->data);
+	free(open->chunks);
+	*open = open_commands[--open_command_num];
+}
+
+//--------------------------------------------
+bool msc_trace_finish(void)
+{
+	msc_trace_header_t header;
+	bool is_ok;
+
+	if (!file)
+	{
+		return false;
+	}
+	while (open_command_num)
+	{
+		msc_trace_close_command(open_commands[0].index);
+	}
+
+	header.magic = MSC_TRACE_MAGIC;
+	header.version = MSC_TRACE_VERSION;
+	header.command_count = (uint32_t)command_num;
+	header.chunk_count = (uint32_t)chunk_num;
+	header.map_count = (uint32_t)map_num;
+	header.sector_count = (uint32_t)sector_num;
+	header.commands_offset = sizeof(msc_trace_header_t);
+	header.chunks_offset = header.commands_offset + command_num * sizeof(msc_trace_command_t);
+	header.map_offset = header.chunks_offset + chunk_num * sizeof(msc_trace_chunk_t);
+	header.sectors_offset = header.map_offset + map_num * sizeof(uint32_t);
+	is_ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(commands, sizeof(msc_trace_command_t), command_num, file) == command_num
+		&& fwrite(chunks, sizeof(msc_trace_chunk_t), chunk_num, file) == chunk_num
+		&& fwrite(map, sizeof(uint32_t), map_num, file) == map_num
+		&& fwrite(sectors, DISK_SECTOR_SIZE, sector_num, file) == sector_num;
+	is_ok = !fclose(file) && is_ok;
+	file = NULL;
+
+	printf(ANSI_YELLOW"\r\nTrace: %zu commands, %zu data sectors stored as %zu unique sectors, %llu bytes\r\n"ANSI_CLEAR,
+		command_num, map_num, sector_num, (unsigned long long)(header.sectors_offset + sector_num * DISK_SECTOR_SIZE));
+	if (!is_ok)
+	{
+		printf(ANSI_YELLOW"msc_trace_finish: write error\r\n"ANSI_CLEAR);
+	}
+
+	free(commands);
+	free(chunks);
+	free(map);
+	free(sectors);
+	free(slots);
+	free(open_commands);
+	commands = NULL;
+	chunks = NULL;
+	map = NULL;
+	sectors = NULL;
+	slots = NULL;
+	open_commands = NULL;
+	command_num = command_max = chunk_num = chunk_max = map_num = map_max = 0;
+	sector_num = sector_max = slot_num = open_command_max = 0;
+	return is_ok;
+}
+
+//--------------------------------------------
+static bool read_at(msc_trace_t *trace, uint64_t offset, void *buffer, size_t size)
+{
+	return !fseek(trace->file, (long)offset, SEEK_SET) && fread(buffer, size, 1, trace->file) == 1;
+}
+
+//--------------------------------------------
+msc_trace_t *msc_trace_open(const char *name)
+{
+	msc_trace_t *trace = (msc_trace_t *)calloc(1, sizeof(msc_trace_t));
+	assert(trace);
+
+	trace->file = fopen(name, "rb");
+	if (!trace->file)
+	{
+		printf(ANSI_YELLOW"msc_trace_open: can't open %s\r\n"ANSI_CLEAR, name);
+		free(trace);
+		return NULL;
+	}
+	if (!read_at(trace, 0, &trace->header, sizeof(msc_trace_header_t))
+		|| trace->header.magic != MSC_TRACE_MAGIC || trace->header.version != MSC_TRACE_VERSION)
+	{
+		printf(ANSI_YELLOW"msc_trace_open: %s is not a trace\r\n"ANSI_CLEAR, name);
+		fclose(trace->file);
+		free(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+//--------------------------------------------
+size_t msc_trace_command_count(msc_trace_t *trace)
+{
+	return trace->header.command_count;
+}
+
+//--------------------------------------------
+bool msc_trace_read_command(msc_trace_t *trace, size_t index, msc_trace_command_t *command)
+{
+	if (index >= trace->header.command_count)
+	{
+		return false;
+	}
+	return read_at(trace, trace->header.commands_offset + index * sizeof(msc_trace_command_t), command, sizeof(msc_trace_command_t));
+}
+
+//--------------------------------------------
+bool msc_trace_read_chunk(msc_trace_t *trace, size_t index, msc_trace_chunk_t *chunk)
+{
+	if (index >= trace->header.chunk_count)
+	{
+		return false;
+	}
+	return read_at(trace, trace->header.chunks_offset + index * sizeof(msc_trace_chunk_t), chunk, sizeof(msc_trace_chunk_t));
+}
+
+//--------------------------------------------
+// buffer gets command->sector_count sectors
+bool msc_trace_read_data(msc_trace_t *trace, const msc_trace_command_t *command, uint8_t *buffer)
+{
+	uint32_t sector;
+
+	if ((uint64_t)command->sector_first + command->sector_count > trace->header.map_count)
+	{
+		return false;
+	}
+	for (uint32_t cnt = 0; cnt < command->sector_count; cnt++)
+	{
+		if (!read_at(trace, trace->header.map_offset + (uint64_t)(command->sector_first + cnt) * sizeof(uint32_t), &sector, sizeof(sector))
+			|| sector >= trace->header.sector_count
+			|| !read_at(trace, trace->header.sectors_offset + (uint64_t)sector * DISK_SECTOR_SIZE, buffer + DISK_SECTOR_SIZE * cnt, DISK_SECTOR_SIZE))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//--------------------------------------------
+void msc_trace_close(msc_trace_t *trace)
+{
+	fclose(trace->file);
+	free(trace);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2024, Vladimir Alemasov
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef MSC_TRACE_H_
+#define MSC_TRACE_H_
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stddef.h>     /* size_t */
+#include <stdbool.h>    /* bool */
+
+//--------------------------------------------
+// Mass storage transaction (CBW, data stage, CSW) of a trace
+typedef struct
+{
+	uint64_t timestamp_us;      // of the CBW
+	uint32_t packet_num;        // CBW submission
+	uint32_t data_packet_num;   // submission of the last data URB
+	uint32_t status_packet_num; // CSW completion, 0 if there is no CSW
+	uint16_t bus;
+	uint16_t device;
+	uint32_t tag;               // of the CBW
+	uint32_t status_tag;        // of the CSW
+	uint32_t lba;               // of a READ/WRITE
+	uint32_t length;            // sectors of a READ/WRITE
+	uint32_t chunk_first;       // data URBs
+	uint32_t chunk_count;
+	uint32_t sector_first;      // data stage in the sector map
+	uint32_t sector_count;
+	uint8_t status;             // CSW status
+	uint8_t cdb_length;
+	uint8_t cdb[16];
+	uint8_t reserved[2];
+} msc_trace_command_t;
+
+//--------------------------------------------
+// Data URB of a transaction
+typedef struct
+{
+	uint32_t length;            // transferred bytes
+	uint32_t captured;          // bytes present in the capture
+} msc_trace_chunk_t;
+
+//--------------------------------------------
+typedef struct msc_trace msc_trace_t;
+
+//--------------------------------------------
+// Writer
+bool msc_trace_create(const char *name);
+size_t msc_trace_command(const msc_trace_command_t *command);
+void msc_trace_data(size_t index, uint32_t offset, const uint8_t *data, uint32_t length, uint32_t captured, size_t packet_num);
+void msc_trace_status(size_t index, uint32_t tag, uint8_t status, size_t packet_num);
+void msc_trace_close_command(size_t index);
+bool msc_trace_finish(void);
+
+//--------------------------------------------
+// Reader
+msc_trace_t *msc_trace_open(const char *name);
+size_t msc_trace_command_count(msc_trace_t *trace);
+bool msc_trace_read_command(msc_trace_t *trace, size_t index, msc_trace_command_t *command);
+bool msc_trace_read_chunk(msc_trace_t *trace, size_t index, msc_trace_chunk_t *chunk);
+bool msc_trace_read_data(msc_trace_t *trace, const msc_trace_command_t *command, uint8_t *buffer);
+void msc_trace_close(msc_trace_t *trace);
+
+#endif /* MSC_TRACE_H_ */
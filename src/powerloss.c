@@ -0,0 +1,566 @@
+/*
+ * Copyright (c) 2024, Vladimir Alemasov
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* malloc */
+#include <stdio.h>      /* printf */
+#include <string.h>     /* strcmp, memcpy */
+#include <ctype.h>      /* toupper */
+#include <stdbool.h>    /* bool */
+#include <assert.h>     /* assert */
+#ifndef _WIN32
+#include <unistd.h>     /* fork, sysconf, _exit */
+#include <sys/wait.h>   /* wait */
+#endif
+#include "lfs.h"
+#include "mimic_fat.h"
+#include "unicode.h"
+#include "tests.h"
+#include "powerloss.h"
+
+//--------------------------------------------
+// Every k-th prog/erase callback of the flash driver is a cut point.
+// The replay process forks at each cut point, so the child inherits the flash image
+// as it was just before the interrupted operation (copy-on-write snapshot).
+// The child applies a truncated or torn operation, "reboots" and checks the invariants:
+// littlefs mounts and reads back, and the FAT volume rendered from it lists every file and
+// directory with a chain as long as the file, no cluster being claimed twice.
+// The parent meanwhile continues the replay. Up to one child per CPU core runs at a time.
+
+#ifndef _WIN32
+
+//--------------------------------------------
+// Exit codes of the child process
+enum
+{
+	POWERLOSS_OK = 0,
+	POWERLOSS_ERR_MOUNT,
+	POWERLOSS_ERR_TRAVERSE,
+	POWERLOSS_ERR_CACHE,
+	POWERLOSS_ERR_FAT,
+	POWERLOSS_ERR_ENTRY,
+	POWERLOSS_ERR_CHAIN,
+	POWERLOSS_ERR_CLAIMED,
+	POWERLOSS_ERR_MAX
+};
+
+static const char *powerloss_errors[POWERLOSS_ERR_MAX] =
+{
+	"ok",
+	"lfs_mount failed",
+	"littlefs traversal failed",
+	"mimic_fat_create_cache failed",
+	"invalid FAT sectors after mimic_fat_create_cache",
+	"file or directory without a matching entry in the FAT directories",
+	"FAT chain of a file does not match its size",
+	"cluster claimed by two FAT chains",
+};
+
+//--------------------------------------------
+typedef struct
+{
+	pid_t pid;
+	size_t op;
+	powerloss_cut_t cut;
+} powerloss_child_t;
+
+//--------------------------------------------
+static const struct lfs_config *config;
+static size_t interval;
+static size_t op_count;
+static size_t cut_count;
+static size_t failed_count;
+static powerloss_child_t *children;
+static size_t children_max;
+static size_t children_running;
+static bool is_child;
+
+//--------------------------------------------
+static int traverse_dir(lfs_t *lfs, const char *path)
+{
+	int res;
+	lfs_dir_t dir;
+	lfs_file_t fd;
+	struct lfs_info finfo;
+	char name[LFS_NAME_MAX * 2 + 1 + 1];
+	uint8_t buf[DISK_SECTOR_SIZE];
+
+	res = lfs_dir_open(lfs, &dir, path);
+	if (res != LFS_ERR_OK)
+	{
+		return res;
+	}
+	while ((res = lfs_dir_read(lfs, &dir, &finfo)) > 0)
+	{
+		if (!strcmp(finfo.name, ".") || !strcmp(finfo.name, ".."))
+		{
+			continue;
+		}
+		snprintf(name, sizeof(name), "%s/%s", path, finfo.name);
+		if (finfo.type == LFS_TYPE_DIR)
+		{
+			res = traverse_dir(lfs, name);
+			if (res < 0)
+			{
+				break;
+			}
+			continue;
+		}
+		res = lfs_file_open(lfs, &fd, name, LFS_O_RDONLY);
+		if (res != LFS_ERR_OK)
+		{
+			break;
+		}
+		while ((res = lfs_file_read(lfs, &fd, buf, sizeof(buf))) > 0);
+		lfs_file_close(lfs, &fd);
+		if (res < 0)
+		{
+			break;
+		}
+	}
+	lfs_dir_close(lfs, &dir);
+	return res;
+}
+
+//--------------------------------------------
+// The FAT volume as the host sees it right after attaching
+typedef struct
+{
+	uint8_t *fat;               // all FAT sectors
+	uint32_t fat_size;          // in sectors
+	uint32_t clusters;          // FAT entries, data clusters start at 2
+	uint8_t *claimed;           // the cluster belongs to a file or a directory
+} fat_volume_t;
+
+//--------------------------------------------
+static uint32_t fat_next(const fat_volume_t *vol, uint32_t cluster)
+{
+	uint32_t offset;
+	uint32_t value;
+
+	offset = cluster * 3 / 2;
+	value = vol->fat[offset] | vol->fat[offset + 1] << 8;
+	return (cluster & 1) ? value >> 4 : value & 0xFFF;
+}
+
+//--------------------------------------------
+// Claim the clusters of a chain up to the end of chain mark
+static int claim_chain(fat_volume_t *vol, uint32_t cluster, uint32_t *count)
+{
+	*count = 0;
+	while (cluster < 0xFF8)
+	{
+		if (cluster < 2 || cluster >= vol->clusters)
+		{
+			return POWERLOSS_ERR_CHAIN;
+		}
+		if (vol->claimed[cluster])
+		{
+			return POWERLOSS_ERR_CLAIMED;
+		}
+		vol->claimed[cluster] = 1;
+		(*count)++;
+		cluster = fat_next(vol, cluster);
+	}
+	return POWERLOSS_OK;
+}
+
+//--------------------------------------------
+static bool short_name_equals(const uint8_t *sfn, const char *name)
+{
+	char buf[8 + 1 + 3 + 1];
+	size_t len = 0;
+	size_t cnt;
+
+	for (cnt = 0; cnt < 8 && sfn[cnt] != ' '; cnt++)
+	{
+		buf[len++] = sfn[cnt];
+	}
+	if (sfn[8] != ' ')
+	{
+		buf[len++] = '.';
+		for (cnt = 8; cnt < 11 && sfn[cnt] != ' '; cnt++)
+		{
+			buf[len++] = sfn[cnt];
+		}
+	}
+	buf[len] = '\0';
+	for (cnt = 0; buf[cnt] && toupper((unsigned char)name[cnt]) == buf[cnt]; cnt++);
+	return buf[cnt] == '\0' && name[cnt] == '\0';
+}
+
+//--------------------------------------------
+// Look up a name in the rendered clusters of a directory, the root directory is cluster 1
+static bool find_fat_entry(const fat_volume_t *vol, uint32_t cluster, const char *name, fat_dir_entry_t *found)
+{
+	fat_dir_entry_t entries[DISK_SECTOR_SIZE / sizeof(fat_dir_entry_t)];
+	uint16_t lfn[LFS_NAME_MAX + 13 + 1];
+	char utf8[LFS_NAME_MAX * 3 + 1];
+	bool is_lfn = false;
+	uint32_t limit;
+	size_t cnt;
+	size_t len;
+
+	for (limit = vol->clusters; limit; limit--)
+	{
+		mimic_fat_read(0, vol->fat_size + cluster, entries, sizeof(entries));
+		for (cnt = 0; cnt < sizeof(entries) / sizeof(entries[0]); cnt++)
+		{
+			fat_dir_entry_t *entry = &entries[cnt];
+			fat_lfn_t *lfn_entry = (fat_lfn_t *)entry;
+			uint8_t order = lfn_entry->LDIR_Ord & 0x3F;
+
+			if (entry->DIR_Name[0] == 0x00)
+			{
+				return false;
+			}
+			if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Name[0] == '.' || entry->DIR_Attr == 0x08)
+			{
+				is_lfn = false;
+				continue;
+			}
+			if (entry->DIR_Attr == 0x0F)
+			{
+				if (order == 0 || order * 13 > LFS_NAME_MAX + 13)
+				{
+					is_lfn = false;
+					continue;
+				}
+				if (lfn_entry->LDIR_Ord & 0x40)
+				{
+					is_lfn = true;
+					memset(lfn, 0, sizeof(lfn));
+				}
+				memcpy(&lfn[(order - 1) * 13 + 0], lfn_entry->LDIR_Name1, sizeof(lfn_entry->LDIR_Name1));
+				memcpy(&lfn[(order - 1) * 13 + 5], lfn_entry->LDIR_Name2, sizeof(lfn_entry->LDIR_Name2));
+				memcpy(&lfn[(order - 1) * 13 + 11], lfn_entry->LDIR_Name3, sizeof(lfn_entry->LDIR_Name3));
+				continue;
+			}
+			if (is_lfn)
+			{
+				for (len = 0; len < LFS_NAME_MAX && lfn[len] != 0x0000 && lfn[len] != 0xFFFF; len++);
+				utf16le_to_utf8(utf8, sizeof(utf8), lfn, len);
+				is_lfn = false;
+				if (!strcmp(utf8, name))
+				{
+					*found = *entry;
+					return true;
+				}
+			}
+			else if (short_name_equals(entry->DIR_Name, name))
+			{
+				*found = *entry;
+				return true;
+			}
+		}
+		if (cluster == 1)
+		{
+			return false;
+		}
+		cluster = fat_next(vol, cluster);
+		if (cluster < 2 || cluster >= 0xFF8)
+		{
+			return false;
+		}
+	}
+	return false;
+}
+
+//--------------------------------------------
+// Every file and directory of littlefs has an entry in the FAT directory,
+// and the FAT chain of the entry is exactly as long as the file
+static int check_fat_dir(lfs_t *lfs, fat_volume_t *vol, const char *path, uint32_t cluster)
+{
+	int res;
+	int err = POWERLOSS_OK;
+	lfs_dir_t dir;
+	struct lfs_info finfo;
+	fat_dir_entry_t entry;
+	char name[LFS_NAME_MAX * 2 + 1 + 1];
+	uint32_t count;
+
+	res = lfs_dir_open(lfs, &dir, path);
+	if (res != LFS_ERR_OK)
+	{
+		return POWERLOSS_ERR_TRAVERSE;
+	}
+	while (err == POWERLOSS_OK && (res = lfs_dir_read(lfs, &dir, &finfo)) > 0)
+	{
+		if (!strcmp(finfo.name, ".") || !strcmp(finfo.name, ".."))
+		{
+			continue;
+		}
+		if (cluster == 1 && !strcmp(finfo.name, ".mimic"))
+		{
+			continue;
+		}
+		if (!find_fat_entry(vol, cluster, finfo.name, &entry) ||
+			(finfo.type == LFS_TYPE_DIR) != ((entry.DIR_Attr & 0x10) != 0))
+		{
+			err = POWERLOSS_ERR_ENTRY;
+			break;
+		}
+		if (finfo.type == LFS_TYPE_DIR)
+		{
+			err = entry.DIR_FstClusLO < 2 ? POWERLOSS_ERR_CHAIN : claim_chain(vol, entry.DIR_FstClusLO, &count);
+			if (err == POWERLOSS_OK)
+			{
+				snprintf(name, sizeof(name), "%s/%s", path, finfo.name);
+				err = check_fat_dir(lfs, vol, name, entry.DIR_FstClusLO);
+			}
+			continue;
+		}
+		if (entry.DIR_FileSize != finfo.size)
+		{
+			err = POWERLOSS_ERR_ENTRY;
+			break;
+		}
+		count = 0;
+		if (entry.DIR_FstClusLO)
+		{
+			err = claim_chain(vol, entry.DIR_FstClusLO, &count);
+		}
+		if (err == POWERLOSS_OK && count != (finfo.size + DISK_SECTOR_SIZE - 1) / DISK_SECTOR_SIZE)
+		{
+			err = POWERLOSS_ERR_CHAIN;
+		}
+	}
+	lfs_dir_close(lfs, &dir);
+	if (err == POWERLOSS_OK && res < 0)
+	{
+		err = POWERLOSS_ERR_TRAVERSE;
+	}
+	return err;
+}
+
+//--------------------------------------------
+static void check_and_exit(void)
+{
+	int res;
+	lfs_t lfs;
+	struct lfs_info finfo;
+	uint8_t sector[DISK_SECTOR_SIZE];
+	fat_volume_t vol;
+	uint32_t total_size;
+
+	res = lfs_mount(&lfs, config);
+	if (res != LFS_ERR_OK)
+	{
+		_exit(POWERLOSS_ERR_MOUNT);
+	}
+	res = traverse_dir(&lfs, "");
+	lfs_unmount(&lfs);
+	if (res < 0)
+	{
+		_exit(POWERLOSS_ERR_TRAVERSE);
+	}
+
+	mimic_fat_init(config);
+	mimic_fat_create_cache();
+
+	res = lfs_mount(&lfs, config);
+	if (res == LFS_ERR_OK)
+	{
+		res = lfs_stat(&lfs, ".mimic/FAT", &finfo);
+		lfs_unmount(&lfs);
+	}
+	if (res != LFS_ERR_OK)
+	{
+		_exit(POWERLOSS_ERR_CACHE);
+	}
+
+	// boot sector, FAT and directories as the host reads them right after attaching
+	mimic_fat_read(0, 0, sector, sizeof(sector));
+	vol.fat_size = sector[22] | sector[23] << 8;
+	total_size = sector[19] | sector[20] << 8;
+	if (!total_size)
+	{
+		total_size = sector[32] | sector[33] << 8 | sector[34] << 16 | (uint32_t)sector[35] << 24;
+	}
+	vol.clusters = total_size - vol.fat_size;
+	if (vol.clusters > vol.fat_size * DISK_SECTOR_SIZE * 2 / 3)
+	{
+		vol.clusters = vol.fat_size * DISK_SECTOR_SIZE * 2 / 3;
+	}
+	vol.fat = (uint8_t *)malloc((size_t)vol.fat_size * DISK_SECTOR_SIZE);
+	vol.claimed = (uint8_t *)calloc(vol.clusters, 1);
+	assert(vol.fat && vol.claimed);
+	for (uint32_t cnt = 0; cnt < vol.fat_size; cnt++)
+	{
+		mimic_fat_read(0, cnt + 1, vol.fat + cnt * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+	}
+	if (vol.fat[0] != 0xF8 || vol.fat[1] != 0xFF || vol.fat[2] != 0xFF)
+	{
+		_exit(POWERLOSS_ERR_FAT);
+	}
+
+	res = lfs_mount(&lfs, config);
+	if (res != LFS_ERR_OK)
+	{
+		_exit(POWERLOSS_ERR_MOUNT);
+	}
+	res = check_fat_dir(&lfs, &vol, "", 1);
+	lfs_unmount(&lfs);
+	free(vol.fat);
+	free(vol.claimed);
+	_exit(res);
+}
+
+//--------------------------------------------
+static void wait_child(void)
+{
+	int status;
+	pid_t pid;
+	size_t cnt;
+
+	pid = wait(&status);
+	if (pid < 0)
+	{
+		children_running = 0;
+		return;
+	}
+	for (cnt = 0; cnt < children_max; cnt++)
+	{
+		if (children[cnt].pid == pid)
+		{
+			break;
+		}
+	}
+	if (cnt == children_max)
+	{
+		return;
+	}
+	children[cnt].pid = 0;
+	children_running--;
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == POWERLOSS_OK)
+	{
+		return;
+	}
+	failed_count++;
+	if (WIFEXITED(status) && WEXITSTATUS(status) < POWERLOSS_ERR_MAX)
+	{
+		printf(ANSI_YELLOW"Power loss at operation %zu (%s): %s\r\n"ANSI_CLEAR, children[cnt].op,
+			children[cnt].cut == POWERLOSS_TEAR ? "torn" : "truncated", powerloss_errors[WEXITSTATUS(status)]);
+	}
+	else if (WIFSIGNALED(status))
+	{
+		printf(ANSI_YELLOW"Power loss at operation %zu (%s): crashed with signal %d\r\n"ANSI_CLEAR, children[cnt].op,
+			children[cnt].cut == POWERLOSS_TEAR ? "torn" : "truncated", WTERMSIG(status));
+	}
+}
+
+//--------------------------------------------
+void powerloss_start(size_t k, const struct lfs_config *cfg)
+{
+	long cpus;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	children_max = cpus > 0 ? (size_t)cpus : 1;
+	children = (powerloss_child_t *)calloc(children_max, sizeof(powerloss_child_t));
+	assert(children);
+	config = cfg;
+	interval = k;
+	printf(ANSI_YELLOW"Power loss injection at every %zu prog/erase operation, %zu processes\r\n"ANSI_CLEAR, interval, children_max);
+}
+
+//--------------------------------------------
+bool powerloss_cut(powerloss_cut_t *cut)
+{
+	pid_t pid;
+	size_t cnt;
+
+	if (!interval || is_child)
+	{
+		return false;
+	}
+	if (++op_count % interval)
+	{
+		return false;
+	}
+	while (children_running >= children_max)
+	{
+		wait_child();
+	}
+
+	*cut = (cut_count & 1) ? POWERLOSS_TEAR : POWERLOSS_TRUNCATE;
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+	{
+		printf(ANSI_YELLOW"powerloss_cut: fork failed\r\n"ANSI_CLEAR);
+		return false;
+	}
+	if (pid == 0)
+	{
+		is_child = true;
+		if (!freopen("/dev/null", "w", stdout))
+		{
+			_exit(POWERLOSS_ERR_MAX);
+		}
+		return true;
+	}
+
+	for (cnt = 0; children[cnt].pid; cnt++);
+	children[cnt].pid = pid;
+	children[cnt].op = op_count;
+	children[cnt].cut = *cut;
+	children_running++;
+	cut_count++;
+	return false;
+}
+
+//--------------------------------------------
+void powerloss_reboot(void)
+{
+	assert(is_child);
+	check_and_exit();
+}
+
+//--------------------------------------------
+void powerloss_finish(void)
+{
+	if (!interval)
+	{
+		return;
+	}
+	while (children_running)
+	{
+		wait_child();
+	}
+	interval = 0;
+	free(children);
+	printf(ANSI_YELLOW"\r\nPower loss injection: %zu operations, %zu cut points, %zu failed\r\n"ANSI_CLEAR,
+		op_count, cut_count, failed_count);
+}
+
+#else
+
+//--------------------------------------------
+void powerloss_start(size_t k, const struct lfs_config *cfg)
+{
+	(void)k;
+	(void)cfg;
+	printf(ANSI_YELLOW"Power loss injection is not supported on this platform\r\n"ANSI_CLEAR);
+}
+
+//--------------------------------------------
+bool powerloss_cut(powerloss_cut_t *cut)
+{
+	(void)cut;
+	return false;
+}
+
+//--------------------------------------------
+void powerloss_reboot(void)
+{
+}
+
+//--------------------------------------------
+void powerloss_finish(void)
+{
+}
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * Copyright (c) 2024, Vladimir Alemasov
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef POWERLOSS_H_
+#define POWERLOSS_H_
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdbool.h>    /* bool */
+#include <stddef.h>     /* size_t */
+#include "lfs.h"
+
+//--------------------------------------------
+typedef enum
+{
+	POWERLOSS_TRUNCATE,     // the interrupted operation did not reach the flash at all
+	POWERLOSS_TEAR,         // only the first half of the interrupted operation reached the flash
+} powerloss_cut_t;
+
+//--------------------------------------------
+void powerloss_start(size_t interval, const struct lfs_config *cfg);
+bool powerloss_cut(powerloss_cut_t *cut);
+void powerloss_reboot(void);
+void powerloss_finish(void);
+
+#endif /* POWERLOSS_H_ */
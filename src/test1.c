@@ -68,12 +68,12 @@ static void reload(void)
 }
 
 //--------------------------------------------
-static void check1(void)
+static bool check1(void)
 {
 	int res;
 	lfs_file_t fd;
 	struct lfs_info finfo;
-	bool eq;
+	bool eq = false;
 	uint8_t *buf_fs;
 	uint8_t *buf_pc;
 
@@ -111,15 +111,16 @@ static void check1(void)
 	{
 		printf(ANSI_YELLOW"There is no %s in littlefs. Check passed = false\r\n"ANSI_CLEAR, FILE_NAME);
 	}
+	return eq;
 }
 
 //--------------------------------------------
-static void check3(void)
+static bool check3(void)
 {
 	int res;
 	lfs_file_t fd;
 	struct lfs_info finfo;
-	bool eq;
+	bool eq = false;
 	uint8_t *buf_fs;
 	uint8_t *buf_pc;
 
@@ -157,6 +158,7 @@ static void check3(void)
 	{
 		printf(ANSI_YELLOW"There is no %s in littlefs. Check passed = false\r\n"ANSI_CLEAR, FILE_NAME);
 	}
+	return eq;
 }
 
 //--------------------------------------------
@@ -81,12 +81,12 @@ static void reload(void)
 }
 
 //--------------------------------------------
-static void check(void)
+static bool check(void)
 {
 	int res;
 	lfs_file_t fd;
 	struct lfs_info finfo;
-	bool eq;
+	bool eq = false;
 	uint8_t *buf_fs;
 	uint8_t *buf_pc;
 
@@ -124,6 +124,7 @@ static void check(void)
 	{
 		printf(ANSI_YELLOW"There is no %s in littlefs. Check passed = false\r\n"ANSI_CLEAR, FILE_NAME);
 	}
+	return eq;
 }
 
 //--------------------------------------------
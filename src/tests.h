@@ -6,6 +6,8 @@
 #ifndef TESTS_H_
 #define TESTS_H_
 
+#include <stdbool.h>    /* bool */
+
  //--------------------------------------------
 typedef struct
 {
@@ -13,7 +15,7 @@ typedef struct
 	char *file;
 	void(*littlefs_init)(void);
 	void(*littlefs_reload)(void);
-	void(*littlefs_check)(void);
+	bool(*littlefs_check)(void);   // true if the check passed
 	void(*littlefs_cleanup)(void);
 } test_t;
 
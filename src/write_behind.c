@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2024, Vladimir Alemasov
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* malloc */
+#include <stdio.h>      /* printf */
+#include <string.h>     /* memcpy */
+#include <stdbool.h>    /* bool */
+#include <assert.h>     /* assert */
+#include <time.h>       /* clock_gettime */
+#ifndef _WIN32
+#include <pthread.h>    /* pthread_create, pthread_mutex_lock ... */
+#endif
+#include "mimic_fat.h"
+#include "tests.h"
+#include "write_behind.h"
+
+//--------------------------------------------
+// Sectors written by the host are acknowledged as soon as they are queued,
+// a worker thread applies them to littlefs in order. A read, SYNCHRONIZE CACHE,
+// a reconnection or the end of the replay waits until the queue is drained,
+// a full queue makes the next sector wait for a free entry.
+// With depth 0 (and on Windows) every sector is applied before the command is acknowledged.
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t lba;
+	bool is_last;               // the last sector of its command
+	uint64_t submitted_us;      // when its command was received
+	uint8_t data[DISK_SECTOR_SIZE];
+} write_behind_entry_t;
+
+//--------------------------------------------
+static write_behind_stats_t stats;
+
+//--------------------------------------------
+static uint64_t now_us(void)
+{
+#ifndef _WIN32
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	return (uint64_t)clock() * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
+
+//--------------------------------------------
+static void account_apply(uint64_t submitted_us)
+{
+	uint64_t latency = now_us() - submitted_us;
+	stats.apply_total_us += latency;
+	if (latency > stats.apply_max_us)
+	{
+		stats.apply_max_us = latency;
+	}
+}
+
+//--------------------------------------------
+static void account_ack(uint64_t submitted_us)
+{
+	uint64_t latency = now_us() - submitted_us;
+	stats.commands++;
+	stats.ack_total_us += latency;
+	if (latency > stats.ack_max_us)
+	{
+		stats.ack_max_us = latency;
+	}
+}
+
+#ifndef _WIN32
+
+//--------------------------------------------
+static write_behind_entry_t *queue;
+static size_t queue_depth;
+static size_t queue_head;
+static size_t queue_count;
+static bool worker_stop;
+static pthread_t worker;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+
+//--------------------------------------------
+static void *worker_main(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&queue_mutex);
+	while (true)
+	{
+		while (!queue_count && !worker_stop)
+		{
+			pthread_cond_wait(&queue_not_empty, &queue_mutex);
+		}
+		if (!queue_count)
+		{
+			break;
+		}
+		// the entry stays queued while it is applied, so a barrier also waits for it
+		write_behind_entry_t *entry = &queue[queue_head];
+		pthread_mutex_unlock(&queue_mutex);
+		mimic_fat_write(0, entry->lba, entry->data, DISK_SECTOR_SIZE);
+		pthread_mutex_lock(&queue_mutex);
+		if (entry->is_last)
+		{
+			account_apply(entry->submitted_us);
+		}
+		queue_head = (queue_head + 1) % queue_depth;
+		queue_count--;
+		pthread_cond_broadcast(&queue_changed);
+	}
+	pthread_mutex_unlock(&queue_mutex);
+	return NULL;
+}
+
+//--------------------------------------------
+void write_behind_start(size_t depth)
+{
+	if (!depth)
+	{
+		return;
+	}
+	queue = (write_behind_entry_t *)calloc(depth, sizeof(write_behind_entry_t));
+	assert(queue);
+	queue_depth = depth;
+	worker_stop = false;
+	if (pthread_create(&worker, NULL, worker_main, NULL))
+	{
+		printf(ANSI_YELLOW"write_behind_start: pthread_create failed, sectors are applied synchronously\r\n"ANSI_CLEAR);
+		free(queue);
+		queue = NULL;
+		queue_depth = 0;
+	}
+}
+
+//--------------------------------------------
+void write_behind_write(uint32_t lba, const uint8_t *data, size_t sectors)
+{
+	uint64_t submitted_us = now_us();
+
+	if (!queue_depth)
+	{
+		for (size_t cnt = 0; cnt < sectors; cnt++)
+		{
+			mimic_fat_write(0, lba + cnt, (void *)(data + DISK_SECTOR_SIZE * cnt), DISK_SECTOR_SIZE);
+		}
+		stats.sectors += sectors;
+		account_apply(submitted_us);
+		account_ack(submitted_us);
+		return;
+	}
+
+	pthread_mutex_lock(&queue_mutex);
+	for (size_t cnt = 0; cnt < sectors; cnt++)
+	{
+		if (queue_count == queue_depth)
+		{
+			stats.full_waits++;
+			while (queue_count == queue_depth)
+			{
+				pthread_cond_wait(&queue_changed, &queue_mutex);
+			}
+		}
+		write_behind_entry_t *entry = &queue[(queue_head + queue_count) % queue_depth];
+		entry->lba = lba + cnt;
+		entry->is_last = cnt == sectors - 1;
+		entry->submitted_us = submitted_us;
+		memcpy(entry->data, data + DISK_SECTOR_SIZE * cnt, DISK_SECTOR_SIZE);
+		queue_count++;
+		pthread_cond_signal(&queue_not_empty);
+	}
+	stats.sectors += sectors;
+	account_ack(submitted_us);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+//--------------------------------------------
+void write_behind_barrier(void)
+{
+	if (!queue_depth)
+	{
+		return;
+	}
+	pthread_mutex_lock(&queue_mutex);
+	if (queue_count)
+	{
+		stats.barriers++;
+		while (queue_count)
+		{
+			pthread_cond_wait(&queue_changed, &queue_mutex);
+		}
+	}
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+//--------------------------------------------
+void write_behind_finish(void)
+{
+	if (!queue_depth)
+	{
+		return;
+	}
+	write_behind_barrier();
+	pthread_mutex_lock(&queue_mutex);
+	worker_stop = true;
+	pthread_cond_signal(&queue_not_empty);
+	pthread_mutex_unlock(&queue_mutex);
+	pthread_join(worker, NULL);
+	free(queue);
+	queue = NULL;
+	queue_depth = 0;
+}
+
+//--------------------------------------------
+void write_behind_stats(write_behind_stats_t *result)
+{
+	pthread_mutex_lock(&queue_mutex);
+	*result = stats;
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+#else
+
+//--------------------------------------------
+void write_behind_start(size_t depth)
+{
+	if (depth)
+	{
+		printf(ANSI_YELLOW"Write-behind is not supported on this platform, sectors are applied synchronously\r\n"ANSI_CLEAR);
+	}
+}
+
+//--------------------------------------------
+void write_behind_write(uint32_t lba, const uint8_t *data, size_t sectors)
+{
+	uint64_t submitted_us = now_us();
+
+	for (size_t cnt = 0; cnt < sectors; cnt++)
+	{
+		mimic_fat_write(0, lba + cnt, (void *)(data + DISK_SECTOR_SIZE * cnt), DISK_SECTOR_SIZE);
+	}
+	stats.sectors += sectors;
+	account_apply(submitted_us);
+	account_ack(submitted_us);
+}
+
+//--------------------------------------------
+void write_behind_barrier(void)
+{
+}
+
+//--------------------------------------------
+void write_behind_finish(void)
+{
+}
+
+//--------------------------------------------
+void write_behind_stats(write_behind_stats_t *result)
+{
+	*result = stats;
+}
+
+#endif
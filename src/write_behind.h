@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2024, Vladimir Alemasov
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef WRITE_BEHIND_H_
+#define WRITE_BEHIND_H_
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stddef.h>     /* size_t */
+
+//--------------------------------------------
+typedef struct
+{
+	size_t commands;            // WRITE(10) commands
+	size_t sectors;
+	uint64_t ack_total_us;      // from the command to the moment the host could get its status
+	uint64_t ack_max_us;
+	uint64_t apply_total_us;    // from the command to the moment its last sector is in littlefs
+	uint64_t apply_max_us;
+	size_t barriers;            // waits for the queue to drain
+	size_t full_waits;          // waits for a free queue entry
+} write_behind_stats_t;
+
+//--------------------------------------------
+void write_behind_start(size_t depth);
+void write_behind_write(uint32_t lba, const uint8_t *data, size_t sectors);
+void write_behind_barrier(void);
+void write_behind_finish(void);
+void write_behind_stats(write_behind_stats_t *stats);
+
+#endif /* WRITE_BEHIND_H_ */